@@ -0,0 +1,1108 @@
+// AzureFileBenchmark.cpp : Measures the console's transfer commands against a local stand-in
+// for the Azure Files REST API.
+//
+
+#include "stdafx.h"
+#include "AzureFileConsole.h"
+
+#include <random>
+#include "cpprest/http_listener.h"
+
+namespace AzureFileConsole
+{
+    using namespace web;
+    using namespace web::http;
+    using namespace web::http::experimental::listener;
+
+    // Serves the subset of the Azure Files REST API that the console uses from memory: share and
+    // directory listing, share, directory and file properties, creating and deleting directories,
+    // creating, resizing and deleting files, and putting, getting and listing ranges. Requests
+    // are not authenticated. Every reply can be held back by a fixed latency and by a bandwidth
+    // cap shared by all requests, and a fraction of requests can be answered with 503 to
+    // exercise the client's retries.
+    class AzureFileStandIn
+    {
+    public:
+        struct Options
+        {
+            Options()
+                : latency(0), bandwidth(0), throttleRate(0.0), maxResults(5000)
+            {
+            }
+
+            chrono::milliseconds latency;
+
+            // Bytes per second through the shared link, or 0 for no limit.
+            uint64_t bandwidth;
+
+            // Fraction of requests answered with 503 Server Busy.
+            double throttleRate;
+
+            size_t maxResults;
+        };
+
+        struct OperationStats
+        {
+            string_t name;
+            size_t count;
+            double p50;
+            double p99;
+        };
+
+        AzureFileStandIn(const string_t& address, const Options& options)
+            : m_address(address), m_options(options), m_listener(uri(address)), m_random(random_device()()), m_next_version(1), m_next_request_id(1), m_stopping(false)
+        {
+            m_listener.support([this](http_request request)
+            {
+                Handle(request);
+            });
+        }
+
+        ~AzureFileStandIn()
+        {
+            Close();
+        }
+
+        void Open()
+        {
+            m_delayer = thread([this]()
+            {
+                RunDelayed();
+            });
+
+            m_listener.open().wait();
+        }
+
+        void Close()
+        {
+            if (!m_delayer.joinable())
+            {
+                return;
+            }
+
+            m_listener.close().wait();
+
+            {
+                lock_guard<mutex> lock(m_delay_mutex);
+                m_stopping = true;
+                m_delay_changed.notify_all();
+            }
+
+            m_delayer.join();
+        }
+
+        // An account whose file endpoint points at the stand-in. The key is never checked.
+        cloud_storage_account Account() const
+        {
+            storage_uri endpoint(uri(m_address + _XPLATSTR("/") + AccountName()));
+            return cloud_storage_account(storage_credentials(AccountName(), _XPLATSTR("ZGV2c3RvcmU=")), storage_uri(), storage_uri(), storage_uri(), endpoint);
+        }
+
+        void CreateShare(const string_t& name)
+        {
+            lock_guard<mutex> lock(m_store_mutex);
+            m_shares[name] = NewNode(true);
+        }
+
+        void DeleteShare(const string_t& name)
+        {
+            lock_guard<mutex> lock(m_store_mutex);
+            m_shares.erase(name);
+        }
+
+        // Per operation latency, from the arrival of the request to its reply, in milliseconds.
+        vector<OperationStats> Stats() const
+        {
+            vector<OperationStats> result;
+            lock_guard<mutex> lock(m_stats_mutex);
+
+            for (auto& operation : m_latencies)
+            {
+                vector<double> latencies = operation.second;
+                std::sort(latencies.begin(), latencies.end());
+
+                OperationStats stats;
+                stats.name = operation.first;
+                stats.count = latencies.size();
+                stats.p50 = latencies[(latencies.size() - 1) / 2];
+                stats.p99 = latencies[(latencies.size() - 1) * 99 / 100];
+                result.push_back(stats);
+            }
+
+            return result;
+        }
+
+        void ResetStats()
+        {
+            lock_guard<mutex> lock(m_stats_mutex);
+            m_latencies.clear();
+        }
+
+        static string_t AccountName()
+        {
+            return _XPLATSTR("devstoreaccount1");
+        }
+
+    private:
+
+        struct Node
+        {
+            bool isDirectory;
+            map<string_t, shared_ptr<Node>> children;
+            vector<uint8_t> data;
+            uint64_t version;
+            utility::datetime modified;
+
+            // Guards the data, version and modified time of a file; the tree itself is guarded by the store lock.
+            mutex dataMutex;
+        };
+
+        struct Reply
+        {
+            Reply(const string_t& operation, status_code status)
+                : operation(operation), response(status), bytes(0)
+            {
+            }
+
+            string_t operation;
+            http_response response;
+            size_t bytes;
+        };
+
+        struct Delayed
+        {
+            chrono::steady_clock::time_point due;
+            uint64_t sequence;
+            function<void()> action;
+
+            bool operator<(const Delayed& other) const
+            {
+                return due != other.due ? due > other.due : sequence > other.sequence;
+            }
+        };
+
+        static const size_t PageSize = 512;
+
+        void Handle(http_request request)
+        {
+            chrono::steady_clock::time_point arrived = chrono::steady_clock::now();
+
+            if (Throttle())
+            {
+                Send(request, Error(_XPLATSTR("Throttled"), status_codes::ServiceUnavailable, _XPLATSTR("ServerBusy")), 0, arrived);
+                return;
+            }
+
+            request.extract_vector().then([this, request, arrived](pplx::task<vector<unsigned char>> body)
+            {
+                try
+                {
+                    vector<unsigned char> content = body.get();
+                    Send(request, Dispatch(request, content), content.size(), arrived);
+                }
+                catch (const std::exception& e)
+                {
+                    Send(request, Error(_XPLATSTR("Failed"), status_codes::InternalError, conversions::to_string_t(e.what())), 0, arrived);
+                }
+            });
+        }
+
+        bool Throttle()
+        {
+            if (m_options.throttleRate <= 0.0)
+            {
+                return false;
+            }
+
+            lock_guard<mutex> lock(m_random_mutex);
+            return uniform_real_distribution<double>(0.0, 1.0)(m_random) < m_options.throttleRate;
+        }
+
+        Reply Dispatch(const http_request& request, const vector<unsigned char>& body)
+        {
+            vector<string_t> segments = uri::split_path(request.relative_uri().path());
+            map<string_t, string_t> query = uri::split_query(request.relative_uri().query());
+            string_t method = request.method();
+            string_t restype = Query(query, _XPLATSTR("restype"));
+            string_t comp = Query(query, _XPLATSTR("comp"));
+
+            for (auto& segment : segments)
+            {
+                segment = uri::decode(segment);
+            }
+
+            if (segments.empty() || segments[0] != AccountName())
+            {
+                return Error(_XPLATSTR("Unknown"), status_codes::BadRequest, _XPLATSTR("InvalidUri"));
+            }
+
+            segments.erase(segments.begin());
+
+            if (segments.empty())
+            {
+                if (method == methods::GET && comp == _XPLATSTR("list"))
+                {
+                    return ListShares(query);
+                }
+
+                return Error(_XPLATSTR("Unknown"), status_codes::BadRequest, _XPLATSTR("UnsupportedHttpVerb"));
+            }
+
+            unique_lock<mutex> lock(m_store_mutex);
+            auto share = m_shares.find(segments[0]);
+
+            if (share == m_shares.end())
+            {
+                return Error(_XPLATSTR("Unknown"), status_codes::NotFound, _XPLATSTR("ShareNotFound"));
+            }
+
+            if (restype == _XPLATSTR("share"))
+            {
+                return Properties(_XPLATSTR("GetShareProperties"), *share->second, method == methods::HEAD);
+            }
+
+            vector<string_t> path(segments.begin() + 1, segments.end());
+
+            if (restype == _XPLATSTR("directory"))
+            {
+                return DirectoryOperation(share->second, path, method, comp, query, lock);
+            }
+
+            return FileOperation(share->second, path, request, comp, body, lock);
+        }
+
+        Reply DirectoryOperation(const shared_ptr<Node>& root, const vector<string_t>& path, const string_t& method, const string_t& comp, const map<string_t, string_t>& query, unique_lock<mutex>& storeLock)
+        {
+            if (method == methods::PUT)
+            {
+                shared_ptr<Node> parent = path.empty() ? nullptr : Find(root, path, path.size() - 1);
+
+                if (!parent || !parent->isDirectory)
+                {
+                    return Error(_XPLATSTR("CreateDirectory"), status_codes::NotFound, _XPLATSTR("ParentNotFound"));
+                }
+
+                if (parent->children.count(path.back()))
+                {
+                    return Error(_XPLATSTR("CreateDirectory"), status_codes::Conflict, _XPLATSTR("ResourceAlreadyExists"));
+                }
+
+                shared_ptr<Node> directory = NewNode(true);
+                parent->children[path.back()] = directory;
+                return Properties(_XPLATSTR("CreateDirectory"), *directory, true, status_codes::Created);
+            }
+
+            shared_ptr<Node> directory = Find(root, path, path.size());
+
+            if (!directory || !directory->isDirectory)
+            {
+                return Error(_XPLATSTR("Directory"), status_codes::NotFound, _XPLATSTR("ResourceNotFound"));
+            }
+
+            if (method == methods::DEL)
+            {
+                if (path.empty())
+                {
+                    return Error(_XPLATSTR("DeleteDirectory"), status_codes::BadRequest, _XPLATSTR("InvalidUri"));
+                }
+
+                if (!directory->children.empty())
+                {
+                    return Error(_XPLATSTR("DeleteDirectory"), status_codes::Conflict, _XPLATSTR("DirectoryNotEmpty"));
+                }
+
+                Find(root, path, path.size() - 1)->children.erase(path.back());
+                return Reply(_XPLATSTR("DeleteDirectory"), status_codes::Accepted);
+            }
+
+            if (comp == _XPLATSTR("list"))
+            {
+                return ListDirectory(*directory, query, storeLock);
+            }
+
+            return Properties(_XPLATSTR("GetDirectoryProperties"), *directory, method == methods::HEAD);
+        }
+
+        // Only the lookup and changes to the tree hold the store lock; the data of a file is read and
+        // written under its own lock, so ranges of different files are copied side by side.
+        Reply FileOperation(const shared_ptr<Node>& root, const vector<string_t>& path, const http_request& request, const string_t& comp, const vector<unsigned char>& body, unique_lock<mutex>& storeLock)
+        {
+            string_t method = request.method();
+
+            if (path.empty())
+            {
+                return Error(_XPLATSTR("File"), status_codes::BadRequest, _XPLATSTR("InvalidUri"));
+            }
+
+            if (method == methods::PUT && comp.empty())
+            {
+                shared_ptr<Node> parent = Find(root, path, path.size() - 1);
+
+                if (!parent || !parent->isDirectory)
+                {
+                    return Error(_XPLATSTR("CreateFile"), status_codes::NotFound, _XPLATSTR("ParentNotFound"));
+                }
+
+                size_t length = static_cast<size_t>(stoull(Header(request, _XPLATSTR("x-ms-content-length"), _XPLATSTR("0"))));
+                shared_ptr<Node> file = NewNode(false);
+
+                // The file is locked before it is published, so no request sees it before it has its length.
+                lock_guard<mutex> fileLock(file->dataMutex);
+                parent->children[path.back()] = file;
+                storeLock.unlock();
+
+                file->data.resize(length);
+                return Properties(_XPLATSTR("CreateFile"), *file, true, status_codes::Created);
+            }
+
+            shared_ptr<Node> file = Find(root, path, path.size());
+
+            if (!file || file->isDirectory)
+            {
+                return Error(_XPLATSTR("File"), status_codes::NotFound, _XPLATSTR("ResourceNotFound"));
+            }
+
+            if (method == methods::DEL)
+            {
+                Find(root, path, path.size() - 1)->children.erase(path.back());
+                return Reply(_XPLATSTR("DeleteFile"), status_codes::Accepted);
+            }
+
+            storeLock.unlock();
+            lock_guard<mutex> fileLock(file->dataMutex);
+
+            if (method == methods::PUT && comp == _XPLATSTR("range"))
+            {
+                uint64_t start = 0;
+                uint64_t end = 0;
+
+                if (!ParseRange(Header(request, _XPLATSTR("x-ms-range"), string_t()), start, end) || end >= file->data.size())
+                {
+                    return Error(_XPLATSTR("PutRange"), status_codes::RangeNotSatisfiable, _XPLATSTR("InvalidRange"));
+                }
+
+                if (Header(request, _XPLATSTR("x-ms-write"), _XPLATSTR("update")) == _XPLATSTR("clear"))
+                {
+                    std::fill(file->data.begin() + start, file->data.begin() + end + 1, 0);
+                }
+                else if (body.size() != end - start + 1)
+                {
+                    return Error(_XPLATSTR("PutRange"), status_codes::BadRequest, _XPLATSTR("InvalidHeaderValue"));
+                }
+                else
+                {
+                    std::copy(body.begin(), body.end(), file->data.begin() + start);
+                }
+
+                Touch(*file);
+                return Properties(_XPLATSTR("PutRange"), *file, true, status_codes::Created);
+            }
+
+            if (method == methods::PUT && comp == _XPLATSTR("properties"))
+            {
+                if (request.headers().has(_XPLATSTR("x-ms-content-length")))
+                {
+                    file->data.resize(static_cast<size_t>(stoull(Header(request, _XPLATSTR("x-ms-content-length"), _XPLATSTR("0")))));
+                }
+
+                Touch(*file);
+                return Properties(_XPLATSTR("SetFileProperties"), *file, true);
+            }
+
+            if (method == methods::GET && comp == _XPLATSTR("rangelist"))
+            {
+                return ListRanges(*file);
+            }
+
+            if (method == methods::GET)
+            {
+                return GetFile(request, *file);
+            }
+
+            return Properties(_XPLATSTR("GetFileProperties"), *file, true);
+        }
+
+        Reply ListShares(const map<string_t, string_t>& query)
+        {
+            lock_guard<mutex> lock(m_store_mutex);
+            string_t marker = Query(query, _XPLATSTR("marker"));
+            size_t maxResults = MaxResults(query);
+            stringstream_t xml;
+            size_t count = 0;
+
+            xml << _XPLATSTR("<?xml version=\"1.0\" encoding=\"utf-8\"?><EnumerationResults ServiceEndpoint=\"") << m_address << _XPLATSTR("/\"><Shares>");
+
+            auto it = m_shares.lower_bound(marker);
+
+            for (; it != m_shares.end() && count < maxResults; ++it, ++count)
+            {
+                xml << _XPLATSTR("<Share><Name>") << Escape(it->first) << _XPLATSTR("</Name><Properties><Last-Modified>")
+                    << it->second->modified.to_string(utility::datetime::RFC_1123) << _XPLATSTR("</Last-Modified><Etag>")
+                    << ETag(*it->second) << _XPLATSTR("</Etag><Quota>5120</Quota></Properties></Share>");
+            }
+
+            xml << _XPLATSTR("</Shares><NextMarker>") << (it != m_shares.end() ? Escape(it->first) : string_t()) << _XPLATSTR("</NextMarker></EnumerationResults>");
+            return Xml(_XPLATSTR("ListShares"), xml.str());
+        }
+
+        // Takes the page of entries under the store lock and reads the file lengths after releasing
+        // it, so a listing does not wait on range copies while holding up the whole store.
+        Reply ListDirectory(const Node& directory, const map<string_t, string_t>& query, unique_lock<mutex>& storeLock)
+        {
+            string_t marker = Query(query, _XPLATSTR("marker"));
+            size_t maxResults = MaxResults(query);
+            vector<pair<string_t, shared_ptr<Node>>> entries;
+            stringstream_t xml;
+
+            auto it = directory.children.lower_bound(marker);
+
+            for (; it != directory.children.end() && entries.size() < maxResults; ++it)
+            {
+                entries.push_back(*it);
+            }
+
+            string_t nextMarker = it != directory.children.end() ? it->first : string_t();
+            storeLock.unlock();
+
+            xml << _XPLATSTR("<?xml version=\"1.0\" encoding=\"utf-8\"?><EnumerationResults ServiceEndpoint=\"") << m_address << _XPLATSTR("/\"><Entries>");
+
+            for (auto& entry : entries)
+            {
+                if (entry.second->isDirectory)
+                {
+                    xml << _XPLATSTR("<Directory><Name>") << Escape(entry.first) << _XPLATSTR("</Name><Properties /></Directory>");
+                }
+                else
+                {
+                    lock_guard<mutex> fileLock(entry.second->dataMutex);
+                    xml << _XPLATSTR("<File><Name>") << Escape(entry.first) << _XPLATSTR("</Name><Properties><Content-Length>")
+                        << entry.second->data.size() << _XPLATSTR("</Content-Length></Properties></File>");
+                }
+            }
+
+            xml << _XPLATSTR("</Entries><NextMarker>") << Escape(nextMarker) << _XPLATSTR("</NextMarker></EnumerationResults>");
+            return Xml(_XPLATSTR("ListDirectory"), xml.str());
+        }
+
+        // Reports every run of pages that holds a non-zero byte, which is what the service
+        // reports for a file whose cleared ranges were never written.
+        Reply ListRanges(const Node& file)
+        {
+            stringstream_t xml;
+            size_t size = file.data.size();
+            size_t start = 0;
+            bool inRange = false;
+
+            xml << _XPLATSTR("<?xml version=\"1.0\" encoding=\"utf-8\"?><Ranges>");
+
+            for (size_t page = 0; page < size; page += PageSize)
+            {
+                size_t end = (std::min)(page + PageSize, size);
+                bool hasData = std::find_if(file.data.begin() + page, file.data.begin() + end, [](uint8_t b) { return b != 0; }) != file.data.begin() + end;
+
+                if (hasData && !inRange)
+                {
+                    start = page;
+                    inRange = true;
+                }
+                else if (!hasData && inRange)
+                {
+                    xml << _XPLATSTR("<Range><Start>") << start << _XPLATSTR("</Start><End>") << page - 1 << _XPLATSTR("</End></Range>");
+                    inRange = false;
+                }
+            }
+
+            if (inRange)
+            {
+                xml << _XPLATSTR("<Range><Start>") << start << _XPLATSTR("</Start><End>") << size - 1 << _XPLATSTR("</End></Range>");
+            }
+
+            xml << _XPLATSTR("</Ranges>");
+
+            Reply reply = Xml(_XPLATSTR("ListRanges"), xml.str());
+            reply.response.headers().add(_XPLATSTR("ETag"), ETag(file));
+            reply.response.headers().add(_XPLATSTR("Last-Modified"), file.modified.to_string(utility::datetime::RFC_1123));
+            reply.response.headers().add(_XPLATSTR("x-ms-content-length"), conversions::to_string_t(to_string(size)));
+            return reply;
+        }
+
+        Reply GetFile(const http_request& request, const Node& file)
+        {
+            string_t range = Header(request, _XPLATSTR("x-ms-range"), Header(request, _XPLATSTR("Range"), string_t()));
+            uint64_t start = 0;
+            uint64_t end = file.data.empty() ? 0 : file.data.size() - 1;
+            bool partial = !range.empty();
+
+            if (partial && (!ParseRange(range, start, end) || start >= file.data.size()))
+            {
+                return Error(_XPLATSTR("GetRange"), status_codes::RangeNotSatisfiable, _XPLATSTR("InvalidRange"));
+            }
+
+            end = (std::min)(end, static_cast<uint64_t>(file.data.size() - 1));
+
+            Reply reply = Properties(partial ? _XPLATSTR("GetRange") : _XPLATSTR("GetFile"), file, false, partial ? status_codes::PartialContent : status_codes::OK);
+            vector<unsigned char> data;
+
+            if (!file.data.empty())
+            {
+                data.assign(file.data.begin() + start, file.data.begin() + end + 1);
+            }
+
+            if (partial)
+            {
+                stringstream_t contentRange;
+                contentRange << _XPLATSTR("bytes ") << start << _XPLATSTR("-") << end << _XPLATSTR("/") << file.data.size();
+                reply.response.headers().add(_XPLATSTR("Content-Range"), contentRange.str());
+            }
+
+            reply.bytes = data.size();
+            reply.response.set_body(move(data));
+            reply.response.headers()[_XPLATSTR("Content-Type")] = _XPLATSTR("application/octet-stream");
+            return reply;
+        }
+
+        Reply Properties(const string_t& operation, const Node& node, bool headersOnly, status_code status = status_codes::OK)
+        {
+            Reply reply(operation, status);
+            reply.response.headers().add(_XPLATSTR("ETag"), ETag(node));
+            reply.response.headers().add(_XPLATSTR("Last-Modified"), node.modified.to_string(utility::datetime::RFC_1123));
+
+            if (!node.isDirectory)
+            {
+                reply.response.headers().add(_XPLATSTR("x-ms-type"), _XPLATSTR("File"));
+
+                if (headersOnly)
+                {
+                    reply.response.headers().add(_XPLATSTR("Content-Length"), conversions::to_string_t(to_string(node.data.size())));
+                }
+            }
+
+            return reply;
+        }
+
+        Reply Error(const string_t& operation, status_code status, const string_t& code)
+        {
+            Reply reply(operation, status);
+            reply.response.headers().add(_XPLATSTR("x-ms-error-code"), code);
+            reply.response.set_body(_XPLATSTR("<?xml version=\"1.0\" encoding=\"utf-8\"?><Error><Code>") + code + _XPLATSTR("</Code><Message>") + code + _XPLATSTR("</Message></Error>"), _XPLATSTR("application/xml"));
+            return reply;
+        }
+
+        Reply Xml(const string_t& operation, const string_t& body)
+        {
+            Reply reply(operation, status_codes::OK);
+            reply.bytes = body.size();
+            reply.response.set_body(body, _XPLATSTR("application/xml"));
+            return reply;
+        }
+
+        // Holds the reply back by the configured latency, and by the time its bytes take through
+        // a link shared with every other request.
+        void Send(const http_request& request, Reply reply, size_t requestBytes, chrono::steady_clock::time_point arrived)
+        {
+            chrono::steady_clock::time_point due = arrived + m_options.latency;
+            lock_guard<mutex> lock(m_delay_mutex);
+            uint64_t requestId = m_next_request_id++;
+
+            reply.response.headers().add(_XPLATSTR("x-ms-version"), _XPLATSTR("2015-04-05"));
+            reply.response.headers().add(_XPLATSTR("x-ms-request-id"), conversions::to_string_t(to_string(requestId)));
+            reply.response.headers().add(_XPLATSTR("Date"), utility::datetime::utc_now().to_string(utility::datetime::RFC_1123));
+
+            if (m_options.bandwidth > 0)
+            {
+                chrono::nanoseconds transfer(static_cast<int64_t>((requestBytes + reply.bytes) * 1000000000.0 / m_options.bandwidth));
+                m_link_free = (std::max)(m_link_free, chrono::steady_clock::now()) + chrono::duration_cast<chrono::steady_clock::duration>(transfer);
+                due = (std::max)(due, m_link_free);
+            }
+
+            string_t operation = reply.operation;
+            http_response response = reply.response;
+
+            Delayed delayed;
+            delayed.due = due;
+            delayed.sequence = requestId;
+            delayed.action = [this, request, response, operation, arrived]()
+            {
+                request.reply(response).then([](pplx::task<void> replied)
+                {
+                    try
+                    {
+                        replied.get();
+                    }
+                    catch (...)
+                    {
+                        // The client went away; nothing to do.
+                    }
+                });
+
+                Record(operation, arrived);
+            };
+
+            m_delayed.push(delayed);
+            m_delay_changed.notify_all();
+        }
+
+        void RunDelayed()
+        {
+            unique_lock<mutex> lock(m_delay_mutex);
+
+            while (!m_stopping)
+            {
+                if (m_delayed.empty())
+                {
+                    m_delay_changed.wait(lock);
+                    continue;
+                }
+
+                if (m_delayed.top().due > chrono::steady_clock::now())
+                {
+                    m_delay_changed.wait_until(lock, m_delayed.top().due);
+                    continue;
+                }
+
+                function<void()> action = m_delayed.top().action;
+                m_delayed.pop();
+
+                lock.unlock();
+                action();
+                lock.lock();
+            }
+        }
+
+        void Record(const string_t& operation, chrono::steady_clock::time_point arrived)
+        {
+            double latency = chrono::duration<double, milli>(chrono::steady_clock::now() - arrived).count();
+
+            lock_guard<mutex> lock(m_stats_mutex);
+            m_latencies[operation].push_back(latency);
+        }
+
+        shared_ptr<Node> Find(const shared_ptr<Node>& root, const vector<string_t>& path, size_t depth)
+        {
+            shared_ptr<Node> node = root;
+
+            for (size_t i = 0; i < depth && node; i++)
+            {
+                auto child = node->children.find(path[i]);
+                node = child != node->children.end() ? child->second : nullptr;
+            }
+
+            return node;
+        }
+
+        shared_ptr<Node> NewNode(bool isDirectory)
+        {
+            shared_ptr<Node> node = make_shared<Node>();
+            node->isDirectory = isDirectory;
+            Touch(*node);
+            return node;
+        }
+
+        void Touch(Node& node)
+        {
+            node.version = m_next_version++;
+            node.modified = utility::datetime::utc_now();
+        }
+
+        size_t MaxResults(const map<string_t, string_t>& query) const
+        {
+            string_t value = Query(query, _XPLATSTR("maxresults"));
+            return value.empty() ? m_options.maxResults : (std::min)(static_cast<size_t>(stoul(value)), m_options.maxResults);
+        }
+
+        static string_t ETag(const Node& node)
+        {
+            stringstream_t etag;
+            etag << _XPLATSTR("\"0x") << std::hex << node.version << _XPLATSTR("\"");
+            return etag.str();
+        }
+
+        static bool ParseRange(const string_t& range, uint64_t& start, uint64_t& end)
+        {
+            const string_t prefix = _XPLATSTR("bytes=");
+            size_t dash = range.find(_XPLATSTR('-'));
+
+            if (range.compare(0, prefix.size(), prefix) != 0 || dash == string_t::npos || dash + 1 >= range.size())
+            {
+                return false;
+            }
+
+            start = stoull(range.substr(prefix.size(), dash - prefix.size()));
+            end = stoull(range.substr(dash + 1));
+            return start <= end;
+        }
+
+        static string_t Query(const map<string_t, string_t>& query, const string_t& name)
+        {
+            auto it = query.find(name);
+            return it != query.end() ? uri::decode(it->second) : string_t();
+        }
+
+        static string_t Header(const http_request& request, const string_t& name, const string_t& fallback)
+        {
+            auto it = request.headers().find(name);
+            return it != request.headers().end() ? it->second : fallback;
+        }
+
+        static string_t Escape(const string_t& text)
+        {
+            string_t result;
+
+            for (auto c : text)
+            {
+                switch (c)
+                {
+                case _XPLATSTR('&'): result.append(_XPLATSTR("&amp;")); break;
+                case _XPLATSTR('<'): result.append(_XPLATSTR("&lt;")); break;
+                case _XPLATSTR('>'): result.append(_XPLATSTR("&gt;")); break;
+                case _XPLATSTR('"'): result.append(_XPLATSTR("&quot;")); break;
+                default: result.push_back(c); break;
+                }
+            }
+
+            return result;
+        }
+
+        string_t m_address;
+        Options m_options;
+        http_listener m_listener;
+
+        mutex m_random_mutex;
+        mt19937 m_random;
+
+        mutex m_store_mutex;
+        map<string_t, shared_ptr<Node>> m_shares;
+        atomic<uint64_t> m_next_version;
+
+        mutex m_delay_mutex;
+        condition_variable m_delay_changed;
+        priority_queue<Delayed> m_delayed;
+        chrono::steady_clock::time_point m_link_free;
+        uint64_t m_next_request_id;
+        bool m_stopping;
+        thread m_delayer;
+
+        mutable mutex m_stats_mutex;
+        map<string_t, vector<double>> m_latencies;
+    };
+
+    // Drives the console commands over a synthetic local tree and reports throughput for each
+    // phase, followed by the stand-in's latency for every operation the phase issued. Each phase
+    // is a single command, so it runs at the command's own concurrency. The local trees are
+    // removed when the scenario ends.
+    class Benchmark
+    {
+    public:
+        struct Scenario
+        {
+            string_t name;
+            size_t directories;
+            size_t filesPerDirectory;
+            size_t fileSize;
+        };
+
+        Benchmark(AzureFileStandIn& stand_in, const string_t& data_path, const string_t& options)
+            : m_stand_in(stand_in), m_data_path(data_path), m_options(options), m_file_system(FileSystemFactory::CreateFileSystem())
+        {
+        }
+
+        void Run(const Scenario& scenario)
+        {
+            string_t localRoot = m_data_path + _XPLATSTR("/") + scenario.name;
+            string_t downloadRoot = localRoot + _XPLATSTR(".download");
+            string_t listPath = localRoot + _XPLATSTR(".list");
+            uint64_t bytes = static_cast<uint64_t>(scenario.directories) * scenario.filesPerDirectory * scenario.fileSize;
+            size_t files = scenario.directories * scenario.filesPerDirectory;
+
+            ucout << endl << scenario.name << _XPLATSTR(": ") << files << _XPLATSTR(" files of ") << scenario.fileSize << _XPLATSTR(" bytes in ")
+                << scenario.directories << _XPLATSTR(" directories") << endl;
+
+            MakeDirectory(m_data_path);
+            Generate(localRoot, scenario);
+            MakeDirectory(downloadRoot);
+            m_stand_in.CreateShare(scenario.name);
+
+            AzureFileContext context(m_stand_in.Account());
+            Execute(context, _XPLATSTR("cd ") + scenario.name);
+
+            Measure(_XPLATSTR("upload"), files, bytes, [&]()
+            {
+                Execute(context, _XPLATSTR("upload ") + localRoot + m_options);
+            });
+
+            Measure(_XPLATSTR("dir -r"), files, 0, [&]()
+            {
+                Execute(context, _XPLATSTR("dir -r") + m_options);
+            });
+
+            Measure(_XPLATSTR("find -out"), files, 0, [&]()
+            {
+                Execute(context, _XPLATSTR("find tree -out ") + listPath + m_options);
+            });
+
+            Measure(_XPLATSTR("download -from"), files, bytes, [&]()
+            {
+                Execute(context, _XPLATSTR("download -from ") + listPath + _XPLATSTR(" ") + downloadRoot + m_options);
+            });
+
+            Measure(_XPLATSTR("delete"), files, 0, [&]()
+            {
+                Execute(context, _XPLATSTR("delete tree"));
+            });
+
+            m_stand_in.DeleteShare(scenario.name);
+
+            RemoveTree(localRoot);
+            RemoveTree(downloadRoot);
+            RemoveLocalFile(listPath);
+            RemoveEmptyDirectory(m_data_path);
+        }
+
+    private:
+
+        void Measure(const string_t& phase, size_t files, uint64_t bytes, const function<void()>& action)
+        {
+            m_stand_in.ResetStats();
+            TransferMetrics::Instance().Reset();
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+            action();
+
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+            ucout << _XPLATSTR("  ") << phase << _XPLATSTR(": ") << seconds << _XPLATSTR(" s, ") << files / seconds << _XPLATSTR(" files/s");
+
+            if (bytes > 0)
+            {
+                ucout << _XPLATSTR(", ") << bytes / seconds / (1024 * 1024) << _XPLATSTR(" MB/s");
+            }
+
+            ucout << endl;
+
+            for (auto& stats : m_stand_in.Stats())
+            {
+                ucout << _XPLATSTR("    server ") << stats.name << _XPLATSTR(": ") << stats.count << _XPLATSTR(" requests, p50 ")
+                    << stats.p50 << _XPLATSTR(" ms, p99 ") << stats.p99 << _XPLATSTR(" ms") << endl;
+            }
+
+            // Client latency well above the server's means the time goes in the client or on the wire.
+            TransferMetrics::Snapshot client = TransferMetrics::Instance().Take();
+
+            for (size_t op = 0; op < TransferMetrics::OperationCount; op++)
+            {
+                const TransferMetrics::Summary& summary = client.operations[op];
+
+                if (summary.completed > 0)
+                {
+                    ucout << _XPLATSTR("    client ") << TransferMetrics::Name(static_cast<TransferMetrics::Operation>(op)) << _XPLATSTR(": ") << summary.completed
+                        << _XPLATSTR(" calls, ") << summary.retries << _XPLATSTR(" retries, p50 ") << summary.Percentile(0.50)
+                        << _XPLATSTR(" ms, p99 ") << summary.Percentile(0.99) << _XPLATSTR(" ms") << endl;
+                }
+            }
+        }
+
+        // Runs a command with its output suppressed, so only the measurements are printed.
+        void Execute(AzureFileContext& context, const string_t& line)
+        {
+            shared_ptr<ICommand> command = CommandFactory::Create(line, context, m_file_system);
+            auto* output = ucout.rdbuf(nullptr);
+
+            try
+            {
+                command->PreExecute();
+                command->Execute();
+                command->PostExecute();
+            }
+            catch (...)
+            {
+                ucout.rdbuf(output);
+                ucout.clear();
+                throw;
+            }
+
+            ucout.rdbuf(output);
+            ucout.clear();
+        }
+
+        // Writes <root>/tree/dNNNN/fNNNNNN with incompressible content.
+        void Generate(const string_t& root, const Scenario& scenario)
+        {
+            mt19937 random(static_cast<unsigned>(scenario.fileSize + scenario.directories));
+            vector<uint8_t> buffer((std::min)(scenario.fileSize, static_cast<size_t>(FileUploader::MaxRangeSize)));
+
+            MakeDirectory(root);
+            MakeDirectory(root + _XPLATSTR("/tree"));
+
+            for (size_t d = 0; d < scenario.directories; d++)
+            {
+                string_t directory = root + _XPLATSTR("/tree/") + DirectoryName(d);
+                MakeDirectory(directory);
+
+                for (size_t f = 0; f < scenario.filesPerDirectory; f++)
+                {
+                    shared_ptr<ILocalFile> file = m_file_system->CreateLocalFile(directory + _XPLATSTR("/") + FileName(f));
+
+                    for (size_t offset = 0; offset < scenario.fileSize; offset += buffer.size())
+                    {
+                        size_t count = (std::min)(buffer.size(), scenario.fileSize - offset);
+
+                        for (auto& b : buffer)
+                        {
+                            b = static_cast<uint8_t>(random());
+                        }
+
+                        file->WriteAt(static_cast<int64_t>(offset), buffer.data(), count);
+                    }
+                }
+            }
+        }
+
+        static void MakeDirectory(const string_t& path)
+        {
+#ifdef _WIN32
+            ::CreateDirectoryW(path.c_str(), NULL);
+#else
+            mkdir(path.c_str(), 0755);
+#endif
+        }
+
+        // Removes a directory and everything below it. Directories are reported before their
+        // contents, so removing them in reverse order empties each one before it goes.
+        void RemoveTree(const string_t& root)
+        {
+            vector<string_t> directories;
+
+            m_file_system->ProcessDirectories(root, [&directories](const string_t& path)
+            {
+                directories.push_back(path);
+            }, [](const string_t& path)
+            {
+                RemoveLocalFile(path);
+            });
+
+            for (auto it = directories.rbegin(); it != directories.rend(); ++it)
+            {
+                RemoveEmptyDirectory(*it);
+            }
+
+            RemoveEmptyDirectory(root);
+        }
+
+        static void RemoveLocalFile(const string_t& path)
+        {
+#ifdef _WIN32
+            ::DeleteFileW(path.c_str());
+#else
+            unlink(path.c_str());
+#endif
+        }
+
+        // Fails quietly when the directory is not empty, so a -data directory that holds
+        // anything else is left alone.
+        static void RemoveEmptyDirectory(const string_t& path)
+        {
+#ifdef _WIN32
+            ::RemoveDirectoryW(path.c_str());
+#else
+            rmdir(path.c_str());
+#endif
+        }
+
+        static string_t DirectoryName(size_t index)
+        {
+            return _XPLATSTR("d") + conversions::to_string_t(to_string(index));
+        }
+
+        static string_t FileName(size_t index)
+        {
+            return _XPLATSTR("f") + conversions::to_string_t(to_string(index));
+        }
+
+        AzureFileStandIn& m_stand_in;
+        string_t m_data_path;
+        string_t m_options;
+        shared_ptr<IFileSystem> m_file_system;
+    };
+}
+
+int main(int argc, const char *argv[])
+{
+    AzureFileConsole::AzureFileStandIn::Options options;
+    utility::string_t address = _XPLATSTR("http://127.0.0.1:10004");
+    utility::string_t dataPath = _XPLATSTR("AzureFileBenchmark.data");
+    utility::string_t commandOptions;
+    utility::string_t only;
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string name = argv[i];
+        utility::string_t value = utility::conversions::to_string_t(argv[i + 1]);
+
+        if (name == "-latency")
+        {
+            options.latency = std::chrono::milliseconds(std::stoul(value));
+        }
+        else if (name == "-bandwidth")
+        {
+            options.bandwidth = AzureFileConsole::Util::ParseSize(value);
+        }
+        else if (name == "-throttle")
+        {
+            options.throttleRate = std::stod(value);
+        }
+        else if (name == "-address")
+        {
+            address = value;
+        }
+        else if (name == "-data")
+        {
+            dataPath = value;
+        }
+        else if (name == "-p")
+        {
+            commandOptions = _XPLATSTR(" -p ") + value;
+        }
+        else if (name == "-scenario")
+        {
+            only = value;
+        }
+        else
+        {
+            ucout << _XPLATSTR("Usage:") << std::endl;
+            ucout << _XPLATSTR("  ") << argv[0] << _XPLATSTR(" [-latency ms] [-bandwidth bytes/s] [-throttle rate] [-p n] [-scenario tiny|mixed|large] [-data dir] [-address url]") << std::endl;
+            return -1;
+        }
+    }
+
+    std::vector<AzureFileConsole::Benchmark::Scenario> scenarios =
+    {
+        { _XPLATSTR("tiny"), 20, 100, 4 * 1024 },
+        { _XPLATSTR("mixed"), 10, 20, 256 * 1024 },
+        { _XPLATSTR("large"), 1, 4, 64 * 1024 * 1024 },
+    };
+
+    try
+    {
+        AzureFileConsole::AzureFileStandIn standIn(address, options);
+        standIn.Open();
+
+        AzureFileConsole::Benchmark benchmark(standIn, dataPath, commandOptions);
+
+        for (auto& scenario : scenarios)
+        {
+            if (only.empty() || only == scenario.name)
+            {
+                benchmark.Run(scenario);
+            }
+        }
+
+        standIn.Close();
+    }
+    catch (const std::exception& e)
+    {
+        ucout << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
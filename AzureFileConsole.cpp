@@ -2,820 +2,196 @@
 //
 
 #include "stdafx.h"
+#include "AzureFileConsole.h"
 
-namespace AzureFileConsole
+utility::string_t combine_uri_paths(const utility::string_t& str1, const utility::string_t& str2)
 {
-    using namespace std;
-    using namespace concurrency;
-    using namespace utility;
-    using namespace azure::storage;
+    utility::string_t result = str1;
 
-    class Util
+    if (result.back() == _XPLATSTR('/'))
     {
-    public:
-        static vector<string_t> Split(const string_t& input, const string_t& delimiters)
-        {
-            vector<string_t> result;
-            size_t start = 0;
-
-            while (start < input.size())
-            {
-                size_t end = start;
-
-                while (end < input.size()
-                    && std::find(delimiters.begin(), delimiters.end(), input[end]) == delimiters.end())
-                {
-                    end++;
-                }
-
-                if (start < end)
-                {
-                    result.push_back(input.substr(start, end - start));
-                }
-
-                start = end;
-
-                while (start < input.size()
-                    && std::find(delimiters.begin(), delimiters.end(), input[start]) != delimiters.end())
-                {
-                    start++;
-                }
-            }
-
-            return result;
-        }
-    };
+        result.erase(result.end());
+    }
 
-    class AzureFileContext
+    if (str2.front() != _XPLATSTR('/'))
     {
-    public:
-
-        AzureFileContext()
-        {
-        }
-
-        AzureFileContext(const string_t& account_name, const string_t& account_key)
-            : m_account_name(account_name), m_account_key(account_key)
-        {
-            m_storage_credentials = storage_credentials(m_account_name, m_account_key);
-            Init();
-        }
-
-        AzureFileContext(const string_t& sas_token)
-            : m_sas_token(sas_token)
-        {
-            m_storage_credentials = storage_credentials(m_sas_token);
-            Init();
-        }
-
-        cloud_file_client FileClient() const
-        {
-            return m_file_client;
-        }
-
-        const string_t& CurrentUri() const
-        {
-            return m_current_uri;
-        }
-
-        void CurrentUri(const string_t& uri)
-        {
-            m_current_uri = uri;
-        }
-
-        const cloud_file_share& CurrentShare() const
-        {
-            return m_current_share;
-        }
-
-        void CurrentShare(const cloud_file_share& file_share)
-        {
-            m_current_share = file_share;
-        }
-
-        const cloud_file_directory& CurrentDirectory() const
-        {
-            return m_current_directory;
-        }
-
-        void CurrentDirectory(const cloud_file_directory& file_directory)
-        {
-            m_current_directory = file_directory;
-        }
-
-    private:
-
-        void Init()
-        {
-            m_storage_account = cloud_storage_account(m_storage_credentials, true);
-            m_file_client = m_storage_account.create_cloud_file_client();
-            m_current_uri = m_file_client.base_uri().primary_uri().to_string();
-        }
-
-        string_t m_account_name;
-        string_t m_account_key;
-        string_t m_sas_token;
-        storage_credentials m_storage_credentials;
-        cloud_storage_account m_storage_account;
-        cloud_file_client m_file_client;
+        result.append(_XPLATSTR("/"));
+    }
+    
+    result.append(str2);
+    return result;
+}
 
-        cloud_file_share m_current_share;
-        cloud_file_directory m_current_directory;
-        string_t m_current_uri;
-    };
+int main(int argc, const char *argv[])
+{
+    std::vector<utility::string_t> credentials;
+    std::vector<utility::string_t> script;
+    std::string metricsPath;
+    std::string configPath;
+    bool batch = false;
 
-    class IFileSystem
-    {
-    public:
-        virtual string_t GetFileName(const string_t& path) = 0;
-        virtual bool IsDirectory(const string_t& path) = 0;
-        virtual void ProcessDirectories(
-            const string_t& path,
-            const function<void(const string_t&)>& actionOnDirectory,
-            const function<void(const string_t&)>& actionOnFile) = 0;
-        virtual string_t GetRelativePath(const string_t& parent, const string_t& fullPath) = 0;
-    };
-
-    class FileSystem : public IFileSystem
+    for (int i = 1; i < argc; i++)
     {
-    public:
-        string_t GetFileName(const string_t& path)
-        {
-            throw runtime_error("NotImplemented");
-        }
+        std::string arg = argv[i];
 
-        bool IsDirectory(const string_t& path)
+        if (arg == "-metrics" && i + 1 < argc)
         {
-            throw runtime_error("NotImplemented");
+            metricsPath = argv[++i];
         }
-
-        void ProcessDirectories(
-            const string_t& path,
-            const function<void(const string_t&)>& actionOnDirectory,
-            const function<void(const string_t&)>& actionOnFile)
+        else if (arg == "-config" && i + 1 < argc)
         {
-            throw runtime_error("NotImplemented");
+            configPath = argv[++i];
         }
-
-        string_t GetRelativePath(const string_t& parent, const string_t& fullPath)
-        {
-            throw runtime_error("NotImplemented");
-        }
-    };
-
-    class NtfsFileSystem : public FileSystem
-    {
-    public:
-        string_t GetFileName(const string_t& path)
+        else if ((arg == "-c" || arg == "-f") && i + 1 < argc)
         {
-            size_t index = path.find_last_of(_XPLATSTR('\\'));
-            return path.substr(index + 1);
-        }
-
-        bool IsDirectory(const string_t& path)
-        {
-            DWORD dwAttrs = GetFileAttributes(path.c_str());
-
-            if (dwAttrs == INVALID_FILE_ATTRIBUTES)
-            {
-                return false;
-            }
+            batch = true;
 
-            return ((dwAttrs & FILE_ATTRIBUTE_DIRECTORY) == FILE_ATTRIBUTE_DIRECTORY);
-        }
-
-        void ProcessDirectories(
-            const string_t& path,
-            const function<void(const string_t&)>& actionOnDirectory,
-            const function<void(const string_t&)>& actionOnFile)
-        {
-            if (path.empty())
+            if (arg == "-c")
             {
-                throw invalid_argument("path");
+                std::vector<utility::string_t> lines = AzureFileConsole::Util::Split(utility::conversions::to_string_t(argv[++i]), _XPLATSTR(";"));
+                script.insert(script.end(), lines.begin(), lines.end());
             }
-
-            queue<string_t> directories;
-            directories.push(path);
-
-            string_t currentDirectory;
-
-            while (!directories.empty())
+            else
             {
-                currentDirectory = directories.front();
-                directories.pop();
-                ProcessDirectory(currentDirectory, directories, actionOnDirectory, actionOnFile);
-            }
-        }
-
-        string_t GetRelativePath(const string_t& parent, const string_t& fullPath)
-        {
-            string_t relativePath = fullPath;
-            size_t length = parent.size();
+                std::ifstream stream(argv[++i]);
+                std::string line;
 
-            if (fullPath.substr(0, length).compare(parent) == 0)
-            {
-                if (length < fullPath.size())
-                {
-                    relativePath = fullPath.substr(length);
-                }
-                else
+                if (!stream)
                 {
-                    relativePath = string_t();
+                    ucout << _XPLATSTR("Cannot open script ") << argv[i] << std::endl;
+                    return -1;
                 }
-            }
-
-            if (relativePath.size() > 0 && relativePath.front() == _XPLATSTR('\\'))
-            {
-                relativePath = relativePath.substr(1);
-            }
-
-            return relativePath;
-        }
-
-    private:
-
-        void ProcessDirectory(
-            const string_t& directory,
-            queue<string_t>& directories,
-            const function<void(const string_t&)>& actionOnDirectory,
-            const function<void(const string_t&)>& actionOnFile)
-        {
-            WIN32_FIND_DATA findData;
-            HANDLE hFind = INVALID_HANDLE_VALUE;
-            DWORD dwError = 0;
 
-            try
-            {
-                actionOnDirectory(directory);
-
-                string_t pattern = BuildSearchPattern(directory);
-
-                hFind = FindFirstFile(pattern.c_str(), &findData);
-
-                if (hFind == INVALID_HANDLE_VALUE)
+                while (std::getline(stream, line))
                 {
-                    dwError = GetLastError();
-                    ucout << _XPLATSTR("Failed to find ") << pattern << ", last error: " << dwError << endl;
-                    return;
+                    script.push_back(utility::conversions::to_string_t(line));
                 }
-
-                vector<pplx::task<void>> fileActions;
-                do
-                {
-                    if (_wcsicmp(findData.cFileName, L".") == 0 || _wcsicmp(findData.cFileName, L"..") == 0)
-                    {
-                        continue;
-                    }
-
-                    string_t path = PathCombine(directory, string_t(findData.cFileName));
-
-                    if ((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == FILE_ATTRIBUTE_DIRECTORY)
-                    {
-                        directories.push(path);
-                    }
-                    else
-                    {
-                        pplx::task<void> action([=]()->void
-                        {
-                            actionOnFile(path);
-                        });
-
-                        fileActions.push_back(action);
-                    }
-                } while (FindNextFile(hFind, &findData) != 0);
-
-                pplx::when_all(fileActions.begin(), fileActions.end()).wait();
-            }
-            catch (const std::exception& e)
-            {
-                ucout << e.what() << endl;
-            }
-
-            if (hFind != INVALID_HANDLE_VALUE)
-            {
-                FindClose(hFind);
-                hFind = INVALID_HANDLE_VALUE;
             }
         }
-
-        static string_t BuildSearchPattern(const string_t& path)
+        else
         {
-            string_t pattern = path;
-
-            if (pattern.back() != _XPLATSTR('\\'))
-            {
-                pattern.append(1, _XPLATSTR('\\'));
-            }
-
-            pattern.append(1, _XPLATSTR('*'));
-            return pattern;
+            credentials.push_back(utility::conversions::to_string_t(arg));
         }
+    }
 
-        static string_t PathCombine(const string_t& parent, const string_t& child)
-        {
-            string_t path = parent;
-
-            if (path.back() == _XPLATSTR('\\'))
-            {
-                if (child.front() == _XPLATSTR('\\'))
-                {
-                    path.append(child.substr(1));
-                }
-                else
-                {
-                    path.append(child);
-                }
-            }
-            else
-            {
-                if (child.front() != _XPLATSTR('\\'))
-                {
-                    path.append(1, _XPLATSTR('\\'));
-                }
-
-                path.append(child);
-            }
-
-            return path;
-        }
-    };
+    if (credentials.empty())
+    {
+        ucout << _XPLATSTR("Not enough arguments") << std::endl;
+        ucout << _XPLATSTR("Usage:") << std::endl;
+        ucout << _XPLATSTR("  ") << argv[0] << _XPLATSTR(" [AccountName] [AccountKey] [-c \"cmd; cmd\"] [-f script] [-metrics file.json] [-config file]") << std::endl;
+        ucout << _XPLATSTR("  ") << argv[0] << _XPLATSTR(" [SAS Key] [-c \"cmd; cmd\"] [-f script] [-metrics file.json] [-config file]") << std::endl;
+        return -1;
+    }
 
-    class FileSystemFactory
+    if (!configPath.empty())
     {
-    public:
-        static shared_ptr<IFileSystem> CreateFileSystem()
+        try
         {
-            return shared_ptr<IFileSystem>(new NtfsFileSystem());
+            AzureFileConsole::TransferProfile::Instance().Load(configPath);
         }
-    };
-
-    class ICommand
-    {
-    public:
-
-        ICommand()
+        catch (const std::exception& e)
         {
+            ucout << e.what() << std::endl;
+            return -1;
         }
+    }
 
-        virtual void PreExecute() = 0;
-        virtual void Execute() = 0;
-        virtual void PostExecute() = 0;
-    };
+    AzureFileConsole::AzureFileContext context;
 
-    class CommandBase : public ICommand
+    if (credentials.size() == 1)
     {
-    public:
-        CommandBase(const string_t& command, const vector<string_t>& arguments, AzureFileContext& context,  const shared_ptr<IFileSystem>& file_system)
-            : m_command(command), m_arguments(arguments), m_context(context), m_file_system(file_system), ICommand()
-        {
-        }
-
-        void PreExecute()
-        {
-        }
+        context = AzureFileConsole::AzureFileContext(credentials[0]);
+    }
+    else
+    {
+        context = AzureFileConsole::AzureFileContext(credentials[0], credentials[1]);
+    }
 
-        void Execute()
-        {
-        }
+    std::shared_ptr<AzureFileConsole::IFileSystem> fileSystem = AzureFileConsole::FileSystemFactory::CreateFileSystem();
 
-        void PostExecute()
+    // The metrics are written however the session ends.
+    struct MetricsDump
+    {
+        ~MetricsDump()
         {
+            if (!path.empty())
+            {
+                std::ofstream stream(path.c_str(), std::ios::out | std::ios::trunc);
+                stream << utility::conversions::to_utf8string(AzureFileConsole::TransferMetrics::Instance().ToJson()) << std::endl;
+            }
         }
 
-    protected:
-
-        string_t m_command_line;
-        string_t m_command;
-        vector<string_t> m_arguments;
-
-        AzureFileContext& m_context;
+        std::string path;
+    } metricsDump;
 
-        shared_ptr<IFileSystem> m_file_system;
-    };
+    metricsDump.path = metricsPath;
 
-    class DefaultCommand : public CommandBase
+    if (batch)
     {
-    public:
-        DefaultCommand(const string_t& command, const vector<string_t>& arguments, AzureFileContext& context, const shared_ptr<IFileSystem>& file_system)
-            : CommandBase(command, arguments, context, file_system)
+        try
         {
+            AzureFileConsole::ScriptRunner runner(context, fileSystem);
+            return runner.Run(script) == 0 ? 0 : 1;
         }
-    };
-
-    class DirCommand : public CommandBase
-    {
-    public:
-        DirCommand(const string_t& command, const vector<string_t>& arguments, AzureFileContext& context, const shared_ptr<IFileSystem>& file_system)
-            : CommandBase(command, arguments, context, file_system)
+        catch (const std::exception& e)
         {
+            ucout << e.what() << std::endl;
+            return 1;
         }
+    }
 
-        void Execute()
-        {
-            if (!m_context.CurrentShare().is_valid())
-            {
-                continuation_token token;
-
-                do
-                {
-                    share_result_segment result = m_context.FileClient().list_shares_segmented(token);
-
-                    for (auto& item : result.results())
-                    {
-                        ucout << _XPLATSTR("    ") << item.name() << std::endl;
-                    }
-                }
-                while (!token.empty());
-            }
-            else
-            {
-                continuation_token token;
-
-                do
-                {
-                    list_file_and_directory_result_segment result = m_context.CurrentDirectory().list_files_and_directories_segmented(token);
-                    
-                    for (auto& item : result.results())
-                    {
-                        if (item.is_directory())
-                        {
-                            ucout << _XPLATSTR("<d> ") << item.as_directory().name() << std::endl;
-                        }
-                        else if (item.is_file())
-                        {
-                            ucout << _XPLATSTR("    ") << item.as_file().name() << std::endl;
-                        }
-                    }
-                } while (!token.empty());
-            }
-        }
-    };
+    utility::string_t input;
 
-    class CdCommand : public CommandBase
+    try
     {
-    public:
-        CdCommand(const string_t& command, const vector<string_t>& arguments, AzureFileContext& context, const shared_ptr<IFileSystem>& file_system)
-            : CommandBase(command, arguments, context, file_system)
-        {
-        }
-
-        void PreExecute()
+        while (true)
         {
-            if (m_arguments.size() == 0)
+            try
             {
-                throw invalid_argument("Missing arguments");
-            }
-
-            string_t directory_name = m_arguments[0];
+                ucout << std::endl << _XPLATSTR(">>") << context.CurrentUri() << std::endl;
+                ucout << _XPLATSTR(">");
+                std::getline(ucin, input);
 
-            if (!m_context.CurrentShare().is_valid())
-            {
-                if (directory_name.compare(_XPLATSTR(".")) == 0
-                    || directory_name.compare(_XPLATSTR("..")) == 0)
+                if (input.compare(_XPLATSTR("exit")) == 0)
                 {
-                    // share.exists() throws if share_name is "." or ".."
-                    throw invalid_argument("Invalid share name");
+                    break;
                 }
-            }
-        }
 
-        void Execute()
-        {
-            if (!m_context.CurrentShare().is_valid())
-            {
-                string_t share_name = m_arguments[0];
-
-                cloud_file_share share = m_context.FileClient().get_share_reference(share_name);
+                // A trailing '&' runs the command as a background job; jobs, wait and cancel manage it.
+                utility::string_t line = AzureFileConsole::Util::Trim(input);
 
-                if (share.exists())
+                if (!line.empty() && line.back() == _XPLATSTR('&'))
                 {
-                    m_context.CurrentShare(share);
-                    m_context.CurrentDirectory(m_context.CurrentShare().get_root_directory_reference());
-                    m_context.CurrentUri(m_context.CurrentDirectory().uri().primary_uri().to_string());
-                }
-                else
-                {
-                    throw invalid_argument("Invalid share name");
-                }
-            }
-            else
-            {
-                string_t directory_name = m_arguments[0];
+                    line = AzureFileConsole::Util::Trim(line.substr(0, line.size() - 1));
 
-                if (directory_name.compare(_XPLATSTR("..")) == 0)
-                {
-                    string_t currentDirectoryPath = m_context.CurrentDirectory().uri().path();
-                    string_t rootDirectoryPath = m_context.CurrentShare().get_root_directory_reference().uri().path();
+                    utility::string_t name;
+                    utility::istringstream_t iss(line);
+                    iss >> name;
 
-                    if (currentDirectoryPath.compare(rootDirectoryPath) == 0)
-                    {
-                        m_context.CurrentShare(cloud_file_share());
-                        m_context.CurrentDirectory(cloud_file_directory());
-                        m_context.CurrentUri(m_context.FileClient().base_uri().primary_uri().to_string());
-                    }
-                    else
-                    {
-                        // Note: The parent_directory of root_directory is still the root_directory
-                        m_context.CurrentDirectory(m_context.CurrentDirectory().get_parent_directory_reference());
-                        m_context.CurrentUri(m_context.CurrentDirectory().uri().primary_uri().to_string());
-                    }
-                }
-                else if (directory_name.compare(_XPLATSTR(".")) != 0)
-                {
-                    cloud_file_directory subdir = m_context.CurrentDirectory().get_subdirectory_reference(directory_name);
+                    static const utility::char_t* const transfers[] = { _XPLATSTR("upload"), _XPLATSTR("download"), _XPLATSTR("sync"), _XPLATSTR("copy"), _XPLATSTR("delete"), _XPLATSTR("du"), _XPLATSTR("find") };
 
-                    if (subdir.exists())
+                    if (std::find(std::begin(transfers), std::end(transfers), name) == std::end(transfers))
                     {
-                        m_context.CurrentDirectory(subdir);
-                        m_context.CurrentUri(m_context.CurrentDirectory().uri().primary_uri().to_string());
+                        throw std::invalid_argument("Only transfer commands can run in the background");
                     }
-                    else
-                    {
-                        throw invalid_argument("Invalid directory name");
-                    }
-                }
-            }
-        }
-    };
-
-    class UploadCommand : public CommandBase
-    {
-    public:
-        UploadCommand(const string_t& command, const vector<string_t>& arguments, AzureFileContext& context, const shared_ptr<IFileSystem>& file_system)
-            : CommandBase(command, arguments, context, file_system)
-        {
-        }
-
-        void PreExecute()
-        {
-            if (m_arguments.size() == 0)
-            {
-                throw invalid_argument("Missing arguments");
-            }
 
-            if (!m_context.CurrentShare().is_valid())
-            {
-                throw invalid_argument("Not in a share root directory");
-            }
-        }
-
-        void Execute()
-        {
-            string_t path = m_arguments[0];
-            string_t fileName;
-
-            if (m_file_system->IsDirectory(path))
-            {
-                m_file_system->ProcessDirectories(
-                    path,
-                    [&, path](const string_t& d)
-                    {
-                        string_t relativePath = m_file_system->GetRelativePath(path, d);
-
-                        if (relativePath.size() > 0)
-                        {
-                            vector<string_t> parts = Util::Split(relativePath, _XPLATSTR("\\"));
-                            cloud_file_directory currentDir = m_context.CurrentDirectory();
-                            size_t i = 0;
-
-                            for (i = 0; i < parts.size(); i++)
-                            {
-                                if (parts[i].size() > 0)
-                                {
-                                    currentDir = currentDir.get_subdirectory_reference(parts[i]);
-                                    currentDir.create_if_not_exists();
-                                }
-                            }
-                        }
-                    },
-                    [&, path](const string_t& f)
+                    size_t id = AzureFileConsole::BackgroundJobs::Instance().Start(line, context, [&](AzureFileConsole::AzureFileContext& jobContext)
                     {
-                        string_t relativePath = m_file_system->GetRelativePath(path, f);
-                        vector<string_t> parts = Util::Split(relativePath, _XPLATSTR("\\"));
-                        cloud_file_directory currentDir = m_context.CurrentDirectory();
-                        size_t i = 0;
-
-                        for (i = 0; i < parts.size() - 1; i++)
-                        {
-                            if (parts[i].size() > 0)
-                            {
-                                currentDir = currentDir.get_subdirectory_reference(parts[i]);
-                            }
-                        }
-
-                        fileName = parts[i];
-                        cloud_file file = currentDir.get_file_reference(fileName);
-                        file.upload_from_file(f);
-                        ucout << "Uploaded " << f << endl;
+                        return AzureFileConsole::CommandFactory::Create(line, jobContext, fileSystem);
                     });
-            }
-            else
-            {
-                if (m_arguments.size() > 1)
-                {
-                    fileName = m_arguments[1];
-                }
-                else
-                {
-                    fileName = m_file_system->GetFileName(path);
-                }
-
-                cloud_file file = m_context.CurrentDirectory().get_file_reference(fileName);
-                file.upload_from_file(path);
-            }
-        }
-    };
-
-    class DeleteCommand : public CommandBase
-    {
-    public:
-        DeleteCommand(const string_t& command, const vector<string_t>& arguments, AzureFileContext& context, const shared_ptr<IFileSystem>& file_system)
-            : CommandBase(command, arguments, context, file_system)
-        {
-        }
 
-        void PreExecute()
-        {
-            if (m_arguments.size() == 0)
-            {
-                throw invalid_argument("Missing arguments");
-            }
-
-            if (!m_context.CurrentShare().is_valid())
-            {
-                throw invalid_argument("Not in a share root directory");
-            }
-        }
-
-        void Execute()
-        {
-            string_t itemName = m_arguments[0];
-            cloud_file file = m_context.CurrentDirectory().get_file_reference(itemName);
-
-            if (file.delete_file_if_exists())
-            {
-                return;
-            }
-
-            cloud_file_directory directory = m_context.CurrentDirectory().get_subdirectory_reference(itemName);
-            DeleteDirectory(directory).wait();
-        }
-
-    private:
-        static pplx::task<void> DeleteDirectory(cloud_file_directory directory)
-        {
-            vector<pplx::task<void>> deleteDirectories;
-            vector<pplx::task<void>> deleteFiles;
-
-            continuation_token token;
-
-            do
-            {
-                list_file_and_directory_result_segment result = directory.list_files_and_directories_segmented(token);
-
-                for (auto& item : result.results())
-                {
-                    if (item.is_directory())
-                    {
-                        deleteDirectories.push_back(pplx::task<void>([item]()->void
-                        {
-                            DeleteDirectory(item.as_directory()).wait();
-                        }));
-                    }
-                    else if (item.is_file())
-                    {
-                        deleteFiles.push_back(pplx::task<void>([item]()->void
-                        {
-                            cloud_file file = item.as_file();
-                            file.delete_file();
-                        }));
-                    }
+                    ucout << _XPLATSTR("[") << id << _XPLATSTR("] ") << line << std::endl;
+                    continue;
                 }
-            } while (!token.empty());
-
-            return pplx::when_all(deleteFiles.begin(), deleteFiles.end()).then([deleteDirectories]()->void {
-                pplx::when_all(deleteDirectories.begin(), deleteDirectories.end()).wait();
-            }).then([directory]()->void {
-                cloud_file_directory dir = directory;
-                dir.delete_directory();
-            });
-        }
-    };
-
-    class CommandFactory
-    {
-    public:
-        static shared_ptr<ICommand> Create(const string_t& command_line, AzureFileContext& context)
-        {
-            string_t command;
-            vector<string_t> arguments;
-            istringstream_t iss(command_line);
-
-            if (!iss.eof())
-            {
-                iss >> command;
-            }
-
-            string_t arg;
-
-            while (!iss.eof())
-            {
-                iss >> arg;
-                arguments.push_back(arg);
-            }
-
-            shared_ptr<IFileSystem> file_system = FileSystemFactory::CreateFileSystem();
-
-            if (command.compare(_XPLATSTR("dir")) == 0)
-            {
-                return shared_ptr<ICommand>(new DirCommand(command, arguments, context, file_system));
-            }
-            else if (command.compare(_XPLATSTR("cd")) == 0)
-            {
-                return shared_ptr<ICommand>(new CdCommand(command, arguments, context, file_system));
-            }
-            else if (command.compare(_XPLATSTR("upload")) == 0)
-            {
-                return shared_ptr<ICommand>(new UploadCommand(command, arguments, context, file_system));
-            }
-            else if (command.compare(_XPLATSTR("delete")) == 0)
-            {
-                return shared_ptr<ICommand>(new DeleteCommand(command, arguments, context, file_system));
-            }
-            else
-            {
-                return shared_ptr<ICommand>(new DefaultCommand(command, arguments, context, file_system));
-            }
-        }
-    };
-}
-
-utility::string_t combine_uri_paths(const utility::string_t& str1, const utility::string_t& str2)
-{
-    utility::string_t result = str1;
-
-    if (result.back() == _XPLATSTR('/'))
-    {
-        result.erase(result.end());
-    }
-
-    if (str2.front() != _XPLATSTR('/'))
-    {
-        result.append(_XPLATSTR("/"));
-    }
-    
-    result.append(str2);
-    return result;
-}
-
-int main(int argc, const char *argv[])
-{
-    if (argc == 1)
-    {
-        ucout << _XPLATSTR("Not enough arguments") << std::endl;
-        ucout << _XPLATSTR("Usage:") << std::endl;
-        ucout << _XPLATSTR("  ") << argv[0] << _XPLATSTR(" [AccountName] [AccountKey]") << std::endl;
-        ucout << _XPLATSTR("  ") << argv[0] << _XPLATSTR(" [SAS Key]") << std::endl;
-        return -1;
-    }
-
-    AzureFileConsole::AzureFileContext context;
 
-    if (argc == 2)
-    {
-        utility::stringstream_t token;
-        token << argv[1];
-        context = AzureFileConsole::AzureFileContext(token.str());
-    }
-    else
-    {
-        utility::stringstream_t account;
-        utility::stringstream_t key;
-        account << argv[1];
-        key << argv[2];
-        context = AzureFileConsole::AzureFileContext(account.str(), key.str());
-    }
-
-    utility::string_t input;
-
-    try
-    {
-        while (true)
-        {
-            try
-            {
-                ucout << std::endl << _XPLATSTR(">>") << context.CurrentUri() << std::endl;
-                ucout << _XPLATSTR(">");
-                std::getline(ucin, input);
+                std::shared_ptr<AzureFileConsole::ICommand> command = AzureFileConsole::CommandFactory::Create(input, context, fileSystem);
+                command->PreExecute();
 
-                if (input.compare(_XPLATSTR("exit")) == 0)
                 {
-                    break;
+                    AzureFileConsole::ProgressLine progress;
+                    command->Execute();
                 }
 
-                std::shared_ptr<AzureFileConsole::ICommand> command = AzureFileConsole::CommandFactory::Create(input, context);
-                command->PreExecute();
-                command->Execute();
                 command->PostExecute();
             }
             catch (const std::exception& e)
@@ -829,5 +205,6 @@ int main(int argc, const char *argv[])
         ucout << _XPLATSTR("Exit unexpected") << std::endl;
     }
 
+    AzureFileConsole::BackgroundJobs::Instance().Shutdown();
     return 0;
-}
\ No newline at end of file
+}
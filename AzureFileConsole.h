@@ -0,0 +1,8461 @@
+// AzureFileConsole.h : The console's commands and the transfer machinery behind them, shared by
+// AzureFileConsole and AzureFileBenchmark. Include stdafx.h first.
+//
+
+#pragma once
+
+namespace AzureFileConsole
+{
+    using namespace std;
+    using namespace concurrency;
+    using namespace utility;
+    using namespace azure::storage;
+
+    class Util
+    {
+    public:
+        static vector<string_t> Split(const string_t& input, const string_t& delimiters)
+        {
+            vector<string_t> result;
+            size_t start = 0;
+
+            while (start < input.size())
+            {
+                size_t end = start;
+
+                while (end < input.size()
+                    && std::find(delimiters.begin(), delimiters.end(), input[end]) == delimiters.end())
+                {
+                    end++;
+                }
+
+                if (start < end)
+                {
+                    result.push_back(input.substr(start, end - start));
+                }
+
+                start = end;
+
+                while (start < input.size()
+                    && std::find(delimiters.begin(), delimiters.end(), input[start]) != delimiters.end())
+                {
+                    start++;
+                }
+            }
+
+            return result;
+        }
+
+        static bool IsUrl(const string_t& path)
+        {
+            return path.compare(0, 7, _XPLATSTR("http://")) == 0 || path.compare(0, 8, _XPLATSTR("https://")) == 0;
+        }
+
+        // The URL without its query, which holds the SAS if there is one.
+        static string_t UrlPath(const string_t& url)
+        {
+            return url.substr(0, url.find(_XPLATSTR('?')));
+        }
+
+        static string_t Trim(const string_t& input)
+        {
+            const string_t whitespace = _XPLATSTR(" \t\r\n");
+            size_t start = input.find_first_not_of(whitespace);
+
+            if (start == string_t::npos)
+            {
+                return string_t();
+            }
+
+            return input.substr(start, input.find_last_not_of(whitespace) - start + 1);
+        }
+
+        // Parses a decimal count of digits only: no sign, no spaces and nothing after it, so
+        // "-1" or "8abc" is refused instead of wrapping around or being cut short. The value may
+        // not exceed maximum.
+        static uint64_t ParseNumber(const string_t& input, uint64_t maximum = (numeric_limits<uint64_t>::max)())
+        {
+            if (input.empty() || input.find_first_not_of(_XPLATSTR("0123456789")) != string_t::npos)
+            {
+                throw invalid_argument("Invalid number");
+            }
+
+            uint64_t value = 0;
+
+            for (auto c : input)
+            {
+                uint64_t digit = static_cast<uint64_t>(c - _XPLATSTR('0'));
+
+                if (digit > maximum || value > (maximum - digit) / 10)
+                {
+                    throw invalid_argument("Number out of range");
+                }
+
+                value = value * 10 + digit;
+            }
+
+            return value;
+        }
+
+        // Parses a byte count such as "4194304", "512K", "4M" or "1G", with at most one suffix.
+        static uint64_t ParseSize(const string_t& input)
+        {
+            size_t end = input.find_first_not_of(_XPLATSTR("0123456789"));
+            string_t suffix = end == string_t::npos ? string_t() : input.substr(end);
+            unsigned int shift = 0;
+
+            if (suffix.size() > 1)
+            {
+                throw invalid_argument("Invalid size");
+            }
+
+            if (!suffix.empty())
+            {
+                switch (suffix[0])
+                {
+                case _XPLATSTR('K'):
+                case _XPLATSTR('k'):
+                    shift = 10;
+                    break;
+                case _XPLATSTR('M'):
+                case _XPLATSTR('m'):
+                    shift = 20;
+                    break;
+                case _XPLATSTR('G'):
+                case _XPLATSTR('g'):
+                    shift = 30;
+                    break;
+                default:
+                    throw invalid_argument("Invalid size");
+                }
+            }
+
+            return ParseNumber(input.substr(0, end), (numeric_limits<uint64_t>::max)() >> shift) << shift;
+        }
+
+        // A 64-bit non-cryptographic hash of a block of data, mixing four 64-bit lanes so that it
+        // runs at memory speed. It is used to tell whether a range changed since it was uploaded.
+        static uint64_t HashBlock(const uint8_t* data, size_t size)
+        {
+            const uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+            const uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+            uint64_t lanes[4] = { prime1 + prime2, prime2, 0, 0 - prime1 };
+            size_t i = 0;
+
+            for (; i + 32 <= size; i += 32)
+            {
+                for (size_t lane = 0; lane < 4; lane++)
+                {
+                    uint64_t word;
+                    memcpy(&word, data + i + lane * 8, sizeof(word));
+                    lanes[lane] = RotateLeft(lanes[lane] + word * prime2, 31) * prime1;
+                }
+            }
+
+            uint64_t hash = RotateLeft(lanes[0], 1) + RotateLeft(lanes[1], 7) + RotateLeft(lanes[2], 12) + RotateLeft(lanes[3], 18);
+            hash ^= static_cast<uint64_t>(size) * prime1;
+
+            for (; i < size; i++)
+            {
+                hash = RotateLeft(hash ^ (data[i] * prime1), 11) * prime2;
+            }
+
+            hash ^= hash >> 33;
+            hash *= prime2;
+            hash ^= hash >> 29;
+            hash *= prime1;
+            hash ^= hash >> 32;
+            return hash;
+        }
+
+        static uint64_t RotateLeft(uint64_t value, int bits)
+        {
+            return (value << bits) | (value >> (64 - bits));
+        }
+
+        // Returns whether a block holds only zero bytes. Each 4 KiB is folded into one word with
+        // a branch-free loop the compiler vectorizes, so the scan stops early at the first
+        // page with data.
+        static bool IsZero(const uint8_t* data, size_t size)
+        {
+            const size_t pageSize = 4096;
+            size_t i = 0;
+
+            for (; i + pageSize <= size; i += pageSize)
+            {
+                uint64_t folded = 0;
+
+                for (size_t j = 0; j < pageSize; j += sizeof(uint64_t))
+                {
+                    uint64_t word;
+                    memcpy(&word, data + i + j, sizeof(word));
+                    folded |= word;
+                }
+
+                if (folded != 0)
+                {
+                    return false;
+                }
+            }
+
+            for (; i < size; i++)
+            {
+                if (data[i] != 0)
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        // True for failures that mean the service is overloaded: 503 Server Busy, 500 Operation
+        // Timed Out, 408, or a request that never got a response.
+        static bool IsThrottled(const exception_ptr& error)
+        {
+            try
+            {
+                rethrow_exception(error);
+            }
+            catch (const storage_exception& e)
+            {
+                return IsThrottled(e.result());
+            }
+            catch (...)
+            {
+                return false;
+            }
+        }
+
+        static bool IsThrottled(const request_result& result)
+        {
+            int status = result.http_status_code();
+            return !result.is_response_available() || status == 503 || status == 500 || status == 408;
+        }
+
+        // Completes with true once the request succeeds, and with false when it fails with the
+        // given status: a delete that finds nothing (404) or a create that finds the item already
+        // there (409). Unlike the client's _if_exists and _if_not_exists calls, which check
+        // first, this costs a single request.
+        static pplx::task<bool> Tolerate(const pplx::task<void>& request, int status)
+        {
+            return request.then([status](pplx::task<void> previous)
+            {
+                try
+                {
+                    previous.get();
+                }
+                catch (const storage_exception& e)
+                {
+                    if (e.result().is_response_available() && e.result().http_status_code() == status)
+                    {
+                        return false;
+                    }
+
+                    throw;
+                }
+
+                return true;
+            });
+        }
+
+        // Completes when all the tasks complete. Unlike pplx::when_all, every task is observed,
+        // and the result faults with the first error seen once all of them have finished.
+        static pplx::task<void> WhenAll(const vector<pplx::task<void>>& tasks)
+        {
+            struct State
+            {
+                mutex m_mutex;
+                size_t m_remaining;
+                exception_ptr m_error;
+                pplx::task_completion_event<void> m_completed;
+            };
+
+            shared_ptr<State> state = make_shared<State>();
+            state->m_remaining = tasks.size();
+
+            if (tasks.empty())
+            {
+                return pplx::task_from_result();
+            }
+
+            for (auto& task : tasks)
+            {
+                task.then([state](pplx::task<void> previous)->void
+                {
+                    exception_ptr error;
+
+                    try
+                    {
+                        previous.get();
+                    }
+                    catch (...)
+                    {
+                        error = current_exception();
+                    }
+
+                    lock_guard<mutex> lock(state->m_mutex);
+
+                    if (error && !state->m_error)
+                    {
+                        state->m_error = error;
+                    }
+
+                    if (--state->m_remaining == 0)
+                    {
+                        if (state->m_error)
+                        {
+                            state->m_completed.set_exception(state->m_error);
+                        }
+                        else
+                        {
+                            state->m_completed.set();
+                        }
+                    }
+                });
+            }
+
+            return pplx::create_task(state->m_completed);
+        }
+    };
+
+    // Session-wide tuning applied to every storage request: server and client timeouts, the
+    // retry policy, the parallelism of single-call uploads, the default range size, HTTP
+    // keep-alive, how many connections the scheduler may keep busy, and whether uploads send
+    // ranges straight from memory-mapped views of the local file. mmap is off by default: on
+    // POSIX systems a file truncated by another process while a view is mapped kills this one.
+    // It is read from the -config file at start and changed with the set command.
+    class TransferProfile
+    {
+    public:
+        static TransferProfile& Instance()
+        {
+            static TransferProfile profile;
+            return profile;
+        }
+
+        file_request_options RequestOptions() const
+        {
+            lock_guard<mutex> lock(m_mutex);
+            return m_options;
+        }
+
+        bool KeepAlive() const
+        {
+            lock_guard<mutex> lock(m_mutex);
+            return m_keep_alive;
+        }
+
+        size_t RangeSize() const
+        {
+            lock_guard<mutex> lock(m_mutex);
+            return m_range_size;
+        }
+
+        size_t Connections() const
+        {
+            lock_guard<mutex> lock(m_mutex);
+            return m_connections;
+        }
+
+        bool MemoryMapped() const
+        {
+            lock_guard<mutex> lock(m_mutex);
+            return m_memory_mapped;
+        }
+
+        // Bytes per second for both directions together, 0 for no limit.
+        uint64_t Bandwidth() const
+        {
+            lock_guard<mutex> lock(m_mutex);
+            return m_bandwidth;
+        }
+
+        uint64_t UploadBandwidth() const
+        {
+            lock_guard<mutex> lock(m_mutex);
+            return m_upload_bandwidth;
+        }
+
+        uint64_t DownloadBandwidth() const
+        {
+            lock_guard<mutex> lock(m_mutex);
+            return m_download_bandwidth;
+        }
+
+        // Bytes that may go at once under a bandwidth limit after a pause.
+        uint64_t Burst() const
+        {
+            lock_guard<mutex> lock(m_mutex);
+            return m_burst;
+        }
+
+        // Changes one setting. Throws invalid_argument for unknown names and bad values, and
+        // leaves the profile as it was.
+        void Set(const string_t& name, const string_t& value)
+        {
+            lock_guard<mutex> lock(m_mutex);
+            map<string_t, string_t> values = m_values;
+
+            if (values.count(name) == 0)
+            {
+                throw invalid_argument("Unknown setting");
+            }
+
+            values[name] = value;
+            Apply(values);
+        }
+
+        // Reads "name = value" lines; blank lines and lines starting with '#' are skipped.
+        void Load(const string& path)
+        {
+            std::ifstream stream(path.c_str());
+            string line;
+
+            if (!stream)
+            {
+                throw runtime_error("Cannot open config file " + path);
+            }
+
+            lock_guard<mutex> lock(m_mutex);
+            map<string_t, string_t> values = m_values;
+
+            while (getline(stream, line))
+            {
+                string_t text = Util::Trim(conversions::to_string_t(line));
+                size_t separator = text.find(_XPLATSTR('='));
+
+                if (text.empty() || text[0] == _XPLATSTR('#'))
+                {
+                    continue;
+                }
+
+                string_t name = Util::Trim(text.substr(0, separator));
+
+                if (separator == string_t::npos || values.count(name) == 0)
+                {
+                    throw invalid_argument("Invalid config line: " + line);
+                }
+
+                values[name] = Util::Trim(text.substr(separator + 1));
+            }
+
+            Apply(values);
+        }
+
+        map<string_t, string_t> Values() const
+        {
+            lock_guard<mutex> lock(m_mutex);
+            return m_values;
+        }
+
+    private:
+
+        TransferProfile()
+        {
+            map<string_t, string_t> values;
+            values[_XPLATSTR("timeout")] = _XPLATSTR("30");
+            values[_XPLATSTR("retry")] = _XPLATSTR("exponential");
+            values[_XPLATSTR("retry-interval")] = _XPLATSTR("2");
+            values[_XPLATSTR("retry-attempts")] = _XPLATSTR("3");
+            values[_XPLATSTR("parallelism")] = _XPLATSTR("1");
+            values[_XPLATSTR("range")] = _XPLATSTR("4M");
+            values[_XPLATSTR("keepalive")] = _XPLATSTR("on");
+            values[_XPLATSTR("connections")] = _XPLATSTR("256");
+            values[_XPLATSTR("mmap")] = _XPLATSTR("off");
+            values[_XPLATSTR("bandwidth")] = _XPLATSTR("0");
+            values[_XPLATSTR("upload-bandwidth")] = _XPLATSTR("0");
+            values[_XPLATSTR("download-bandwidth")] = _XPLATSTR("0");
+            values[_XPLATSTR("burst")] = _XPLATSTR("4M");
+            Apply(values);
+        }
+
+        // Validates every value before anything changes. Called with the lock held.
+        void Apply(const map<string_t, string_t>& values)
+        {
+            // Counts stay within an int, which every option they feed can hold.
+            const uint64_t maxCount = static_cast<uint64_t>((numeric_limits<int>::max)());
+            size_t timeout = static_cast<size_t>(Util::ParseNumber(values.at(_XPLATSTR("timeout")), maxCount));
+            string_t retry = values.at(_XPLATSTR("retry"));
+            int retryInterval = static_cast<int>(Util::ParseNumber(values.at(_XPLATSTR("retry-interval")), maxCount));
+            int retryAttempts = static_cast<int>(Util::ParseNumber(values.at(_XPLATSTR("retry-attempts")), maxCount));
+            int parallelism = static_cast<int>(Util::ParseNumber(values.at(_XPLATSTR("parallelism")), maxCount));
+            uint64_t rangeSize = Util::ParseSize(values.at(_XPLATSTR("range")));
+            string_t keepAlive = values.at(_XPLATSTR("keepalive"));
+            size_t connections = static_cast<size_t>(Util::ParseNumber(values.at(_XPLATSTR("connections")), maxCount));
+            string_t memoryMapped = values.at(_XPLATSTR("mmap"));
+            uint64_t bandwidth = Util::ParseSize(values.at(_XPLATSTR("bandwidth")));
+            uint64_t uploadBandwidth = Util::ParseSize(values.at(_XPLATSTR("upload-bandwidth")));
+            uint64_t downloadBandwidth = Util::ParseSize(values.at(_XPLATSTR("download-bandwidth")));
+            uint64_t burst = Util::ParseSize(values.at(_XPLATSTR("burst")));
+
+            if (retryInterval < 0 || retryAttempts < 0 || parallelism < 1 || rangeSize == 0 || connections == 0)
+            {
+                throw invalid_argument("Setting out of range");
+            }
+
+            if (keepAlive != _XPLATSTR("on") && keepAlive != _XPLATSTR("off"))
+            {
+                throw invalid_argument("keepalive must be on or off");
+            }
+
+            if (memoryMapped != _XPLATSTR("on") && memoryMapped != _XPLATSTR("off"))
+            {
+                throw invalid_argument("mmap must be on or off");
+            }
+
+            file_request_options options;
+
+            if (retry == _XPLATSTR("exponential"))
+            {
+                options.set_retry_policy(exponential_retry_policy(chrono::seconds(retryInterval), retryAttempts));
+            }
+            else if (retry == _XPLATSTR("linear"))
+            {
+                options.set_retry_policy(linear_retry_policy(chrono::seconds(retryInterval), retryAttempts));
+            }
+            else if (retry == _XPLATSTR("none"))
+            {
+                options.set_retry_policy(no_retry_policy());
+            }
+            else
+            {
+                throw invalid_argument("retry must be exponential, linear or none");
+            }
+
+            if (timeout > 0)
+            {
+                // The server gives up after the timeout, and the client stops waiting for a
+                // request that has sent or received nothing for as long.
+                options.set_server_timeout(chrono::seconds(timeout));
+                options.set_noactivity_timeout(chrono::seconds(timeout));
+            }
+
+            options.set_parallelism_factor(parallelism);
+
+            m_values = values;
+            m_options = options;
+            m_range_size = static_cast<size_t>(rangeSize);
+            m_keep_alive = keepAlive == _XPLATSTR("on");
+            m_connections = connections;
+            m_memory_mapped = memoryMapped == _XPLATSTR("on");
+            m_bandwidth = bandwidth;
+            m_upload_bandwidth = uploadBandwidth;
+            m_download_bandwidth = downloadBandwidth;
+            m_burst = burst;
+        }
+
+        mutable mutex m_mutex;
+        map<string_t, string_t> m_values;
+        file_request_options m_options;
+        size_t m_range_size;
+        bool m_keep_alive;
+        size_t m_connections;
+        bool m_memory_mapped;
+        uint64_t m_bandwidth;
+        uint64_t m_upload_bandwidth;
+        uint64_t m_download_bandwidth;
+        uint64_t m_burst;
+    };
+
+    // Counts, bytes, retries and latency histograms for every storage call, split by operation.
+    // Each thread records into its own shard with relaxed atomic adds, so recording never takes a
+    // lock; readers add the shards up. Reset keeps a baseline instead of clearing the shards, so
+    // it cannot race with writers.
+    class TransferMetrics
+    {
+    public:
+        enum Operation
+        {
+            ShareList,
+            ShareExists,
+            DirectoryList,
+            DirectoryExists,
+            DirectoryCreate,
+            DirectoryDelete,
+            FileProperties,
+            FileCreate,
+            FileResize,
+            FileUpload,
+            FileDelete,
+            RangePut,
+            RangeGet,
+            RangeClear,
+            RangeList,
+            FileCopy,
+            FileCopyStatus,
+            OperationCount
+        };
+
+        // Four latency buckets per power of two microseconds, up to about 18 minutes.
+        static const size_t BucketCount = 4 * 30;
+
+        struct Summary
+        {
+            uint64_t started;
+            uint64_t completed;
+            uint64_t failed;
+            uint64_t retries;
+            uint64_t bytes;
+            uint64_t microseconds;
+            uint64_t buckets[BucketCount];
+
+            // Upper bound of the bucket holding the given fraction of completed calls, in milliseconds.
+            double Percentile(double fraction) const
+            {
+                uint64_t rank = static_cast<uint64_t>(ceil(fraction * completed));
+                uint64_t seen = 0;
+
+                for (size_t i = 0; i < BucketCount; i++)
+                {
+                    seen += buckets[i];
+
+                    if (seen >= rank && seen > 0)
+                    {
+                        return pow(2.0, (i + 1) / 4.0) / 1000.0;
+                    }
+                }
+
+                return 0.0;
+            }
+
+            double MeanMilliseconds() const
+            {
+                return completed > 0 ? microseconds / 1000.0 / completed : 0.0;
+            }
+        };
+
+        struct Snapshot
+        {
+            Summary operations[OperationCount];
+            double seconds;
+
+            Summary Total() const
+            {
+                Summary total = Summary();
+
+                for (auto& operation : operations)
+                {
+                    total.started += operation.started;
+                    total.completed += operation.completed;
+                    total.failed += operation.failed;
+                    total.retries += operation.retries;
+                    total.bytes += operation.bytes;
+                    total.microseconds += operation.microseconds;
+
+                    for (size_t i = 0; i < BucketCount; i++)
+                    {
+                        total.buckets[i] += operation.buckets[i];
+                    }
+                }
+
+                return total;
+            }
+        };
+
+        static TransferMetrics& Instance()
+        {
+            static TransferMetrics metrics;
+            return metrics;
+        }
+
+        static const char* Name(Operation operation)
+        {
+            static const char* const names[OperationCount] =
+            {
+                "ShareList", "ShareExists", "DirectoryList", "DirectoryExists", "DirectoryCreate", "DirectoryDelete",
+                "FileProperties", "FileCreate", "FileResize", "FileUpload", "FileDelete", "RangePut", "RangeGet",
+                "RangeClear", "RangeList", "FileCopy", "FileCopyStatus"
+            };
+
+            return names[operation];
+        }
+
+        // Issues a storage call with a fresh operation_context and records its latency, outcome
+        // and retries once it completes. The call's own task is returned unchanged. The call is
+        // expected to pass the profile's request options along with the context.
+        template<typename Call>
+        auto Measure(Operation operation, uint64_t bytes, Call call) -> decltype(call(operation_context()))
+        {
+            typedef decltype(call(operation_context())) Task;
+
+            operation_context context;
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+            if (!TransferProfile::Instance().KeepAlive())
+            {
+                context.user_headers().add(_XPLATSTR("Connection"), _XPLATSTR("close"));
+            }
+
+            LocalShard().counters[operation].started.fetch_add(1, memory_order_relaxed);
+
+            Task task;
+
+            try
+            {
+                task = call(context);
+            }
+            catch (...)
+            {
+                Record(operation, start, 0, true, 0);
+                throw;
+            }
+
+            task.then([this, operation, bytes, context, start](Task completed)
+            {
+                bool failed = false;
+                bool throttled = false;
+
+                try
+                {
+                    completed.get();
+                }
+                catch (...)
+                {
+                    failed = true;
+                    throttled = Util::IsThrottled(current_exception());
+                }
+
+                // Only attempts the service turned away as overloaded, or that timed out, count as
+                // retries. A call that issues several requests by design, such as a check followed
+                // by the request itself, is not congestion.
+                const vector<request_result>& results = context.request_results();
+                size_t retries = 0;
+
+                for (size_t i = 0; i + 1 < results.size(); i++)
+                {
+                    if (Util::IsThrottled(results[i]))
+                    {
+                        retries++;
+                    }
+                }
+
+                Record(operation, start, failed ? 0 : bytes, failed, retries);
+
+                if (retries > 0 || throttled)
+                {
+                    m_congestion.fetch_add(1, memory_order_relaxed);
+                }
+            });
+
+            return task;
+        }
+
+        // Storage calls so far that were retried or failed because the service was overloaded.
+        uint64_t CongestionEvents() const
+        {
+            return m_congestion.load(memory_order_relaxed);
+        }
+
+        Snapshot Take() const
+        {
+            Snapshot snapshot = Current();
+            Snapshot since;
+
+            {
+                lock_guard<mutex> lock(m_mutex);
+                since = m_baseline;
+                since.seconds = chrono::duration<double>(chrono::steady_clock::now() - m_since).count();
+            }
+
+            for (size_t op = 0; op < OperationCount; op++)
+            {
+                Summary& summary = snapshot.operations[op];
+                const Summary& baseline = since.operations[op];
+
+                summary.started -= baseline.started;
+                summary.completed -= baseline.completed;
+                summary.failed -= baseline.failed;
+                summary.retries -= baseline.retries;
+                summary.bytes -= baseline.bytes;
+                summary.microseconds -= baseline.microseconds;
+
+                for (size_t i = 0; i < BucketCount; i++)
+                {
+                    summary.buckets[i] -= baseline.buckets[i];
+                }
+            }
+
+            snapshot.seconds = since.seconds;
+            return snapshot;
+        }
+
+        void Reset()
+        {
+            Snapshot baseline = Current();
+            lock_guard<mutex> lock(m_mutex);
+            m_baseline = baseline;
+            m_since = chrono::steady_clock::now();
+        }
+
+        string_t ToJson() const
+        {
+            Snapshot snapshot = Take();
+            stringstream_t json;
+
+            json << _XPLATSTR("{\"seconds\":") << snapshot.seconds << _XPLATSTR(",\"operations\":{");
+
+            for (size_t op = 0; op < OperationCount; op++)
+            {
+                const Summary& summary = snapshot.operations[op];
+
+                json << (op > 0 ? _XPLATSTR(",") : _XPLATSTR("")) << _XPLATSTR("\"") << Name(static_cast<Operation>(op)) << _XPLATSTR("\":{")
+                    << _XPLATSTR("\"requests\":") << summary.completed
+                    << _XPLATSTR(",\"in_flight\":") << summary.started - summary.completed
+                    << _XPLATSTR(",\"errors\":") << summary.failed
+                    << _XPLATSTR(",\"retries\":") << summary.retries
+                    << _XPLATSTR(",\"bytes\":") << summary.bytes
+                    << _XPLATSTR(",\"mean_ms\":") << summary.MeanMilliseconds()
+                    << _XPLATSTR(",\"p50_ms\":") << summary.Percentile(0.50)
+                    << _XPLATSTR(",\"p99_ms\":") << summary.Percentile(0.99)
+                    << _XPLATSTR("}");
+            }
+
+            json << _XPLATSTR("}}");
+            return json.str();
+        }
+
+    private:
+
+        struct Counters
+        {
+            atomic<uint64_t> started;
+            atomic<uint64_t> completed;
+            atomic<uint64_t> failed;
+            atomic<uint64_t> retries;
+            atomic<uint64_t> bytes;
+            atomic<uint64_t> microseconds;
+            atomic<uint64_t> buckets[BucketCount];
+        };
+
+        struct Shard
+        {
+            Counters counters[OperationCount];
+        };
+
+        TransferMetrics()
+            : m_baseline(), m_since(chrono::steady_clock::now()), m_congestion(0)
+        {
+        }
+
+        Shard& LocalShard()
+        {
+            static thread_local Shard* shard = nullptr;
+
+            if (!shard)
+            {
+                lock_guard<mutex> lock(m_mutex);
+                m_shards.push_back(unique_ptr<Shard>(new Shard()));
+                shard = m_shards.back().get();
+            }
+
+            return *shard;
+        }
+
+        void Record(Operation operation, chrono::steady_clock::time_point start, uint64_t bytes, bool failed, size_t retries)
+        {
+            uint64_t microseconds = static_cast<uint64_t>(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count());
+            size_t bucket = microseconds > 1 ? static_cast<size_t>(log2(static_cast<double>(microseconds)) * 4) : 0;
+            Counters& counters = LocalShard().counters[operation];
+
+            counters.completed.fetch_add(1, memory_order_relaxed);
+            counters.failed.fetch_add(failed ? 1 : 0, memory_order_relaxed);
+            counters.retries.fetch_add(retries, memory_order_relaxed);
+            counters.bytes.fetch_add(bytes, memory_order_relaxed);
+            counters.microseconds.fetch_add(microseconds, memory_order_relaxed);
+            counters.buckets[(std::min)(bucket, BucketCount - 1)].fetch_add(1, memory_order_relaxed);
+        }
+
+        Snapshot Current() const
+        {
+            Snapshot snapshot = Snapshot();
+            lock_guard<mutex> lock(m_mutex);
+
+            for (auto& shard : m_shards)
+            {
+                for (size_t op = 0; op < OperationCount; op++)
+                {
+                    const Counters& counters = shard->counters[op];
+                    Summary& summary = snapshot.operations[op];
+
+                    summary.started += counters.started.load(memory_order_relaxed);
+                    summary.completed += counters.completed.load(memory_order_relaxed);
+                    summary.failed += counters.failed.load(memory_order_relaxed);
+                    summary.retries += counters.retries.load(memory_order_relaxed);
+                    summary.bytes += counters.bytes.load(memory_order_relaxed);
+                    summary.microseconds += counters.microseconds.load(memory_order_relaxed);
+
+                    for (size_t i = 0; i < BucketCount; i++)
+                    {
+                        summary.buckets[i] += counters.buckets[i].load(memory_order_relaxed);
+                    }
+                }
+            }
+
+            return snapshot;
+        }
+
+        mutable mutex m_mutex;
+        vector<unique_ptr<Shard>> m_shards;
+        Snapshot m_baseline;
+        chrono::steady_clock::time_point m_since;
+        atomic<uint64_t> m_congestion;
+    };
+
+    // Rewrites one status line on stderr every second while a command runs, as long as stderr
+    // is a terminal. Short commands finish before the first update and print nothing.
+    class ProgressLine
+    {
+    public:
+        ProgressLine()
+            : m_stopping(false), m_printed(false)
+        {
+#ifdef _WIN32
+            bool terminal = _isatty(_fileno(stderr)) != 0;
+#else
+            bool terminal = isatty(STDERR_FILENO) != 0;
+#endif
+
+            if (terminal)
+            {
+                m_thread = thread([this]()
+                {
+                    Run();
+                });
+            }
+        }
+
+        ~ProgressLine()
+        {
+            if (!m_thread.joinable())
+            {
+                return;
+            }
+
+            {
+                lock_guard<mutex> lock(m_mutex);
+                m_stopping = true;
+                m_stopped.notify_all();
+            }
+
+            m_thread.join();
+
+            if (m_printed)
+            {
+                ucerr << _XPLATSTR("\r") << string_t(79, _XPLATSTR(' ')) << _XPLATSTR("\r") << flush;
+            }
+        }
+
+    private:
+
+        void Run()
+        {
+            TransferMetrics::Summary previous = TransferMetrics::Instance().Take().Total();
+            unique_lock<mutex> lock(m_mutex);
+
+            while (!m_stopped.wait_for(lock, chrono::seconds(1), [this]() { return m_stopping; }))
+            {
+                TransferMetrics::Summary current = TransferMetrics::Instance().Take().Total();
+
+                ucerr << _XPLATSTR("\r") << current.completed - previous.completed << _XPLATSTR(" req/s, ")
+                    << (current.bytes - previous.bytes) / (1024.0 * 1024.0) << _XPLATSTR(" MB/s, ")
+                    << current.started - current.completed << _XPLATSTR(" in flight, ")
+                    << current.failed << _XPLATSTR(" errors, ") << current.retries << _XPLATSTR(" retries    ") << flush;
+
+                previous = current;
+                m_printed = true;
+            }
+        }
+
+        mutex m_mutex;
+        condition_variable m_stopped;
+        bool m_stopping;
+        bool m_printed;
+        thread m_thread;
+    };
+
+    // Runs actions after a delay on a single background thread, so that nothing waiting for a
+    // retry holds a thread pool thread.
+    class DelayTimer
+    {
+    public:
+        static DelayTimer& Instance()
+        {
+            static DelayTimer timer;
+            return timer;
+        }
+
+        ~DelayTimer()
+        {
+            {
+                lock_guard<mutex> lock(m_mutex);
+                m_stopping = true;
+                m_changed.notify_all();
+            }
+
+            m_thread.join();
+        }
+
+        void Schedule(chrono::steady_clock::duration delay, const function<void()>& action)
+        {
+            Entry entry;
+            entry.due = chrono::steady_clock::now() + delay;
+            entry.sequence = m_next_sequence++;
+            entry.action = action;
+
+            lock_guard<mutex> lock(m_mutex);
+            m_entries.push(entry);
+            m_changed.notify_all();
+        }
+
+    private:
+
+        struct Entry
+        {
+            chrono::steady_clock::time_point due;
+            uint64_t sequence;
+            function<void()> action;
+
+            bool operator<(const Entry& other) const
+            {
+                return due != other.due ? due > other.due : sequence > other.sequence;
+            }
+        };
+
+        DelayTimer()
+            : m_stopping(false), m_next_sequence(0)
+        {
+            m_thread = thread([this]()
+            {
+                Run();
+            });
+        }
+
+        void Run()
+        {
+            unique_lock<mutex> lock(m_mutex);
+
+            while (!m_stopping)
+            {
+                if (m_entries.empty())
+                {
+                    m_changed.wait(lock);
+                }
+                else if (m_entries.top().due > chrono::steady_clock::now())
+                {
+                    m_changed.wait_until(lock, m_entries.top().due);
+                }
+                else
+                {
+                    function<void()> action = m_entries.top().action;
+                    m_entries.pop();
+
+                    lock.unlock();
+                    action();
+                    action = nullptr;
+                    lock.lock();
+                }
+            }
+        }
+
+        mutex m_mutex;
+        condition_variable m_changed;
+        priority_queue<Entry> m_entries;
+        bool m_stopping;
+        atomic<uint64_t> m_next_sequence;
+        thread m_thread;
+    };
+
+    // A token bucket kept as a virtual clock, the generic cell rate algorithm: one atomic holds
+    // the time at which the bucket would be full again, and a reservation moves it forward by
+    // the time its bytes take at the rate with a compare-and-swap, so reserving never takes a
+    // lock. Bytes may go at once while the clock runs at most one burst ahead of now; beyond
+    // that each reservation waits exactly until it is within the burst, which spreads requests
+    // evenly instead of letting them stall and then go all together.
+    class TokenBucket
+    {
+    public:
+        TokenBucket()
+            : m_rate(0), m_burst(0), m_clock(0)
+        {
+        }
+
+        // Bytes per second, 0 for no limit, and the bytes that may go at once after a pause.
+        // Changing the limits forgets what was reserved under the old ones.
+        void Configure(uint64_t rate, uint64_t burst)
+        {
+            m_rate.store(rate, memory_order_relaxed);
+            m_burst.store(burst, memory_order_relaxed);
+            m_clock.store(0, memory_order_relaxed);
+        }
+
+        uint64_t Rate() const
+        {
+            return m_rate.load(memory_order_relaxed);
+        }
+
+        // Reserves the bytes and returns how long the caller has to wait before sending them.
+        chrono::nanoseconds Reserve(uint64_t bytes)
+        {
+            uint64_t rate = m_rate.load(memory_order_relaxed);
+
+            if (rate == 0)
+            {
+                return chrono::nanoseconds(0);
+            }
+
+            int64_t now = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+            int64_t tolerance = Nanoseconds(m_burst.load(memory_order_relaxed), rate);
+            int64_t cost = Nanoseconds(bytes, rate);
+            int64_t clock = m_clock.load(memory_order_relaxed);
+
+            // An idle bucket holds no more than one burst, so the clock never lags behind now.
+            while (!m_clock.compare_exchange_weak(clock, (std::max)(clock, now) + cost, memory_order_relaxed))
+            {
+            }
+
+            return chrono::nanoseconds((std::max)(clock - tolerance - now, static_cast<int64_t>(0)));
+        }
+
+    private:
+
+        static int64_t Nanoseconds(uint64_t bytes, uint64_t rate)
+        {
+            return static_cast<int64_t>(static_cast<double>(bytes) * 1e9 / static_cast<double>(rate));
+        }
+
+        atomic<uint64_t> m_rate;
+        atomic<uint64_t> m_burst;
+        atomic<int64_t> m_clock;
+    };
+
+    // Caps the bandwidth of a session: every range or small file sent or received reserves its
+    // bytes from the bucket for both directions and from the bucket for its own direction, and
+    // starts when both allow it. The wait runs on the delay timer, so no thread is held; the
+    // request keeps its scheduler slot meanwhile, so the number in flight settles at what the
+    // cap needs. The limits come from the profile and change with set.
+    class BandwidthShaper
+    {
+    public:
+        enum Direction
+        {
+            Up,
+            Down
+        };
+
+        static BandwidthShaper& Instance()
+        {
+            static BandwidthShaper shaper;
+            return shaper;
+        }
+
+        // Picks up the bandwidth settings of the profile.
+        void Reload()
+        {
+            const TransferProfile& profile = TransferProfile::Instance();
+            uint64_t burst = profile.Burst();
+
+            m_total.Configure(profile.Bandwidth(), burst);
+            m_up.Configure(profile.UploadBandwidth(), burst);
+            m_down.Configure(profile.DownloadBandwidth(), burst);
+        }
+
+        // Returns a task that finishes when the bytes may be sent.
+        pplx::task<void> Pace(Direction direction, uint64_t bytes)
+        {
+            chrono::nanoseconds delay = (std::max)(m_total.Reserve(bytes), (direction == Up ? m_up : m_down).Reserve(bytes));
+
+            if (delay.count() == 0)
+            {
+                return pplx::task_from_result();
+            }
+
+            pplx::task_completion_event<void> ready;
+
+            DelayTimer::Instance().Schedule(delay, [ready]()
+            {
+                ready.set();
+            });
+
+            return pplx::create_task(ready);
+        }
+
+    private:
+
+        BandwidthShaper()
+        {
+            Reload();
+        }
+
+        TokenBucket m_total;
+        TokenBucket m_up;
+        TokenBucket m_down;
+    };
+
+    // Chooses how many requests a scheduler keeps in flight, additive increase and
+    // multiplicative decrease. Until the first sign of congestion the limit grows by one per
+    // completion, doubling every round; after that it grows by one per round of completions.
+    // A round where requests were retried, throttled or timed out cuts it by a third, and so does
+    // a smoothed latency more than twice the best seen; neither cut happens more than once per
+    // round. The caller serializes access.
+    class ConcurrencyController
+    {
+    public:
+        ConcurrencyController(size_t initial, size_t ceiling)
+            : m_ceiling((std::max)(ceiling, static_cast<size_t>(1))),
+            m_limit((std::min)((std::max)(initial, static_cast<size_t>(1)), m_ceiling)),
+            m_credit(0),
+            m_slow_start(true),
+            m_smoothed(0.0),
+            m_best(0.0),
+            m_congestion_seen(TransferMetrics::Instance().CongestionEvents())
+        {
+        }
+
+        size_t Limit() const
+        {
+            return m_limit;
+        }
+
+        size_t Ceiling() const
+        {
+            return m_ceiling;
+        }
+
+        void Ceiling(size_t ceiling)
+        {
+            m_ceiling = (std::max)(ceiling, static_cast<size_t>(1));
+            m_limit = (std::min)(m_limit, m_ceiling);
+        }
+
+        void OnCompleted(chrono::steady_clock::duration latency)
+        {
+            double milliseconds = chrono::duration<double, milli>(latency).count();
+            uint64_t congestion = TransferMetrics::Instance().CongestionEvents();
+
+            m_smoothed = m_smoothed == 0.0 ? milliseconds : 0.9 * m_smoothed + 0.1 * milliseconds;
+
+            // The best latency drifts up slowly, so a permanent change in the workload, such as
+            // moving from listings to 4 MiB ranges, does not hold the limit down forever.
+            m_best = m_best == 0.0 ? m_smoothed : (std::min)(m_best * 1.001, m_smoothed);
+
+            if (congestion != m_congestion_seen)
+            {
+                m_congestion_seen = congestion;
+                Decrease();
+                return;
+            }
+
+            if (m_smoothed > 2.0 * m_best + 1.0)
+            {
+                Decrease();
+                return;
+            }
+
+            if (m_slow_start || ++m_credit >= m_limit)
+            {
+                m_credit = 0;
+                m_limit = (std::min)(m_limit + 1, m_ceiling);
+            }
+        }
+
+        void OnThrottled()
+        {
+            m_congestion_seen = TransferMetrics::Instance().CongestionEvents();
+            Decrease();
+        }
+
+    private:
+
+        void Decrease()
+        {
+            chrono::steady_clock::time_point now = chrono::steady_clock::now();
+
+            if (!m_slow_start && now - m_last_decrease < chrono::duration<double, milli>(m_smoothed))
+            {
+                return;
+            }
+
+            m_slow_start = false;
+            m_last_decrease = now;
+            m_credit = 0;
+            m_limit = (std::max)(m_limit * 2 / 3, static_cast<size_t>(1));
+        }
+
+        size_t m_ceiling;
+        size_t m_limit;
+        size_t m_credit;
+        bool m_slow_start;
+        double m_smoothed;
+        double m_best;
+        uint64_t m_congestion_seen;
+        chrono::steady_clock::time_point m_last_decrease;
+    };
+
+    // Runs transfer work with a bounded number of items in flight. Each work item returns the
+    // task that represents its storage request, and the next queued item starts as soon as one
+    // of those tasks finishes, so no thread is held while a request is outstanding.
+    // Submit blocks the caller while the queue is full and is meant for producers such as the
+    // directory walker. Post never blocks and is meant for continuations on the thread pool.
+    // The number in flight follows a ConcurrencyController, up to MaxInFlight. Work that fails
+    // because the service is overloaded goes back to the front of the queue after a jittered,
+    // growing delay instead of failing, up to MaxRequeues times. Work that must not run twice,
+    // such as starting a copy, is submitted as not idempotent and is never requeued.
+    // A scheduler made from a parent and a cancellation token queues its own work and hands it
+    // to the parent, which runs it on the session's connections. It keeps no more of its own
+    // work in flight than its limit, if it has one, and than the parent's limit, so a command's
+    // -p or a background job never changes what other commands get. Once the token is
+    // canceled, its work that has not started yet completes as canceled instead of running.
+    class TransferScheduler : public enable_shared_from_this<TransferScheduler>
+    {
+    public:
+        static const size_t DefaultInitialInFlight = 32;
+        static const size_t DefaultMaxInFlight = 256;
+        static const size_t DefaultQueueCapacity = 4096;
+        static const size_t MaxRequeues = 6;
+
+        TransferScheduler(size_t max_in_flight = DefaultMaxInFlight, size_t queue_capacity = DefaultQueueCapacity)
+            : m_max_in_flight(0),
+            m_controller(DefaultInitialInFlight, max_in_flight),
+            m_queue_capacity(queue_capacity > 0 ? queue_capacity : 1),
+            m_in_flight(0),
+            m_waiting(0),
+            m_random(random_device()())
+        {
+        }
+
+        // A max_in_flight of 0 leaves the limit to the parent.
+        TransferScheduler(const shared_ptr<TransferScheduler>& parent, const pplx::cancellation_token& token, size_t max_in_flight = 0)
+            : m_parent(parent),
+            m_token(token),
+            m_max_in_flight(max_in_flight),
+            m_controller(1, 1),
+            m_queue_capacity(DefaultQueueCapacity),
+            m_in_flight(0),
+            m_waiting(0)
+        {
+        }
+
+        // The ceiling for the adaptive limit, or the limit of a scheduler with a parent.
+        size_t MaxInFlight() const
+        {
+            if (m_parent)
+            {
+                size_t max_in_flight = m_max_in_flight.load();
+                return max_in_flight > 0 ? max_in_flight : m_parent->MaxInFlight();
+            }
+
+            lock_guard<mutex> lock(m_mutex);
+            return m_controller.Ceiling();
+        }
+
+        void MaxInFlight(size_t max_in_flight)
+        {
+            if (m_parent)
+            {
+                m_max_in_flight = max_in_flight;
+            }
+            else
+            {
+                lock_guard<mutex> lock(m_mutex);
+                m_controller.Ceiling(max_in_flight);
+            }
+
+            Pump();
+        }
+
+        // The number of items currently allowed in flight.
+        size_t Limit() const
+        {
+            if (m_parent)
+            {
+                size_t max_in_flight = m_max_in_flight.load();
+                size_t limit = m_parent->Limit();
+                return max_in_flight > 0 ? (std::min)(max_in_flight, limit) : limit;
+            }
+
+            lock_guard<mutex> lock(m_mutex);
+            return m_controller.Limit();
+        }
+
+        pplx::task<void> Submit(const function<pplx::task<void>()>& work, bool idempotent = true)
+        {
+            shared_ptr<Job> job = make_shared<Job>(work, idempotent);
+
+            {
+                unique_lock<mutex> lock(m_mutex);
+                m_not_full.wait(lock, [this]() { return m_queue.size() + m_waiting < m_queue_capacity; });
+                m_queue.push_back(job);
+            }
+
+            Pump();
+            return pplx::create_task(job->completed);
+        }
+
+        // Same as Submit, but the work becomes eligible to run only once the given task finishes.
+        // Until then it holds a queue entry, not an in-flight slot, so work waiting on other
+        // scheduled work cannot starve the scheduler.
+        pplx::task<void> Submit(const function<pplx::task<void>()>& work, const pplx::task<void>& after, bool idempotent = true)
+        {
+            shared_ptr<Job> job = make_shared<Job>(work, idempotent);
+            shared_ptr<TransferScheduler> self = shared_from_this();
+
+            {
+                unique_lock<mutex> lock(m_mutex);
+                m_not_full.wait(lock, [this]() { return m_queue.size() + m_waiting < m_queue_capacity; });
+                m_waiting++;
+            }
+
+            after.then([self, job](pplx::task<void> previous)->void
+            {
+                try
+                {
+                    previous.get();
+                }
+                catch (...)
+                {
+                    {
+                        lock_guard<mutex> lock(self->m_mutex);
+                        self->m_waiting--;
+                    }
+
+                    self->m_not_full.notify_one();
+                    job->completed.set_exception(current_exception());
+                    return;
+                }
+
+                {
+                    lock_guard<mutex> lock(self->m_mutex);
+                    self->m_waiting--;
+                    self->m_queue.push_back(job);
+                }
+
+                self->Pump();
+            });
+
+            return pplx::create_task(job->completed);
+        }
+
+        pplx::task<void> Post(const function<pplx::task<void>()>& work, bool idempotent = true)
+        {
+            shared_ptr<Job> job = make_shared<Job>(work, idempotent);
+
+            {
+                lock_guard<mutex> lock(m_mutex);
+                m_queue.push_back(job);
+            }
+
+            Pump();
+            return pplx::create_task(job->completed);
+        }
+
+    private:
+
+        // Checked when the work is about to start, so canceling drains the queue at once.
+        function<pplx::task<void>()> Guard(const function<pplx::task<void>()>& work) const
+        {
+            pplx::cancellation_token token = m_token;
+
+            return [work, token]()->pplx::task<void>
+            {
+                if (token.is_canceled())
+                {
+                    return pplx::task_from_exception<void>(pplx::task_canceled());
+                }
+
+                return work();
+            };
+        }
+
+        struct Job
+        {
+            Job(const function<pplx::task<void>()>& work, bool idempotent)
+                : work(work), idempotent(idempotent)
+            {
+            }
+
+            function<pplx::task<void>()> work;
+            bool idempotent;
+            pplx::task_completion_event<void> completed;
+            size_t requeues = 0;
+        };
+
+        void Pump()
+        {
+            while (true)
+            {
+                shared_ptr<Job> job;
+                size_t limit = m_parent ? Limit() : 0;
+
+                {
+                    lock_guard<mutex> lock(m_mutex);
+
+                    if (m_queue.empty() || m_in_flight >= (m_parent ? limit : m_controller.Limit()))
+                    {
+                        return;
+                    }
+
+                    job = m_queue.front();
+                    m_queue.pop_front();
+                    m_in_flight++;
+                }
+
+                m_not_full.notify_one();
+                Start(job);
+            }
+        }
+
+        void Start(const shared_ptr<Job>& job)
+        {
+            pplx::task<void> work;
+
+            try
+            {
+                // The parent does the requeuing, and it is done after the cancellation check.
+                work = m_parent ? m_parent->Post(Guard(job->work), job->idempotent) : job->work();
+            }
+            catch (...)
+            {
+                work = pplx::task_from_exception<void>(current_exception());
+            }
+
+            shared_ptr<TransferScheduler> self = shared_from_this();
+            chrono::steady_clock::time_point started = chrono::steady_clock::now();
+
+            work.then([self, job, started](pplx::task<void> previous)->void
+            {
+                exception_ptr error;
+
+                try
+                {
+                    previous.get();
+                }
+                catch (...)
+                {
+                    error = current_exception();
+                }
+
+                bool throttled = error && Util::IsThrottled(error) && !self->m_parent;
+                bool requeue = throttled && job->idempotent && job->requeues < MaxRequeues;
+                chrono::steady_clock::duration delay;
+
+                {
+                    lock_guard<mutex> lock(self->m_mutex);
+                    self->m_in_flight--;
+
+                    if (throttled)
+                    {
+                        self->m_controller.OnThrottled();
+                    }
+                    else if (!error && !self->m_parent)
+                    {
+                        self->m_controller.OnCompleted(chrono::steady_clock::now() - started);
+                    }
+
+                    if (requeue)
+                    {
+                        delay = self->RequeueDelay(job->requeues++);
+                        self->m_waiting++;
+                    }
+                }
+
+                if (requeue)
+                {
+                    DelayTimer::Instance().Schedule(delay, [self, job]()
+                    {
+                        {
+                            lock_guard<mutex> lock(self->m_mutex);
+                            self->m_waiting--;
+                            self->m_queue.push_front(job);
+                        }
+
+                        self->Pump();
+                    });
+                }
+                else if (error)
+                {
+                    job->completed.set_exception(error);
+                }
+                else
+                {
+                    job->completed.set();
+                }
+
+                self->Pump();
+            });
+        }
+
+        // 250 ms doubling with every requeue up to 8 s, spread by +-50% so that items throttled
+        // together do not come back together. Called with the lock held.
+        chrono::steady_clock::duration RequeueDelay(size_t requeues)
+        {
+            double base = (std::min)(250.0 * (1 << requeues), 8000.0);
+            double jittered = uniform_real_distribution<double>(0.5 * base, 1.5 * base)(m_random);
+            return chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double, milli>(jittered));
+        }
+
+        shared_ptr<TransferScheduler> m_parent;
+        pplx::cancellation_token m_token;
+        atomic<size_t> m_max_in_flight;
+        mutable mutex m_mutex;
+        condition_variable m_not_full;
+        deque<shared_ptr<Job>> m_queue;
+        ConcurrencyController m_controller;
+        size_t m_queue_capacity;
+        size_t m_in_flight;
+        size_t m_waiting;
+        mt19937 m_random;
+    };
+
+    // Tracks the tasks one command hands to the scheduler, so that the command waits for its
+    // own transfers only and can report how many of them failed. Canceled tasks are counted
+    // apart and not reported one by one.
+    class TransferBatch
+    {
+    public:
+        TransferBatch(const shared_ptr<TransferScheduler>& scheduler)
+            : m_scheduler(scheduler), m_state(make_shared<State>())
+        {
+        }
+
+        pplx::task<void> Submit(const function<pplx::task<void>()>& work)
+        {
+            return Track(m_scheduler->Submit(work));
+        }
+
+        pplx::task<void> Post(const function<pplx::task<void>()>& work)
+        {
+            return Track(m_scheduler->Post(work));
+        }
+
+        pplx::task<void> Track(const pplx::task<void>& task)
+        {
+            shared_ptr<State> state = m_state;
+
+            {
+                lock_guard<mutex> lock(state->m_mutex);
+                state->m_pending++;
+            }
+
+            task.then([state](pplx::task<void> previous)->void
+            {
+                bool succeeded = true;
+                bool canceled = false;
+
+                try
+                {
+                    previous.get();
+                }
+                catch (const pplx::task_canceled&)
+                {
+                    canceled = true;
+                }
+                catch (const std::exception& e)
+                {
+                    succeeded = false;
+                    ucout << e.what() << endl;
+                }
+                catch (...)
+                {
+                    succeeded = false;
+                }
+
+                lock_guard<mutex> lock(state->m_mutex);
+                state->m_pending--;
+
+                if (!succeeded)
+                {
+                    state->m_failed++;
+                }
+
+                if (canceled)
+                {
+                    state->m_canceled++;
+                }
+
+                if (state->m_pending == 0)
+                {
+                    state->m_idle.notify_all();
+                }
+            });
+
+            return task;
+        }
+
+        // Waits for every tracked task and throws if any of them failed or was canceled.
+        void Wait()
+        {
+            size_t failed = 0;
+            size_t canceled = 0;
+
+            {
+                unique_lock<mutex> lock(m_state->m_mutex);
+                m_state->m_idle.wait(lock, [this]() { return m_state->m_pending == 0; });
+                failed = m_state->m_failed;
+                canceled = m_state->m_canceled;
+            }
+
+            if (failed > 0)
+            {
+                throw runtime_error(to_string(failed) + " transfer(s) failed");
+            }
+
+            if (canceled > 0)
+            {
+                throw runtime_error(to_string(canceled) + " transfer(s) canceled");
+            }
+        }
+
+    private:
+
+        struct State
+        {
+            State()
+                : m_pending(0), m_failed(0), m_canceled(0)
+            {
+            }
+
+            mutex m_mutex;
+            condition_variable m_idle;
+            size_t m_pending;
+            size_t m_failed;
+            size_t m_canceled;
+        };
+
+        shared_ptr<TransferScheduler> m_scheduler;
+        shared_ptr<State> m_state;
+    };
+
+    // Paths of a large walk, stored as a tree: a node is only the index of its parent and the
+    // index of its name, and each distinct name is kept once in a shared character arena. A
+    // million entries cost a node each instead of a full path string each; the full path of an
+    // entry is built only when it is about to be used for I/O. Safe to use from several threads.
+    class PathTree
+    {
+    public:
+        typedef uint32_t Id;
+
+        // The root stands for the directory the walk started at, named by its full path.
+        static const Id Root = 0;
+
+        explicit PathTree(const string_t& root = string_t())
+        {
+            Node node;
+            node.parent = Root;
+            node.name = Intern(root.data(), root.size());
+            m_nodes.push_back(node);
+        }
+
+        // Appends a child the caller knows is new, such as an entry read from a directory
+        // listing, without looking it up first.
+        Id Add(Id parent, const utility::char_t* name, size_t length)
+        {
+            lock_guard<mutex> lock(m_mutex);
+            return Append(parent, Intern(name, length));
+        }
+
+        // Returns the child with the given name, adding it if the parent does not have it yet.
+        Id Child(Id parent, const string_t& name)
+        {
+            lock_guard<mutex> lock(m_mutex);
+            uint32_t index = Intern(name.data(), name.size());
+            uint64_t key = (static_cast<uint64_t>(parent) << 32) | index;
+            auto it = m_children.find(key);
+
+            if (it != m_children.end())
+            {
+                return it->second;
+            }
+
+            Id id = Append(parent, index);
+            m_children[key] = id;
+            return id;
+        }
+
+        Id Parent(Id id) const
+        {
+            lock_guard<mutex> lock(m_mutex);
+            return m_nodes[id].parent;
+        }
+
+        string_t Name(Id id) const
+        {
+            lock_guard<mutex> lock(m_mutex);
+            const Segment& segment = m_segments[m_nodes[id].name];
+            return string_t(m_characters.data() + segment.offset, segment.length);
+        }
+
+        // The names from below the root down to the node, for resolving it one level at a time.
+        vector<string_t> Names(Id id) const
+        {
+            lock_guard<mutex> lock(m_mutex);
+            vector<string_t> names(Chain(id).size());
+
+            for (size_t i = names.size(); i > 0; i--, id = m_nodes[id].parent)
+            {
+                const Segment& segment = m_segments[m_nodes[id].name];
+                names[i - 1].assign(m_characters.data() + segment.offset, segment.length);
+            }
+
+            return names;
+        }
+
+        // The full path of the node, starting with the name of the root.
+        string_t Path(Id id, utility::char_t separator) const
+        {
+            return Build(id, separator, true);
+        }
+
+        // The path of the node below the root; empty for the root itself.
+        string_t RelativePath(Id id, utility::char_t separator) const
+        {
+            return Build(id, separator, false);
+        }
+
+    private:
+
+        struct Node
+        {
+            Id parent;
+            uint32_t name;
+        };
+
+        struct Segment
+        {
+            size_t offset;
+            size_t length;
+        };
+
+        // Both expect the lock to be held.
+        Id Append(Id parent, uint32_t name)
+        {
+            if (m_nodes.size() >= (std::numeric_limits<Id>::max)())
+            {
+                throw runtime_error("Too many paths");
+            }
+
+            Node node;
+            node.parent = parent;
+            node.name = name;
+            m_nodes.push_back(node);
+            return static_cast<Id>(m_nodes.size() - 1);
+        }
+
+        uint32_t Intern(const utility::char_t* name, size_t length)
+        {
+            size_t hash = Hash(name, length);
+            auto range = m_names.equal_range(hash);
+
+            for (auto it = range.first; it != range.second; ++it)
+            {
+                const Segment& segment = m_segments[it->second];
+
+                if (segment.length == length && equal(name, name + length, m_characters.begin() + segment.offset))
+                {
+                    return it->second;
+                }
+            }
+
+            Segment segment;
+            segment.offset = m_characters.size();
+            segment.length = length;
+            m_characters.insert(m_characters.end(), name, name + length);
+            m_segments.push_back(segment);
+
+            uint32_t index = static_cast<uint32_t>(m_segments.size() - 1);
+            m_names.insert(make_pair(hash, index));
+            return index;
+        }
+
+        // The nodes from below the root down to id, deepest last; expects the lock to be held.
+        vector<Id> Chain(Id id) const
+        {
+            vector<Id> chain;
+
+            for (; id != Root; id = m_nodes[id].parent)
+            {
+                chain.push_back(id);
+            }
+
+            reverse(chain.begin(), chain.end());
+            return chain;
+        }
+
+        string_t Build(Id id, utility::char_t separator, bool withRoot) const
+        {
+            lock_guard<mutex> lock(m_mutex);
+            vector<Id> chain = Chain(id);
+            string_t path;
+
+            if (withRoot)
+            {
+                const Segment& root = m_segments[m_nodes[Root].name];
+                path.assign(m_characters.data() + root.offset, root.length);
+            }
+
+            for (Id node : chain)
+            {
+                if (!path.empty() && path.back() != separator)
+                {
+                    path.append(1, separator);
+                }
+
+                const Segment& segment = m_segments[m_nodes[node].name];
+                path.append(m_characters.data() + segment.offset, segment.length);
+            }
+
+            return path;
+        }
+
+        // FNV-1a, over the characters in place, so a lookup never has to build a string.
+        static size_t Hash(const utility::char_t* name, size_t length)
+        {
+            uint64_t hash = 14695981039346656037ULL;
+
+            for (size_t i = 0; i < length; i++)
+            {
+                hash ^= static_cast<uint64_t>(name[i]);
+                hash *= 1099511628211ULL;
+            }
+
+            return static_cast<size_t>(hash);
+        }
+
+        vector<Node> m_nodes;
+        vector<Segment> m_segments;
+        vector<utility::char_t> m_characters;
+        unordered_multimap<size_t, uint32_t> m_names;
+        unordered_map<uint64_t, Id> m_children;
+        mutable mutex m_mutex;
+    };
+
+    // Creates the remote directories of one command, each at most once. A directory is created
+    // as soon as its parent exists, so the directories of a level are created in parallel, and
+    // work inside a directory waits only for that directory. Directories are nodes of a path
+    // tree whose root is the remote root; a local walk can share the tree and pass its nodes.
+    class RemoteDirectoryCreator
+    {
+    public:
+        RemoteDirectoryCreator(const cloud_file_directory& root, const shared_ptr<TransferScheduler>& scheduler, const shared_ptr<PathTree>& tree = make_shared<PathTree>())
+            : m_root(root), m_scheduler(scheduler), m_tree(tree)
+        {
+        }
+
+        // Returns the task that creates the directory reached from the root through the given
+        // path segments. The root itself is assumed to exist.
+        pplx::task<void> Create(const vector<string_t>& parts)
+        {
+            return Create(Find(parts));
+        }
+
+        // Returns the task that creates the directory at the given node of the tree.
+        pplx::task<void> Create(PathTree::Id id)
+        {
+            if (id == PathTree::Root)
+            {
+                return pplx::task_from_result();
+            }
+
+            // Held across the recursion into the parent, so a directory is never scheduled twice.
+            lock_guard<recursive_mutex> lock(m_mutex);
+            auto it = m_created.find(id);
+
+            if (it != m_created.end())
+            {
+                return it->second;
+            }
+
+            pplx::task<void> parent = Create(m_tree->Parent(id));
+            cloud_file_directory directory = Directory(id);
+            shared_ptr<TransferScheduler> scheduler = m_scheduler;
+
+            pplx::task<void> created = parent.then([directory, scheduler]()
+            {
+                return scheduler->Post([directory]() mutable
+                {
+                    return TransferMetrics::Instance().Measure(TransferMetrics::DirectoryCreate, 0, [&directory](operation_context context)
+                    {
+                        return Util::Tolerate(directory.create_async(TransferProfile::Instance().RequestOptions(), context), 409);
+                    }).then([](bool)
+                    {
+                    });
+                });
+            });
+
+            m_created[id] = created;
+            return created;
+        }
+
+        // Records a directory that is known to exist, so that it is never created.
+        void AddExisting(const vector<string_t>& parts)
+        {
+            AddExisting(Find(parts));
+        }
+
+        void AddExisting(PathTree::Id id)
+        {
+            lock_guard<recursive_mutex> lock(m_mutex);
+            m_created[id] = pplx::task_from_result();
+        }
+
+        // The remote directory at the given node.
+        cloud_file_directory Directory(PathTree::Id id) const
+        {
+            cloud_file_directory directory = m_root;
+
+            for (auto& name : m_tree->Names(id))
+            {
+                directory = directory.get_subdirectory_reference(name);
+            }
+
+            return directory;
+        }
+
+        // The remote file at the given node.
+        cloud_file File(PathTree::Id id) const
+        {
+            return Directory(m_tree->Parent(id)).get_file_reference(m_tree->Name(id));
+        }
+
+    private:
+
+        PathTree::Id Find(const vector<string_t>& parts)
+        {
+            PathTree::Id id = PathTree::Root;
+
+            for (auto& part : parts)
+            {
+                id = m_tree->Child(id, part);
+            }
+
+            return id;
+        }
+
+        cloud_file_directory m_root;
+        shared_ptr<TransferScheduler> m_scheduler;
+        shared_ptr<PathTree> m_tree;
+        recursive_mutex m_mutex;
+        unordered_map<PathTree::Id, pplx::task<void>> m_created;
+    };
+
+    // Lists a remote directory tree. Every listing segment runs as its own work item on the
+    // scheduler, so directories are listed in parallel, and the next segment of a directory is
+    // requested before the current one is processed. The action sees each file and directory
+    // with its path relative to the root, possibly from several threads at once, and returns
+    // false for a directory whose contents should be skipped.
+    class RemoteWalker
+    {
+    public:
+        typedef function<bool(const string_t&, const list_file_and_directory_item&)> Action;
+
+        static pplx::task<void> Walk(const shared_ptr<TransferScheduler>& scheduler, const cloud_file_directory& root, const Action& action)
+        {
+            shared_ptr<State> state = make_shared<State>(scheduler, action);
+            List(state, root, string_t(), continuation_token());
+            return pplx::create_task(state->m_completed);
+        }
+
+        static string_t Name(const list_file_and_directory_item& item)
+        {
+            return item.is_directory() ? item.as_directory().name() : item.as_file().name();
+        }
+
+    private:
+
+        struct State
+        {
+            State(const shared_ptr<TransferScheduler>& scheduler, const Action& action)
+                : m_scheduler(scheduler), m_action(action), m_pending(0)
+            {
+            }
+
+            shared_ptr<TransferScheduler> m_scheduler;
+            Action m_action;
+            mutex m_mutex;
+            size_t m_pending;
+            exception_ptr m_error;
+            pplx::task_completion_event<void> m_completed;
+        };
+
+        static void List(const shared_ptr<State>& state, const cloud_file_directory& directory, const string_t& path, const continuation_token& token)
+        {
+            {
+                lock_guard<mutex> lock(state->m_mutex);
+
+                if (state->m_error)
+                {
+                    return;
+                }
+
+                state->m_pending++;
+            }
+
+            shared_ptr<list_file_and_directory_result_segment> segment = make_shared<list_file_and_directory_result_segment>();
+
+            state->m_scheduler->Post([directory, token, segment]()
+            {
+                return TransferMetrics::Instance().Measure(TransferMetrics::DirectoryList, 0, [&](operation_context context)
+                {
+                    return directory.list_files_and_directories_segmented_async(0, token, TransferProfile::Instance().RequestOptions(), context);
+                }).then([segment](const list_file_and_directory_result_segment& result)
+                {
+                    *segment = result;
+                });
+            }).then([state, directory, path, segment](pplx::task<void> previous)->void
+            {
+                try
+                {
+                    previous.get();
+
+                    if (!segment->continuation_token().empty())
+                    {
+                        List(state, directory, path, segment->continuation_token());
+                    }
+
+                    for (auto& item : segment->results())
+                    {
+                        string_t itemPath = path.empty() ? Name(item) : path + _XPLATSTR("/") + Name(item);
+
+                        if (state->m_action(itemPath, item) && item.is_directory())
+                        {
+                            List(state, item.as_directory(), itemPath, continuation_token());
+                        }
+                    }
+                }
+                catch (...)
+                {
+                    lock_guard<mutex> lock(state->m_mutex);
+
+                    if (!state->m_error)
+                    {
+                        state->m_error = current_exception();
+                    }
+                }
+
+                Done(state);
+            });
+        }
+
+        static void Done(const shared_ptr<State>& state)
+        {
+            exception_ptr error;
+
+            {
+                lock_guard<mutex> lock(state->m_mutex);
+
+                if (--state->m_pending > 0)
+                {
+                    return;
+                }
+
+                error = state->m_error;
+            }
+
+            if (error)
+            {
+                state->m_completed.set_exception(error);
+            }
+            else
+            {
+                state->m_completed.set();
+            }
+        }
+    };
+
+    // Copies files inside the service, so the data never passes through this machine. Each copy
+    // is started through the scheduler and then polled with a growing delay until the service
+    // reports it finished; a failed poll is retried, and only a run of them fails the copy.
+    // Copy blocks the caller while max_copies copies are pending.
+    class RemoteCopier
+    {
+    public:
+        static const size_t DefaultMaxCopies = 64;
+
+        struct Progress
+        {
+            size_t started;
+            size_t succeeded;
+            size_t failed;
+            int64_t bytesCopied;
+            int64_t totalBytes;
+        };
+
+        RemoteCopier(const shared_ptr<TransferScheduler>& scheduler, size_t max_copies = DefaultMaxCopies)
+            : m_scheduler(scheduler), m_state(make_shared<State>((std::max)(max_copies, static_cast<size_t>(1))))
+        {
+        }
+
+        // Copies source over destination once the after task completes. Within the account the
+        // source is authorized by the same credentials; otherwise its credentials must be a SAS.
+        void Copy(const cloud_file& source, cloud_file destination, int64_t size, const pplx::task<void>& after)
+        {
+            shared_ptr<State> state = m_state;
+            shared_ptr<TransferScheduler> scheduler = m_scheduler;
+            web::uri sourceUri = source.service_client().credentials().transform_uri(source.uri().primary_uri());
+            shared_ptr<int64_t> reported = make_shared<int64_t>(0);
+
+            {
+                unique_lock<mutex> lock(state->m_mutex);
+                state->m_below_cap.wait(lock, [state]() { return state->m_pending < state->m_max_copies; });
+                state->m_pending++;
+                state->m_progress.started++;
+                state->m_progress.totalBytes += size;
+            }
+
+            scheduler->Submit([destination, sourceUri]() mutable
+            {
+                return TransferMetrics::Instance().Measure(TransferMetrics::FileCopy, 0, [&](operation_context context)
+                {
+                    return destination.start_copy_async(sourceUri, file_access_condition(), file_access_condition(), TransferProfile::Instance().RequestOptions(), context);
+                }).then([](const string_t&)
+                {
+                });
+            }, after, false).then([state, scheduler, destination, reported](pplx::task<void> started)
+            {
+                try
+                {
+                    started.get();
+                }
+                catch (...)
+                {
+                    Finish(state, current_exception());
+                    return;
+                }
+
+                if (destination.copy_state().status() == copy_status::success)
+                {
+                    Report(state, reported, destination.copy_state().bytes_copied());
+                    Finish(state, nullptr);
+                    return;
+                }
+
+                Poll(state, scheduler, destination, reported, InitialPollDelay(), 0);
+            });
+        }
+
+        Progress Current() const
+        {
+            lock_guard<mutex> lock(m_state->m_mutex);
+            return m_state->m_progress;
+        }
+
+        // Waits up to the timeout for every copy to finish and returns whether they have.
+        bool WaitFor(chrono::steady_clock::duration timeout)
+        {
+            unique_lock<mutex> lock(m_state->m_mutex);
+            return m_state->m_below_cap.wait_for(lock, timeout, [this]() { return m_state->m_pending == 0; });
+        }
+
+        // Waits for every copy and throws if any of them failed.
+        void Wait()
+        {
+            while (!WaitFor(chrono::seconds(1)))
+            {
+            }
+
+            lock_guard<mutex> lock(m_state->m_mutex);
+
+            if (m_state->m_progress.failed > 0)
+            {
+                throw runtime_error(to_string(m_state->m_progress.failed) + " copies failed");
+            }
+        }
+
+    private:
+
+        struct State
+        {
+            State(size_t max_copies)
+                : m_max_copies(max_copies), m_pending(0), m_progress()
+            {
+            }
+
+            size_t m_max_copies;
+            mutex m_mutex;
+            condition_variable m_below_cap;
+            size_t m_pending;
+            Progress m_progress;
+        };
+
+        // Polling starts after half a second and slows down to every ten seconds.
+        static chrono::milliseconds InitialPollDelay()
+        {
+            return chrono::milliseconds(500);
+        }
+
+        static chrono::milliseconds MaxPollDelay()
+        {
+            return chrono::milliseconds(10000);
+        }
+
+        // A failed poll says nothing about the copy, which keeps running in the service, so it is
+        // retried with the growing delay; only this many failures in a row fail the copy.
+        static size_t MaxPollFailures()
+        {
+            return 5;
+        }
+
+        static void Poll(const shared_ptr<State>& state, const shared_ptr<TransferScheduler>& scheduler, cloud_file destination, const shared_ptr<int64_t>& reported, chrono::milliseconds delay, size_t failures)
+        {
+            DelayTimer::Instance().Schedule(delay, [state, scheduler, destination, reported, delay, failures]()
+            {
+                scheduler->Post([destination]() mutable
+                {
+                    return TransferMetrics::Instance().Measure(TransferMetrics::FileCopyStatus, 0, [&destination](operation_context context)
+                    {
+                        return destination.download_attributes_async(file_access_condition(), TransferProfile::Instance().RequestOptions(), context);
+                    });
+                }).then([state, scheduler, destination, reported, delay, failures](pplx::task<void> polled)
+                {
+                    chrono::milliseconds next = (std::min)(delay * 2, MaxPollDelay());
+
+                    try
+                    {
+                        polled.get();
+                    }
+                    catch (...)
+                    {
+                        if (failures + 1 < MaxPollFailures())
+                        {
+                            Poll(state, scheduler, destination, reported, next, failures + 1);
+                        }
+                        else
+                        {
+                            Finish(state, current_exception());
+                        }
+
+                        return;
+                    }
+
+                    const azure::storage::copy_state& copy = destination.copy_state();
+                    Report(state, reported, copy.bytes_copied());
+
+                    switch (copy.status())
+                    {
+                    case copy_status::pending:
+                        Poll(state, scheduler, destination, reported, next, 0);
+                        break;
+                    case copy_status::success:
+                        Finish(state, nullptr);
+                        break;
+                    default:
+                        Finish(state, make_exception_ptr(runtime_error("Copy of " + conversions::to_utf8string(destination.name()) + " did not complete: " + conversions::to_utf8string(copy.status_description()))));
+                        break;
+                    }
+                });
+            });
+        }
+
+        static void Report(const shared_ptr<State>& state, const shared_ptr<int64_t>& reported, int64_t bytesCopied)
+        {
+            lock_guard<mutex> lock(state->m_mutex);
+            state->m_progress.bytesCopied += bytesCopied - *reported;
+            *reported = bytesCopied;
+        }
+
+        static void Finish(const shared_ptr<State>& state, const exception_ptr& error)
+        {
+            if (error)
+            {
+                try
+                {
+                    rethrow_exception(error);
+                }
+                catch (const std::exception& e)
+                {
+                    ucout << e.what() << endl;
+                }
+                catch (...)
+                {
+                }
+            }
+
+            lock_guard<mutex> lock(state->m_mutex);
+            state->m_pending--;
+
+            if (error)
+            {
+                state->m_progress.failed++;
+            }
+            else
+            {
+                state->m_progress.succeeded++;
+            }
+
+            state->m_below_cap.notify_all();
+        }
+
+        shared_ptr<TransferScheduler> m_scheduler;
+        shared_ptr<State> m_state;
+    };
+
+    // Deletes a remote directory tree without blocking inside the thread pool. Listing segments
+    // and deletes are work items on the scheduler, so the number of requests in flight stays
+    // bounded. Files are deleted as soon as the segment naming them arrives, and a directory is
+    // deleted once its listing is complete and all of its children are gone.
+    class RemoteTreeDeleter
+    {
+    public:
+        struct Result
+        {
+            size_t files;
+            size_t directories;
+        };
+
+        static pplx::task<Result> Delete(const shared_ptr<TransferScheduler>& scheduler, const cloud_file_directory& root)
+        {
+            shared_ptr<State> state = make_shared<State>(scheduler);
+            shared_ptr<Node> node = make_shared<Node>(root, nullptr);
+            List(state, node, continuation_token());
+
+            return pplx::create_task(state->m_completed).then([state]()
+            {
+                Result result;
+                result.files = state->m_files;
+                result.directories = state->m_directories;
+                return result;
+            });
+        }
+
+    private:
+
+        struct State
+        {
+            State(const shared_ptr<TransferScheduler>& scheduler)
+                : m_scheduler(scheduler), m_files(0), m_directories(0)
+            {
+            }
+
+            shared_ptr<TransferScheduler> m_scheduler;
+            atomic<size_t> m_files;
+            atomic<size_t> m_directories;
+            mutex m_mutex;
+            exception_ptr m_error;
+            pplx::task_completion_event<void> m_completed;
+        };
+
+        // A directory being emptied. It counts the listing segments and children that are still
+        // outstanding; the last one to finish deletes the directory and releases the parent.
+        struct Node
+        {
+            Node(const cloud_file_directory& directory, const shared_ptr<Node>& parent)
+                : m_directory(directory), m_parent(parent), m_pending(0), m_failed(false)
+            {
+            }
+
+            cloud_file_directory m_directory;
+            shared_ptr<Node> m_parent;
+            atomic<size_t> m_pending;
+            atomic<bool> m_failed;
+        };
+
+        static void List(const shared_ptr<State>& state, const shared_ptr<Node>& node, const continuation_token& token)
+        {
+            node->m_pending++;
+
+            shared_ptr<list_file_and_directory_result_segment> segment = make_shared<list_file_and_directory_result_segment>();
+            cloud_file_directory directory = node->m_directory;
+
+            state->m_scheduler->Post([directory, token, segment]()
+            {
+                return TransferMetrics::Instance().Measure(TransferMetrics::DirectoryList, 0, [&](operation_context context)
+                {
+                    return directory.list_files_and_directories_segmented_async(0, token, TransferProfile::Instance().RequestOptions(), context);
+                }).then([segment](const list_file_and_directory_result_segment& result)
+                {
+                    *segment = result;
+                });
+            }).then([state, node, segment](pplx::task<void> previous)->void
+            {
+                try
+                {
+                    previous.get();
+                }
+                catch (...)
+                {
+                    Fail(state, node, current_exception());
+                    Release(state, node);
+                    return;
+                }
+
+                if (!segment->continuation_token().empty())
+                {
+                    List(state, node, segment->continuation_token());
+                }
+
+                for (auto& item : segment->results())
+                {
+                    if (item.is_directory())
+                    {
+                        node->m_pending++;
+                        List(state, make_shared<Node>(item.as_directory(), node), continuation_token());
+                    }
+                    else if (item.is_file())
+                    {
+                        RemoveFile(state, node, item.as_file());
+                    }
+                }
+
+                Release(state, node);
+            });
+        }
+
+        static void RemoveFile(const shared_ptr<State>& state, const shared_ptr<Node>& node, cloud_file file)
+        {
+            node->m_pending++;
+
+            state->m_scheduler->Post([file]() mutable
+            {
+                return TransferMetrics::Instance().Measure(TransferMetrics::FileDelete, 0, [&file](operation_context context)
+                {
+                    return Util::Tolerate(file.delete_file_async(file_access_condition(), TransferProfile::Instance().RequestOptions(), context), 404);
+                }).then([](bool)
+                {
+                });
+            }).then([state, node](pplx::task<void> previous)->void
+            {
+                try
+                {
+                    previous.get();
+                    state->m_files++;
+                }
+                catch (...)
+                {
+                    Fail(state, node, current_exception());
+                }
+
+                Release(state, node);
+            });
+        }
+
+        static void Release(const shared_ptr<State>& state, const shared_ptr<Node>& node)
+        {
+            if (--node->m_pending > 0)
+            {
+                return;
+            }
+
+            if (node->m_failed)
+            {
+                // The directory cannot be empty, so leave it and everything above it in place.
+                Finish(state, node, false);
+                return;
+            }
+
+            cloud_file_directory directory = node->m_directory;
+
+            state->m_scheduler->Post([directory]() mutable
+            {
+                return TransferMetrics::Instance().Measure(TransferMetrics::DirectoryDelete, 0, [&directory](operation_context context)
+                {
+                    return Util::Tolerate(directory.delete_directory_async(file_access_condition(), TransferProfile::Instance().RequestOptions(), context), 404);
+                }).then([](bool)
+                {
+                });
+            }).then([state, node](pplx::task<void> previous)->void
+            {
+                bool deleted = true;
+
+                try
+                {
+                    previous.get();
+                    state->m_directories++;
+                }
+                catch (...)
+                {
+                    Fail(state, node, current_exception());
+                    deleted = false;
+                }
+
+                Finish(state, node, deleted);
+            });
+        }
+
+        static void Finish(const shared_ptr<State>& state, const shared_ptr<Node>& node, bool deleted)
+        {
+            if (node->m_parent)
+            {
+                if (!deleted)
+                {
+                    node->m_parent->m_failed = true;
+                }
+
+                Release(state, node->m_parent);
+                return;
+            }
+
+            exception_ptr error;
+
+            {
+                lock_guard<mutex> lock(state->m_mutex);
+                error = state->m_error;
+            }
+
+            if (error)
+            {
+                state->m_completed.set_exception(error);
+            }
+            else
+            {
+                state->m_completed.set();
+            }
+        }
+
+        static void Fail(const shared_ptr<State>& state, const shared_ptr<Node>& node, const exception_ptr& error)
+        {
+            node->m_failed = true;
+
+            lock_guard<mutex> lock(state->m_mutex);
+
+            if (!state->m_error)
+            {
+                state->m_error = error;
+            }
+        }
+    };
+
+    // Session cache of remote listings, existence checks and directory usage, keyed by URI.
+    // Everyone who asks for a listing while it is being fetched shares the same request. Entries
+    // expire after a time to live, and commands that change the share drop the entries under the
+    // directory they touched. Usage totals also include everything below a directory, so they
+    // are dropped for the directories above it too, and they are kept longer because a tree
+    // can take a long time to add up.
+    class RemoteCache : public enable_shared_from_this<RemoteCache>
+    {
+    public:
+        struct Entry
+        {
+            string_t name;
+            bool isDirectory;
+            int64_t length;
+        };
+
+        typedef vector<Entry> Listing;
+
+        // The totals of a directory tree, with the names of its subdirectories so that deeper
+        // levels can be read from the cache as well.
+        struct Usage
+        {
+            int64_t bytes;
+            size_t files;
+            size_t directories;
+            vector<string_t> subdirectories;
+        };
+
+        RemoteCache(chrono::seconds time_to_live = chrono::seconds(30), chrono::seconds usage_time_to_live = chrono::seconds(600))
+            : m_time_to_live(time_to_live), m_usage_time_to_live(usage_time_to_live), m_next_id(0)
+        {
+        }
+
+        chrono::seconds TimeToLive() const
+        {
+            lock_guard<mutex> lock(m_mutex);
+            return m_time_to_live;
+        }
+
+        void TimeToLive(chrono::seconds time_to_live)
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_time_to_live = time_to_live;
+        }
+
+        pplx::task<shared_ptr<const Listing>> ListDirectory(const cloud_file_directory& directory)
+        {
+            return Fetch(directory.uri().primary_uri().to_string(), [directory]()
+            {
+                shared_ptr<Listing> listing = make_shared<Listing>();
+
+                return ListSegments(directory, continuation_token(), listing).then([listing]()
+                {
+                    return shared_ptr<const Listing>(listing);
+                });
+            });
+        }
+
+        pplx::task<shared_ptr<const Listing>> ListShares(const cloud_file_client& client)
+        {
+            return Fetch(client.base_uri().primary_uri().to_string(), [client]()
+            {
+                shared_ptr<Listing> listing = make_shared<Listing>();
+
+                return ListShareSegments(client, continuation_token(), listing).then([listing]()
+                {
+                    return shared_ptr<const Listing>(listing);
+                });
+            });
+        }
+
+        // Starts listing a directory in the background, so that a following dir, or a cd into
+        // one of its subdirectories, is answered from memory.
+        void Prefetch(const cloud_file_directory& directory)
+        {
+            ListDirectory(directory).then([](pplx::task<shared_ptr<const Listing>> listing)
+            {
+                try
+                {
+                    listing.get();
+                }
+                catch (...)
+                {
+                    // A failed prefetch is not cached; the command that needs the listing retries it.
+                }
+            });
+        }
+
+        bool DirectoryExists(const cloud_file_directory& parent, const string_t& name)
+        {
+            cloud_file_directory directory = parent.get_subdirectory_reference(name);
+            string_t key = directory.uri().primary_uri().to_string();
+            bool exists = false;
+
+            if (FindInListing(parent.uri().primary_uri().to_string(), name, exists) || FindExists(key, exists))
+            {
+                return exists;
+            }
+
+            exists = TransferMetrics::Instance().Measure(TransferMetrics::DirectoryExists, 0, [&directory](operation_context context)
+            {
+                return directory.exists_async(TransferProfile::Instance().RequestOptions(), context);
+            }).get();
+            AddExists(key, exists);
+            return exists;
+        }
+
+        bool ShareExists(const cloud_file_client& client, const string_t& name)
+        {
+            cloud_file_share share = client.get_share_reference(name);
+            string_t key = share.uri().primary_uri().to_string();
+            bool exists = false;
+
+            if (FindInListing(client.base_uri().primary_uri().to_string(), name, exists) || FindExists(key, exists))
+            {
+                return exists;
+            }
+
+            exists = TransferMetrics::Instance().Measure(TransferMetrics::ShareExists, 0, [&share](operation_context context)
+            {
+                return share.exists_async(TransferProfile::Instance().RequestOptions(), context);
+            }).get();
+            AddExists(key, exists);
+            return exists;
+        }
+
+        // Returns the listing of the URI if it is complete and fresh, or null.
+        shared_ptr<const Listing> Find(const string_t& uri)
+        {
+            lock_guard<mutex> lock(m_mutex);
+            auto it = m_listings.find(uri);
+
+            if (it == m_listings.end() || !it->second.done || Expired(it->second.fetched))
+            {
+                return shared_ptr<const Listing>();
+            }
+
+            return it->second.listing.get();
+        }
+
+        void AddUsage(const string_t& uri, const Usage& usage)
+        {
+            CachedUsage entry;
+            entry.usage = make_shared<Usage>(usage);
+            entry.computed = chrono::steady_clock::now();
+
+            lock_guard<mutex> lock(m_mutex);
+            m_usage[uri] = entry;
+        }
+
+        // Returns the usage of the directory at the URI if it is fresh, or null.
+        shared_ptr<const Usage> FindUsage(const string_t& uri)
+        {
+            lock_guard<mutex> lock(m_mutex);
+            auto it = m_usage.find(uri);
+
+            if (it == m_usage.end() || chrono::steady_clock::now() - it->second.computed > m_usage_time_to_live)
+            {
+                return shared_ptr<const Usage>();
+            }
+
+            return it->second.usage;
+        }
+
+        // Drops everything cached for the URI and for everything below it, and the usage of the
+        // directories above it.
+        void Invalidate(const string_t& uri)
+        {
+            lock_guard<mutex> lock(m_mutex);
+            Erase(m_listings, uri);
+            Erase(m_exists, uri);
+            Erase(m_usage, uri);
+
+            for (size_t slash = uri.find_last_of(_XPLATSTR('/')); slash != string_t::npos && slash > 0; slash = uri.find_last_of(_XPLATSTR('/'), slash - 1))
+            {
+                m_usage.erase(uri.substr(0, slash));
+            }
+        }
+
+    private:
+
+        struct CachedListing
+        {
+            pplx::task<shared_ptr<const Listing>> listing;
+            chrono::steady_clock::time_point fetched;
+            bool done;
+            uint64_t id;
+        };
+
+        struct CachedExists
+        {
+            bool exists;
+            chrono::steady_clock::time_point fetched;
+        };
+
+        struct CachedUsage
+        {
+            shared_ptr<const Usage> usage;
+            chrono::steady_clock::time_point computed;
+        };
+
+        pplx::task<shared_ptr<const Listing>> Fetch(const string_t& key, const function<pplx::task<shared_ptr<const Listing>>()>& list)
+        {
+            unique_lock<mutex> lock(m_mutex);
+            auto it = m_listings.find(key);
+
+            if (it != m_listings.end() && (!it->second.done || !Expired(it->second.fetched)))
+            {
+                return it->second.listing;
+            }
+
+            pplx::task<shared_ptr<const Listing>> listing = list();
+            uint64_t id = ++m_next_id;
+
+            CachedListing& entry = m_listings[key];
+            entry.listing = listing;
+            entry.done = false;
+            entry.id = id;
+            lock.unlock();
+
+            shared_ptr<RemoteCache> self = shared_from_this();
+
+            listing.then([self, key, id](pplx::task<shared_ptr<const Listing>> result)->void
+            {
+                bool failed = false;
+
+                try
+                {
+                    result.get();
+                }
+                catch (...)
+                {
+                    failed = true;
+                }
+
+                lock_guard<mutex> lock(self->m_mutex);
+                auto it = self->m_listings.find(key);
+
+                // The entry may have been invalidated, or replaced, while the listing ran.
+                if (it == self->m_listings.end() || it->second.id != id)
+                {
+                    return;
+                }
+
+                if (failed)
+                {
+                    self->m_listings.erase(it);
+                }
+                else
+                {
+                    it->second.done = true;
+                    it->second.fetched = chrono::steady_clock::now();
+                }
+            });
+
+            return listing;
+        }
+
+        // A cached listing can only confirm a directory. Names are case-insensitive in the
+        // service, so a name missing from the listing as spelled may still exist, and the
+        // caller has to ask.
+        bool FindInListing(const string_t& key, const string_t& name, bool& exists)
+        {
+            shared_ptr<const Listing> listing = Find(key);
+
+            if (!listing)
+            {
+                return false;
+            }
+
+            bool found = std::find_if(listing->begin(), listing->end(), [&name](const Entry& entry)
+            {
+                return entry.isDirectory && entry.name == name;
+            }) != listing->end();
+
+            if (found)
+            {
+                exists = true;
+            }
+
+            return found;
+        }
+
+        bool FindExists(const string_t& key, bool& exists)
+        {
+            lock_guard<mutex> lock(m_mutex);
+            auto it = m_exists.find(key);
+
+            if (it == m_exists.end() || Expired(it->second.fetched))
+            {
+                return false;
+            }
+
+            exists = it->second.exists;
+            return true;
+        }
+
+        void AddExists(const string_t& key, bool exists)
+        {
+            CachedExists entry;
+            entry.exists = exists;
+            entry.fetched = chrono::steady_clock::now();
+
+            lock_guard<mutex> lock(m_mutex);
+            m_exists[key] = entry;
+        }
+
+        bool Expired(const chrono::steady_clock::time_point& fetched) const
+        {
+            return chrono::steady_clock::now() - fetched > m_time_to_live;
+        }
+
+        template<typename T>
+        static void Erase(map<string_t, T>& entries, const string_t& uri)
+        {
+            string_t prefix = uri;
+
+            if (!prefix.empty() && prefix.back() == _XPLATSTR('/'))
+            {
+                prefix.pop_back();
+            }
+
+            auto it = entries.lower_bound(prefix);
+
+            while (it != entries.end() && it->first.compare(0, prefix.size(), prefix) == 0)
+            {
+                if (it->first.size() == prefix.size() || it->first[prefix.size()] == _XPLATSTR('/'))
+                {
+                    it = entries.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+        }
+
+        static pplx::task<void> ListSegments(cloud_file_directory directory, const continuation_token& token, const shared_ptr<Listing>& listing)
+        {
+            return TransferMetrics::Instance().Measure(TransferMetrics::DirectoryList, 0, [&](operation_context context)
+            {
+                return directory.list_files_and_directories_segmented_async(0, token, TransferProfile::Instance().RequestOptions(), context);
+            }).then([directory, listing](const list_file_and_directory_result_segment& segment)
+            {
+                for (auto& item : segment.results())
+                {
+                    Entry entry;
+                    entry.isDirectory = item.is_directory();
+                    entry.name = entry.isDirectory ? item.as_directory().name() : item.as_file().name();
+                    entry.length = entry.isDirectory ? 0 : static_cast<int64_t>(item.as_file().properties().length());
+                    listing->push_back(entry);
+                }
+
+                if (segment.continuation_token().empty())
+                {
+                    return pplx::task_from_result();
+                }
+
+                return ListSegments(directory, segment.continuation_token(), listing);
+            });
+        }
+
+        static pplx::task<void> ListShareSegments(cloud_file_client client, const continuation_token& token, const shared_ptr<Listing>& listing)
+        {
+            return TransferMetrics::Instance().Measure(TransferMetrics::ShareList, 0, [&](operation_context context)
+            {
+                return client.list_shares_segmented_async(string_t(), false, 0, token, TransferProfile::Instance().RequestOptions(), context);
+            }).then([client, listing](const share_result_segment& segment)
+            {
+                for (auto& item : segment.results())
+                {
+                    Entry entry;
+                    entry.name = item.name();
+                    entry.isDirectory = true;
+                    entry.length = 0;
+                    listing->push_back(entry);
+                }
+
+                if (segment.continuation_token().empty())
+                {
+                    return pplx::task_from_result();
+                }
+
+                return ListShareSegments(client, segment.continuation_token(), listing);
+            });
+        }
+
+        mutable mutex m_mutex;
+        chrono::seconds m_time_to_live;
+        chrono::seconds m_usage_time_to_live;
+        uint64_t m_next_id;
+        map<string_t, CachedListing> m_listings;
+        map<string_t, CachedExists> m_exists;
+        map<string_t, CachedUsage> m_usage;
+    };
+
+    // Adds up the sizes in a remote tree. Listing segments run on the scheduler as they do for
+    // the deleter. Each directory counts its outstanding segments and subdirectories. The last
+    // one to finish reports the directory's totals to the action and adds them to its parent,
+    // so totals arrive bottom-up as subtrees complete. The action may run on several threads at
+    // once, and gets each directory's path relative to the root, which is empty for the root.
+    // After the first failed listing nothing more is listed; the directory that failed and
+    // every directory above it are incomplete and never reach the action, so their partial
+    // totals are neither printed nor cached.
+    class RemoteSizer
+    {
+    public:
+        typedef RemoteCache::Usage Usage;
+        typedef function<void(const string_t&, const cloud_file_directory&, const Usage&)> Action;
+
+        static pplx::task<Usage> Sum(const shared_ptr<TransferScheduler>& scheduler, const cloud_file_directory& root, const Action& action)
+        {
+            shared_ptr<State> state = make_shared<State>(scheduler, action);
+            List(state, make_shared<Node>(root, string_t(), nullptr), continuation_token());
+            return pplx::create_task(state->m_completed);
+        }
+
+    private:
+
+        struct State
+        {
+            State(const shared_ptr<TransferScheduler>& scheduler, const Action& action)
+                : m_scheduler(scheduler), m_action(action)
+            {
+            }
+
+            shared_ptr<TransferScheduler> m_scheduler;
+            Action m_action;
+            mutex m_mutex;
+            exception_ptr m_error;
+            pplx::task_completion_event<Usage> m_completed;
+        };
+
+        struct Node
+        {
+            Node(const cloud_file_directory& directory, const string_t& path, const shared_ptr<Node>& parent)
+                : m_directory(directory), m_path(path), m_parent(parent), m_pending(0), m_incomplete(false), m_usage()
+            {
+            }
+
+            cloud_file_directory m_directory;
+            string_t m_path;
+            shared_ptr<Node> m_parent;
+            atomic<size_t> m_pending;
+            atomic<bool> m_incomplete;
+            mutex m_mutex;
+            Usage m_usage;
+        };
+
+        static void List(const shared_ptr<State>& state, const shared_ptr<Node>& node, const continuation_token& token)
+        {
+            node->m_pending++;
+
+            shared_ptr<list_file_and_directory_result_segment> segment = make_shared<list_file_and_directory_result_segment>();
+            cloud_file_directory directory = node->m_directory;
+
+            state->m_scheduler->Post([directory, token, segment]()
+            {
+                return TransferMetrics::Instance().Measure(TransferMetrics::DirectoryList, 0, [&](operation_context context)
+                {
+                    return directory.list_files_and_directories_segmented_async(0, token, TransferProfile::Instance().RequestOptions(), context);
+                }).then([segment](const list_file_and_directory_result_segment& result)
+                {
+                    *segment = result;
+                });
+            }).then([state, node, segment](pplx::task<void> previous)->void
+            {
+                exception_ptr error;
+                bool failed = false;
+
+                try
+                {
+                    previous.get();
+                }
+                catch (...)
+                {
+                    error = current_exception();
+                }
+
+                {
+                    lock_guard<mutex> lock(state->m_mutex);
+
+                    if (error && !state->m_error)
+                    {
+                        state->m_error = error;
+                    }
+
+                    failed = static_cast<bool>(state->m_error);
+                }
+
+                if (failed)
+                {
+                    node->m_incomplete = true;
+                    Release(state, node);
+                    return;
+                }
+
+                if (!segment->continuation_token().empty())
+                {
+                    List(state, node, segment->continuation_token());
+                }
+
+                for (auto& item : segment->results())
+                {
+                    if (item.is_directory())
+                    {
+                        string_t name = item.as_directory().name();
+
+                        {
+                            lock_guard<mutex> lock(node->m_mutex);
+                            node->m_usage.subdirectories.push_back(name);
+                        }
+
+                        string_t path = node->m_path.empty() ? name : node->m_path + _XPLATSTR("/") + name;
+                        node->m_pending++;
+                        List(state, make_shared<Node>(item.as_directory(), path, node), continuation_token());
+                    }
+                    else if (item.is_file())
+                    {
+                        lock_guard<mutex> lock(node->m_mutex);
+                        node->m_usage.bytes += static_cast<int64_t>(item.as_file().properties().length());
+                        node->m_usage.files++;
+                    }
+                }
+
+                Release(state, node);
+            });
+        }
+
+        static void Release(const shared_ptr<State>& state, const shared_ptr<Node>& node)
+        {
+            if (--node->m_pending > 0)
+            {
+                return;
+            }
+
+            // Every segment and subdirectory has finished, so nothing else touches the totals.
+            Usage& usage = node->m_usage;
+
+            if (!node->m_incomplete)
+            {
+                state->m_action(node->m_path, node->m_directory, usage);
+            }
+
+            if (node->m_parent)
+            {
+                if (node->m_incomplete)
+                {
+                    node->m_parent->m_incomplete = true;
+                }
+
+                {
+                    lock_guard<mutex> lock(node->m_parent->m_mutex);
+                    node->m_parent->m_usage.bytes += usage.bytes;
+                    node->m_parent->m_usage.files += usage.files;
+                    node->m_parent->m_usage.directories += usage.directories + 1;
+                }
+
+                Release(state, node->m_parent);
+                return;
+            }
+
+            exception_ptr error;
+
+            {
+                lock_guard<mutex> lock(state->m_mutex);
+                error = state->m_error;
+            }
+
+            if (error)
+            {
+                state->m_completed.set_exception(error);
+            }
+            else
+            {
+                state->m_completed.set(usage);
+            }
+        }
+    };
+
+    class AzureFileContext
+    {
+    public:
+
+        AzureFileContext()
+            : m_scheduler(make_shared<TransferScheduler>(TransferProfile::Instance().Connections())), m_cache(make_shared<RemoteCache>())
+        {
+        }
+
+        AzureFileContext(const string_t& account_name, const string_t& account_key)
+            : m_account_name(account_name), m_account_key(account_key), m_scheduler(make_shared<TransferScheduler>(TransferProfile::Instance().Connections())), m_cache(make_shared<RemoteCache>())
+        {
+            m_storage_credentials = storage_credentials(m_account_name, m_account_key);
+            Init();
+        }
+
+        // Uses an account whose endpoints are already set, such as a local stand-in for the service.
+        AzureFileContext(const cloud_storage_account& storage_account)
+            : m_storage_credentials(storage_account.credentials()), m_storage_account(storage_account), m_scheduler(make_shared<TransferScheduler>(TransferProfile::Instance().Connections())), m_cache(make_shared<RemoteCache>())
+        {
+            m_file_client = m_storage_account.create_cloud_file_client();
+            m_current_uri = m_file_client.base_uri().primary_uri().to_string();
+        }
+
+        AzureFileContext(const string_t& sas_token)
+            : m_sas_token(sas_token), m_scheduler(make_shared<TransferScheduler>(TransferProfile::Instance().Connections())), m_cache(make_shared<RemoteCache>())
+        {
+            m_storage_credentials = storage_credentials(m_sas_token);
+            Init();
+        }
+
+        cloud_file_client FileClient() const
+        {
+            return m_file_client;
+        }
+
+        const string_t& CurrentUri() const
+        {
+            return m_current_uri;
+        }
+
+        void CurrentUri(const string_t& uri)
+        {
+            m_current_uri = uri;
+        }
+
+        const cloud_file_share& CurrentShare() const
+        {
+            return m_current_share;
+        }
+
+        void CurrentShare(const cloud_file_share& file_share)
+        {
+            m_current_share = file_share;
+        }
+
+        const cloud_file_directory& CurrentDirectory() const
+        {
+            return m_current_directory;
+        }
+
+        void CurrentDirectory(const cloud_file_directory& file_directory)
+        {
+            m_current_directory = file_directory;
+        }
+
+        const shared_ptr<TransferScheduler>& Scheduler() const
+        {
+            return m_scheduler;
+        }
+
+        const shared_ptr<RemoteCache>& Cache() const
+        {
+            return m_cache;
+        }
+
+        const pplx::cancellation_token& Cancellation() const
+        {
+            return m_cancellation;
+        }
+
+        // Makes commands run with this context stop when the token is canceled. Their work goes
+        // through a scheduler that forwards to the shared one and drops it once canceled.
+        void Cancellation(const pplx::cancellation_token& token)
+        {
+            m_cancellation = token;
+            m_scheduler = make_shared<TransferScheduler>(m_scheduler, token);
+        }
+
+    private:
+
+        void Init()
+        {
+            m_storage_account = cloud_storage_account(m_storage_credentials, true);
+            m_file_client = m_storage_account.create_cloud_file_client();
+            m_current_uri = m_file_client.base_uri().primary_uri().to_string();
+        }
+
+        string_t m_account_name;
+        string_t m_account_key;
+        string_t m_sas_token;
+        storage_credentials m_storage_credentials;
+        cloud_storage_account m_storage_account;
+        cloud_file_client m_file_client;
+        shared_ptr<TransferScheduler> m_scheduler;
+        shared_ptr<RemoteCache> m_cache;
+        pplx::cancellation_token m_cancellation = pplx::cancellation_token::none();
+
+        cloud_file_share m_current_share;
+        cloud_file_directory m_current_directory;
+        string_t m_current_uri;
+    };
+
+    struct LocalFileInfo
+    {
+        int64_t size;
+
+        // Last write time in the file system's native resolution; only compared for equality.
+        int64_t modified;
+    };
+
+    enum class LocalFileMode
+    {
+        // Opens an existing file for reading.
+        Read,
+
+        // Creates the file, or empties it when it exists, for reading and writing.
+        Create,
+
+        // Opens the file for reading and writing as it is, creating it when it is missing.
+        Update
+    };
+
+    class ILocalFile
+    {
+    public:
+        virtual ~ILocalFile()
+        {
+        }
+
+        virtual int64_t Size() = 0;
+        virtual size_t ReadAt(int64_t offset, uint8_t* buffer, size_t count) = 0;
+
+        // Returns a read-only view of count bytes at offset, valid while any copy of the pointer
+        // lives, or null when that part of the file cannot be mapped.
+        virtual shared_ptr<const uint8_t> MapView(int64_t offset, size_t count) = 0;
+
+        // Returns the sorted [start, end) extents that may hold data. Everything else is a hole
+        // and reads as zeros. A file system that cannot tell reports the whole file.
+        virtual vector<pair<int64_t, int64_t>> DataExtents() = 0;
+
+        virtual void WriteAt(int64_t offset, const uint8_t* buffer, size_t count) = 0;
+        virtual void Allocate(int64_t size) = 0;
+
+        // Sets the size without allocating anything, so the parts never written stay holes.
+        virtual void AllocateSparse(int64_t size) = 0;
+    };
+
+    class IFileSystem
+    {
+    public:
+        virtual string_t GetFileName(const string_t& path) = 0;
+        virtual bool IsDirectory(const string_t& path) = 0;
+        virtual void ProcessDirectories(
+            const string_t& path,
+            const function<void(const string_t&)>& actionOnDirectory,
+            const function<void(const string_t&)>& actionOnFile) = 0;
+
+        // Walks the directory named by the root of the tree like ProcessDirectories, adding every
+        // entry to the tree and passing its node, so no full path is built unless asked for.
+        virtual void ProcessTree(
+            PathTree& tree,
+            const function<void(PathTree::Id)>& actionOnDirectory,
+            const function<void(PathTree::Id)>& actionOnFile) = 0;
+        virtual string_t GetRelativePath(const string_t& parent, const string_t& fullPath) = 0;
+        virtual string_t PathSeparators() = 0;
+        virtual shared_ptr<ILocalFile> OpenLocalFile(const string_t& path) = 0;
+        virtual shared_ptr<ILocalFile> CreateLocalFile(const string_t& path) = 0;
+        virtual shared_ptr<ILocalFile> UpdateLocalFile(const string_t& path) = 0;
+        virtual LocalFileInfo GetLocalFileInfo(const string_t& path) = 0;
+
+        // Creates a directory unless it exists; its parent must exist.
+        virtual void MakeDirectory(const string_t& path) = 0;
+    };
+
+    class FileSystem : public IFileSystem
+    {
+    public:
+        string_t GetFileName(const string_t& path)
+        {
+            throw runtime_error("NotImplemented");
+        }
+
+        bool IsDirectory(const string_t& path)
+        {
+            throw runtime_error("NotImplemented");
+        }
+
+        void ProcessDirectories(
+            const string_t& path,
+            const function<void(const string_t&)>& actionOnDirectory,
+            const function<void(const string_t&)>& actionOnFile)
+        {
+            throw runtime_error("NotImplemented");
+        }
+
+        void ProcessTree(
+            PathTree& tree,
+            const function<void(PathTree::Id)>& actionOnDirectory,
+            const function<void(PathTree::Id)>& actionOnFile)
+        {
+            throw runtime_error("NotImplemented");
+        }
+
+        string_t GetRelativePath(const string_t& parent, const string_t& fullPath)
+        {
+            throw runtime_error("NotImplemented");
+        }
+
+        string_t PathSeparators()
+        {
+            throw runtime_error("NotImplemented");
+        }
+
+        shared_ptr<ILocalFile> OpenLocalFile(const string_t& path)
+        {
+            throw runtime_error("NotImplemented");
+        }
+
+        shared_ptr<ILocalFile> CreateLocalFile(const string_t& path)
+        {
+            throw runtime_error("NotImplemented");
+        }
+
+        shared_ptr<ILocalFile> UpdateLocalFile(const string_t& path)
+        {
+            throw runtime_error("NotImplemented");
+        }
+
+        LocalFileInfo GetLocalFileInfo(const string_t& path)
+        {
+            throw runtime_error("NotImplemented");
+        }
+
+        void MakeDirectory(const string_t& path)
+        {
+            throw runtime_error("NotImplemented");
+        }
+    };
+
+#ifdef _WIN32
+    class NtfsLocalFile : public ILocalFile
+    {
+    public:
+        NtfsLocalFile(const string_t& path, LocalFileMode mode = LocalFileMode::Read)
+        {
+            if (mode != LocalFileMode::Read)
+            {
+                DWORD disposition = mode == LocalFileMode::Create ? CREATE_ALWAYS : OPEN_ALWAYS;
+                m_handle = CreateFile(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, disposition, FILE_ATTRIBUTE_NORMAL, nullptr);
+            }
+            else
+            {
+                m_handle = CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            }
+
+            if (m_handle == INVALID_HANDLE_VALUE)
+            {
+                throw runtime_error("Failed to open file, last error: " + to_string(GetLastError()));
+            }
+        }
+
+        ~NtfsLocalFile()
+        {
+            CloseHandle(m_handle);
+        }
+
+        int64_t Size()
+        {
+            LARGE_INTEGER size;
+
+            if (!GetFileSizeEx(m_handle, &size))
+            {
+                throw runtime_error("Failed to get file size, last error: " + to_string(GetLastError()));
+            }
+
+            return size.QuadPart;
+        }
+
+        size_t ReadAt(int64_t offset, uint8_t* buffer, size_t count)
+        {
+            size_t total = 0;
+
+            while (total < count)
+            {
+                OVERLAPPED overlapped = {};
+                uint64_t position = static_cast<uint64_t>(offset) + total;
+                overlapped.Offset = static_cast<DWORD>(position);
+                overlapped.OffsetHigh = static_cast<DWORD>(position >> 32);
+
+                DWORD read = 0;
+                DWORD toRead = static_cast<DWORD>((std::min)(count - total, static_cast<size_t>(1 << 30)));
+
+                if (!ReadFile(m_handle, buffer + total, toRead, &read, &overlapped))
+                {
+                    DWORD dwError = GetLastError();
+
+                    if (dwError == ERROR_HANDLE_EOF)
+                    {
+                        break;
+                    }
+
+                    throw runtime_error("Failed to read file, last error: " + to_string(dwError));
+                }
+
+                if (read == 0)
+                {
+                    break;
+                }
+
+                total += read;
+            }
+
+            return total;
+        }
+
+        shared_ptr<const uint8_t> MapView(int64_t offset, size_t count)
+        {
+            SYSTEM_INFO system;
+            GetSystemInfo(&system);
+
+            uint64_t start = static_cast<uint64_t>(offset) - static_cast<uint64_t>(offset) % system.dwAllocationGranularity;
+            size_t length = count + static_cast<size_t>(offset - start);
+
+            if (count == 0 || offset + static_cast<int64_t>(count) > Size())
+            {
+                return nullptr;
+            }
+
+            HANDLE mapping = CreateFileMapping(m_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+            if (mapping == nullptr)
+            {
+                return nullptr;
+            }
+
+            // The view keeps the section alive, so the mapping handle can be closed right away.
+            void* address = MapViewOfFile(mapping, FILE_MAP_READ, static_cast<DWORD>(start >> 32), static_cast<DWORD>(start), length);
+            CloseHandle(mapping);
+
+            if (address == nullptr)
+            {
+                return nullptr;
+            }
+
+            const uint8_t* base = static_cast<const uint8_t*>(address);
+            return shared_ptr<const uint8_t>(base + (offset - start), [address](const uint8_t*)
+            {
+                UnmapViewOfFile(address);
+            });
+        }
+
+        vector<pair<int64_t, int64_t>> DataExtents()
+        {
+            int64_t size = Size();
+            vector<pair<int64_t, int64_t>> extents;
+            vector<FILE_ALLOCATED_RANGE_BUFFER> ranges(64);
+            FILE_ALLOCATED_RANGE_BUFFER query = {};
+            query.Length.QuadPart = size;
+
+            while (size > 0)
+            {
+                DWORD returned = 0;
+                BOOL complete = DeviceIoControl(m_handle, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query),
+                    ranges.data(), static_cast<DWORD>(ranges.size() * sizeof(FILE_ALLOCATED_RANGE_BUFFER)), &returned, nullptr);
+
+                if (!complete && GetLastError() != ERROR_MORE_DATA)
+                {
+                    extents.assign(1, make_pair(static_cast<int64_t>(0), size));
+                    break;
+                }
+
+                size_t count = returned / sizeof(FILE_ALLOCATED_RANGE_BUFFER);
+
+                for (size_t i = 0; i < count; i++)
+                {
+                    extents.push_back(make_pair(ranges[i].FileOffset.QuadPart, ranges[i].FileOffset.QuadPart + ranges[i].Length.QuadPart));
+                }
+
+                if (complete || count == 0)
+                {
+                    break;
+                }
+
+                query.FileOffset.QuadPart = extents.back().second;
+                query.Length.QuadPart = size - extents.back().second;
+            }
+
+            return extents;
+        }
+
+        void WriteAt(int64_t offset, const uint8_t* buffer, size_t count)
+        {
+            size_t total = 0;
+
+            while (total < count)
+            {
+                OVERLAPPED overlapped = {};
+                uint64_t position = static_cast<uint64_t>(offset) + total;
+                overlapped.Offset = static_cast<DWORD>(position);
+                overlapped.OffsetHigh = static_cast<DWORD>(position >> 32);
+
+                DWORD written = 0;
+                DWORD toWrite = static_cast<DWORD>((std::min)(count - total, static_cast<size_t>(1 << 30)));
+
+                if (!WriteFile(m_handle, buffer + total, toWrite, &written, &overlapped))
+                {
+                    throw runtime_error("Failed to write file, last error: " + to_string(GetLastError()));
+                }
+
+                total += written;
+            }
+        }
+
+        void Allocate(int64_t size)
+        {
+            FILE_ALLOCATION_INFO allocation = {};
+            allocation.AllocationSize.QuadPart = size;
+            SetFileInformationByHandle(m_handle, FileAllocationInfo, &allocation, sizeof(allocation));
+
+            FILE_END_OF_FILE_INFO endOfFile = {};
+            endOfFile.EndOfFile.QuadPart = size;
+
+            if (!SetFileInformationByHandle(m_handle, FileEndOfFileInfo, &endOfFile, sizeof(endOfFile)))
+            {
+                throw runtime_error("Failed to set file size, last error: " + to_string(GetLastError()));
+            }
+        }
+
+        void AllocateSparse(int64_t size)
+        {
+            // Without the sparse attribute NTFS fills the extended part with zeros on disk.
+            DWORD returned = 0;
+            DeviceIoControl(m_handle, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &returned, nullptr);
+
+            FILE_END_OF_FILE_INFO endOfFile = {};
+            endOfFile.EndOfFile.QuadPart = size;
+
+            if (!SetFileInformationByHandle(m_handle, FileEndOfFileInfo, &endOfFile, sizeof(endOfFile)))
+            {
+                throw runtime_error("Failed to set file size, last error: " + to_string(GetLastError()));
+            }
+        }
+
+    private:
+        HANDLE m_handle;
+    };
+
+    class NtfsFileSystem : public FileSystem
+    {
+    public:
+        string_t GetFileName(const string_t& path)
+        {
+            size_t index = path.find_last_of(_XPLATSTR('\\'));
+            return path.substr(index + 1);
+        }
+
+        bool IsDirectory(const string_t& path)
+        {
+            DWORD dwAttrs = GetFileAttributes(path.c_str());
+
+            if (dwAttrs == INVALID_FILE_ATTRIBUTES)
+            {
+                return false;
+            }
+
+            return ((dwAttrs & FILE_ATTRIBUTE_DIRECTORY) == FILE_ATTRIBUTE_DIRECTORY);
+        }
+
+        void ProcessDirectories(
+            const string_t& path,
+            const function<void(const string_t&)>& actionOnDirectory,
+            const function<void(const string_t&)>& actionOnFile)
+        {
+            PathTree tree(path);
+
+            ProcessTree(
+                tree,
+                [&](PathTree::Id id)
+                {
+                    actionOnDirectory(tree.Path(id, _XPLATSTR('\\')));
+                },
+                [&](PathTree::Id id)
+                {
+                    actionOnFile(tree.Path(id, _XPLATSTR('\\')));
+                });
+        }
+
+        void ProcessTree(
+            PathTree& tree,
+            const function<void(PathTree::Id)>& actionOnDirectory,
+            const function<void(PathTree::Id)>& actionOnFile)
+        {
+            if (tree.Path(PathTree::Root, _XPLATSTR('\\')).empty())
+            {
+                throw invalid_argument("path");
+            }
+
+            queue<PathTree::Id> directories;
+            directories.push(static_cast<PathTree::Id>(PathTree::Root));
+
+            while (!directories.empty())
+            {
+                PathTree::Id currentDirectory = directories.front();
+                directories.pop();
+                ProcessDirectory(tree, currentDirectory, directories, actionOnDirectory, actionOnFile);
+            }
+        }
+
+        string_t GetRelativePath(const string_t& parent, const string_t& fullPath)
+        {
+            string_t relativePath = fullPath;
+            size_t length = parent.size();
+
+            if (fullPath.substr(0, length).compare(parent) == 0)
+            {
+                if (length < fullPath.size())
+                {
+                    relativePath = fullPath.substr(length);
+                }
+                else
+                {
+                    relativePath = string_t();
+                }
+            }
+
+            if (relativePath.size() > 0 && relativePath.front() == _XPLATSTR('\\'))
+            {
+                relativePath = relativePath.substr(1);
+            }
+
+            return relativePath;
+        }
+
+        string_t PathSeparators()
+        {
+            return _XPLATSTR("\\");
+        }
+
+        shared_ptr<ILocalFile> OpenLocalFile(const string_t& path)
+        {
+            return shared_ptr<ILocalFile>(new NtfsLocalFile(path));
+        }
+
+        shared_ptr<ILocalFile> CreateLocalFile(const string_t& path)
+        {
+            return shared_ptr<ILocalFile>(new NtfsLocalFile(path, LocalFileMode::Create));
+        }
+
+        shared_ptr<ILocalFile> UpdateLocalFile(const string_t& path)
+        {
+            return shared_ptr<ILocalFile>(new NtfsLocalFile(path, LocalFileMode::Update));
+        }
+
+        LocalFileInfo GetLocalFileInfo(const string_t& path)
+        {
+            WIN32_FILE_ATTRIBUTE_DATA data;
+
+            if (!GetFileAttributesEx(path.c_str(), GetFileExInfoStandard, &data))
+            {
+                throw runtime_error("Failed to get file attributes, last error: " + to_string(GetLastError()));
+            }
+
+            LocalFileInfo info;
+            info.size = (static_cast<int64_t>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+            info.modified = (static_cast<int64_t>(data.ftLastWriteTime.dwHighDateTime) << 32) | data.ftLastWriteTime.dwLowDateTime;
+            return info;
+        }
+
+        void MakeDirectory(const string_t& path)
+        {
+            if (!CreateDirectory(path.c_str(), nullptr) && GetLastError() != ERROR_ALREADY_EXISTS)
+            {
+                throw runtime_error("Failed to create directory, last error: " + to_string(GetLastError()));
+            }
+        }
+
+    private:
+
+        void ProcessDirectory(
+            PathTree& tree,
+            PathTree::Id id,
+            queue<PathTree::Id>& directories,
+            const function<void(PathTree::Id)>& actionOnDirectory,
+            const function<void(PathTree::Id)>& actionOnFile)
+        {
+            WIN32_FIND_DATA findData;
+            HANDLE hFind = INVALID_HANDLE_VALUE;
+            DWORD dwError = 0;
+
+            try
+            {
+                actionOnDirectory(id);
+
+                string_t pattern = BuildSearchPattern(tree.Path(id, _XPLATSTR('\\')));
+
+                hFind = FindFirstFile(pattern.c_str(), &findData);
+
+                if (hFind == INVALID_HANDLE_VALUE)
+                {
+                    dwError = GetLastError();
+                    ucout << _XPLATSTR("Failed to find ") << pattern << ", last error: " << dwError << endl;
+                    return;
+                }
+
+                do
+                {
+                    if (_wcsicmp(findData.cFileName, L".") == 0 || _wcsicmp(findData.cFileName, L"..") == 0)
+                    {
+                        continue;
+                    }
+
+                    PathTree::Id child = tree.Add(id, findData.cFileName, wcslen(findData.cFileName));
+
+                    if ((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == FILE_ATTRIBUTE_DIRECTORY)
+                    {
+                        directories.push(child);
+                    }
+                    else
+                    {
+                        actionOnFile(child);
+                    }
+                } while (FindNextFile(hFind, &findData) != 0);
+            }
+            catch (const std::exception& e)
+            {
+                ucout << e.what() << endl;
+            }
+
+            if (hFind != INVALID_HANDLE_VALUE)
+            {
+                FindClose(hFind);
+                hFind = INVALID_HANDLE_VALUE;
+            }
+        }
+
+        static string_t BuildSearchPattern(const string_t& path)
+        {
+            string_t pattern = path;
+
+            if (pattern.back() != _XPLATSTR('\\'))
+            {
+                pattern.append(1, _XPLATSTR('\\'));
+            }
+
+            pattern.append(1, _XPLATSTR('*'));
+            return pattern;
+        }
+    };
+#else
+    class PosixLocalFile : public ILocalFile
+    {
+    public:
+        PosixLocalFile(const string_t& path, LocalFileMode mode = LocalFileMode::Read)
+        {
+            if (mode != LocalFileMode::Read)
+            {
+                int truncate = mode == LocalFileMode::Create ? O_TRUNC : 0;
+                m_fd = open(path.c_str(), O_RDWR | O_CREAT | truncate | O_CLOEXEC, 0644);
+            }
+            else
+            {
+                m_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            }
+
+            if (m_fd < 0)
+            {
+                throw runtime_error("Failed to open " + path + ", errno: " + to_string(errno));
+            }
+        }
+
+        ~PosixLocalFile()
+        {
+            close(m_fd);
+        }
+
+        int64_t Size()
+        {
+            struct stat st;
+
+            if (fstat(m_fd, &st) != 0)
+            {
+                throw runtime_error("fstat failed, errno: " + to_string(errno));
+            }
+
+            return st.st_size;
+        }
+
+        size_t ReadAt(int64_t offset, uint8_t* buffer, size_t count)
+        {
+            size_t total = 0;
+
+            while (total < count)
+            {
+                ssize_t bytes = pread(m_fd, buffer + total, count - total, offset + total);
+
+                if (bytes < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+
+                    throw runtime_error("pread failed, errno: " + to_string(errno));
+                }
+
+                if (bytes == 0)
+                {
+                    break;
+                }
+
+                total += bytes;
+            }
+
+            return total;
+        }
+
+        // Touching a mapped page past the end of the file raises SIGBUS. Ranges beyond the size
+        // the file has now are left to ReadAt, but nothing stops another process from truncating
+        // the file while a view is mapped, and the SIGBUS then terminates the process. That is
+        // why the mmap setting is off unless asked for.
+        shared_ptr<const uint8_t> MapView(int64_t offset, size_t count)
+        {
+            static const int64_t pageSize = sysconf(_SC_PAGESIZE);
+            int64_t start = offset - offset % pageSize;
+            size_t length = count + static_cast<size_t>(offset - start);
+
+            if (count == 0 || offset + static_cast<int64_t>(count) > Size())
+            {
+                return nullptr;
+            }
+
+            void* address = mmap(nullptr, length, PROT_READ, MAP_SHARED, m_fd, start);
+
+            if (address == MAP_FAILED)
+            {
+                return nullptr;
+            }
+
+            // The range is read once front to back: read ahead aggressively and let the kernel
+            // drop the pages behind the reader.
+            madvise(address, length, MADV_SEQUENTIAL);
+            madvise(address, length, MADV_WILLNEED);
+
+            const uint8_t* base = static_cast<const uint8_t*>(address);
+            return shared_ptr<const uint8_t>(base + (offset - start), [address, length](const uint8_t*)
+            {
+                munmap(address, length);
+            });
+        }
+
+        vector<pair<int64_t, int64_t>> DataExtents()
+        {
+            int64_t size = Size();
+            vector<pair<int64_t, int64_t>> extents;
+#ifdef SEEK_DATA
+            int64_t offset = 0;
+
+            while (offset < size)
+            {
+                off_t data = lseek(m_fd, offset, SEEK_DATA);
+
+                if (data < 0)
+                {
+                    // ENXIO means only a hole is left; anything else means holes are not supported.
+                    if (errno != ENXIO)
+                    {
+                        extents.assign(1, make_pair(static_cast<int64_t>(0), size));
+                    }
+
+                    break;
+                }
+
+                off_t hole = lseek(m_fd, data, SEEK_HOLE);
+                int64_t end = hole < 0 ? size : (std::min)(static_cast<int64_t>(hole), size);
+                extents.push_back(make_pair(static_cast<int64_t>(data), end));
+                offset = end;
+            }
+#else
+            if (size > 0)
+            {
+                extents.push_back(make_pair(static_cast<int64_t>(0), size));
+            }
+#endif
+            return extents;
+        }
+
+        void WriteAt(int64_t offset, const uint8_t* buffer, size_t count)
+        {
+            size_t total = 0;
+
+            while (total < count)
+            {
+                ssize_t bytes = pwrite(m_fd, buffer + total, count - total, offset + total);
+
+                if (bytes < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+
+                    throw runtime_error("pwrite failed, errno: " + to_string(errno));
+                }
+
+                total += bytes;
+            }
+        }
+
+        void Allocate(int64_t size)
+        {
+#ifdef __linux__
+            // Reserve the blocks up front so concurrent range writes do not fragment the file.
+            if (size > 0 && posix_fallocate(m_fd, 0, size) == 0)
+            {
+                return;
+            }
+#endif
+            if (ftruncate(m_fd, size) != 0)
+            {
+                throw runtime_error("ftruncate failed, errno: " + to_string(errno));
+            }
+        }
+
+        void AllocateSparse(int64_t size)
+        {
+            if (ftruncate(m_fd, size) != 0)
+            {
+                throw runtime_error("ftruncate failed, errno: " + to_string(errno));
+            }
+        }
+
+    private:
+        int m_fd;
+    };
+
+    class PosixFileSystem : public FileSystem
+    {
+    public:
+        string_t GetFileName(const string_t& path)
+        {
+            size_t index = path.find_last_of(_XPLATSTR('/'));
+            return path.substr(index + 1);
+        }
+
+        bool IsDirectory(const string_t& path)
+        {
+            struct stat st;
+
+            if (stat(path.c_str(), &st) != 0)
+            {
+                return false;
+            }
+
+            return S_ISDIR(st.st_mode);
+        }
+
+        void ProcessDirectories(
+            const string_t& path,
+            const function<void(const string_t&)>& actionOnDirectory,
+            const function<void(const string_t&)>& actionOnFile)
+        {
+            PathTree tree(path);
+
+            ProcessTree(
+                tree,
+                [&](PathTree::Id id)
+                {
+                    actionOnDirectory(tree.Path(id, _XPLATSTR('/')));
+                },
+                [&](PathTree::Id id)
+                {
+                    actionOnFile(tree.Path(id, _XPLATSTR('/')));
+                });
+        }
+
+        void ProcessTree(
+            PathTree& tree,
+            const function<void(PathTree::Id)>& actionOnDirectory,
+            const function<void(PathTree::Id)>& actionOnFile)
+        {
+            if (tree.Path(PathTree::Root, _XPLATSTR('/')).empty())
+            {
+                throw invalid_argument("path");
+            }
+
+            queue<PathTree::Id> directories;
+            set<pair<dev_t, ino_t>> visited;
+            directories.push(static_cast<PathTree::Id>(PathTree::Root));
+
+            while (!directories.empty())
+            {
+                PathTree::Id currentDirectory = directories.front();
+                directories.pop();
+                ProcessDirectory(tree, currentDirectory, directories, visited, actionOnDirectory, actionOnFile);
+            }
+        }
+
+        string_t GetRelativePath(const string_t& parent, const string_t& fullPath)
+        {
+            string_t relativePath = fullPath;
+            size_t length = parent.size();
+
+            if (fullPath.substr(0, length).compare(parent) == 0)
+            {
+                if (length < fullPath.size())
+                {
+                    relativePath = fullPath.substr(length);
+                }
+                else
+                {
+                    relativePath = string_t();
+                }
+            }
+
+            if (relativePath.size() > 0 && relativePath.front() == _XPLATSTR('/'))
+            {
+                relativePath = relativePath.substr(1);
+            }
+
+            return relativePath;
+        }
+
+        string_t PathSeparators()
+        {
+            return _XPLATSTR("/");
+        }
+
+        shared_ptr<ILocalFile> OpenLocalFile(const string_t& path)
+        {
+            return shared_ptr<ILocalFile>(new PosixLocalFile(path));
+        }
+
+        shared_ptr<ILocalFile> CreateLocalFile(const string_t& path)
+        {
+            return shared_ptr<ILocalFile>(new PosixLocalFile(path, LocalFileMode::Create));
+        }
+
+        shared_ptr<ILocalFile> UpdateLocalFile(const string_t& path)
+        {
+            return shared_ptr<ILocalFile>(new PosixLocalFile(path, LocalFileMode::Update));
+        }
+
+        LocalFileInfo GetLocalFileInfo(const string_t& path)
+        {
+            struct stat st;
+
+            if (stat(path.c_str(), &st) != 0)
+            {
+                throw runtime_error("Failed to stat " + path + ", errno: " + to_string(errno));
+            }
+
+            LocalFileInfo info;
+            info.size = st.st_size;
+#ifdef __APPLE__
+            info.modified = static_cast<int64_t>(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+            info.modified = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+            return info;
+        }
+
+        void MakeDirectory(const string_t& path)
+        {
+            if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+            {
+                throw runtime_error("Failed to create " + path + ", errno: " + to_string(errno));
+            }
+        }
+
+    private:
+
+        // Large enough that a directory with a few thousand entries is read in one system call.
+        static const size_t DirectoryBufferSize = 64 * 1024;
+
+        // Symbolic links are followed, so a directory reached a second time, typically through a
+        // link to one of its ancestors, is recognized by its device and inode and skipped instead
+        // of being walked again without end.
+        void ProcessDirectory(
+            PathTree& tree,
+            PathTree::Id id,
+            queue<PathTree::Id>& directories,
+            set<pair<dev_t, ino_t>>& visited,
+            const function<void(PathTree::Id)>& actionOnDirectory,
+            const function<void(PathTree::Id)>& actionOnFile)
+        {
+            int fd = -1;
+
+            try
+            {
+                string_t directory = tree.Path(id, _XPLATSTR('/'));
+                fd = openat(AT_FDCWD, directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                struct stat st;
+
+                if (fd >= 0 && fstat(fd, &st) == 0 && !visited.insert(make_pair(st.st_dev, st.st_ino)).second)
+                {
+                    ucout << _XPLATSTR("Skipped ") << directory << _XPLATSTR(", already visited through a symbolic link") << endl;
+                    close(fd);
+                    return;
+                }
+
+                actionOnDirectory(id);
+
+                if (fd < 0)
+                {
+                    ucout << _XPLATSTR("Failed to open ") << directory << ", errno: " << errno << endl;
+                    return;
+                }
+
+                ReadDirectory(fd, [&](const char* name, unsigned char type)
+                {
+                    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+                    {
+                        return;
+                    }
+
+                    if (type == DT_UNKNOWN || type == DT_LNK)
+                    {
+                        // Only entries the file system could not classify, or symbolic links, need a stat.
+                        type = StatType(fd, name);
+                    }
+
+                    if (type == DT_DIR)
+                    {
+                        directories.push(tree.Add(id, name, strlen(name)));
+                    }
+                    else if (type == DT_REG)
+                    {
+                        actionOnFile(tree.Add(id, name, strlen(name)));
+                    }
+                });
+            }
+            catch (const std::exception& e)
+            {
+                ucout << e.what() << endl;
+            }
+
+            if (fd >= 0)
+            {
+                close(fd);
+                fd = -1;
+            }
+        }
+
+        // Enumerates the entries of an open directory, passing each name with its d_type.
+        // The descriptor stays owned by the caller.
+        static void ReadDirectory(int fd, const function<void(const char*, unsigned char)>& action)
+        {
+#ifdef __linux__
+            struct linux_dirent64
+            {
+                uint64_t d_ino;
+                int64_t d_off;
+                unsigned short d_reclen;
+                unsigned char d_type;
+                char d_name[1];
+            };
+
+            vector<char> buffer(DirectoryBufferSize);
+
+            while (true)
+            {
+                long bytes = syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+
+                if (bytes < 0)
+                {
+                    throw runtime_error("getdents64 failed, errno: " + to_string(errno));
+                }
+
+                if (bytes == 0)
+                {
+                    break;
+                }
+
+                for (long offset = 0; offset < bytes;)
+                {
+                    const linux_dirent64* entry = reinterpret_cast<const linux_dirent64*>(buffer.data() + offset);
+                    action(entry->d_name, entry->d_type);
+                    offset += entry->d_reclen;
+                }
+            }
+#else
+            // fdopendir takes ownership of the descriptor it is given, so hand it a duplicate.
+            int dirFd = dup(fd);
+
+            if (dirFd < 0)
+            {
+                throw runtime_error("dup failed, errno: " + to_string(errno));
+            }
+
+            DIR* dir = fdopendir(dirFd);
+
+            if (dir == nullptr)
+            {
+                close(dirFd);
+                throw runtime_error("fdopendir failed, errno: " + to_string(errno));
+            }
+
+            struct dirent* entry;
+
+            try
+            {
+                while ((entry = readdir(dir)) != nullptr)
+                {
+                    action(entry->d_name, entry->d_type);
+                }
+            }
+            catch (...)
+            {
+                closedir(dir);
+                throw;
+            }
+
+            closedir(dir);
+#endif
+        }
+
+        static unsigned char StatType(int fd, const char* name)
+        {
+            struct stat st;
+
+            if (fstatat(fd, name, &st, 0) != 0)
+            {
+                return DT_UNKNOWN;
+            }
+
+            if (S_ISDIR(st.st_mode))
+            {
+                return DT_DIR;
+            }
+
+            if (S_ISREG(st.st_mode))
+            {
+                return DT_REG;
+            }
+
+            return DT_UNKNOWN;
+        }
+    };
+#endif
+
+    class FileSystemFactory
+    {
+    public:
+        static shared_ptr<IFileSystem> CreateFileSystem()
+        {
+#ifdef _WIN32
+            return shared_ptr<IFileSystem>(new NtfsFileSystem());
+#else
+            return shared_ptr<IFileSystem>(new PosixFileSystem());
+#endif
+        }
+    };
+
+    // The hashes of the ranges of a local file as it was last uploaded, kept in a sidecar file
+    // next to it. The remote file's ETag is recorded too, so the hashes are trusted only while
+    // nobody else has written to the remote file. Only upload -delta skips sidecars; every other
+    // transfer treats them as ordinary files.
+    struct RangeIndex
+    {
+        RangeIndex()
+            : fileSize(0), rangeSize(0)
+        {
+        }
+
+        static string_t SidecarPath(const string_t& path)
+        {
+            return path + SidecarSuffix();
+        }
+
+        static bool IsSidecar(const string_t& path)
+        {
+            string_t suffix = SidecarSuffix();
+            return path.size() > suffix.size() && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0;
+        }
+
+        static string_t SidecarSuffix()
+        {
+            return _XPLATSTR(".azranges");
+        }
+
+        // Returns false when the index is missing, incomplete or describes another remote file.
+        bool Load(const string_t& path, const string_t& remoteUri)
+        {
+            std::ifstream stream(path.c_str());
+            string line;
+
+            if (!getline(stream, line) || line != "#AzureFileConsole range index 1"
+                || !getline(stream, line) || conversions::to_string_t(line) != remoteUri
+                || !getline(stream, line))
+            {
+                return false;
+            }
+
+            etag = conversions::to_string_t(line);
+
+            if (!(stream >> fileSize >> rangeSize) || fileSize < 0 || rangeSize == 0)
+            {
+                return false;
+            }
+
+            hashes.resize(static_cast<size_t>((fileSize + rangeSize - 1) / rangeSize));
+
+            for (auto& hash : hashes)
+            {
+                if (!(stream >> hex >> hash))
+                {
+                    return false;
+                }
+            }
+
+            return (stream >> line) && line == "#end";
+        }
+
+        void Save(const string_t& path, const string_t& remoteUri) const
+        {
+            std::ofstream stream(path.c_str(), ios::out | ios::trunc);
+
+            stream << "#AzureFileConsole range index 1\n"
+                << conversions::to_utf8string(remoteUri) << "\n"
+                << conversions::to_utf8string(etag) << "\n"
+                << fileSize << " " << rangeSize << "\n" << hex;
+
+            for (auto hash : hashes)
+            {
+                stream << hash << "\n";
+            }
+
+            stream << "#end\n";
+
+            if (!stream.flush())
+            {
+                throw runtime_error("Failed to write the range index");
+            }
+        }
+
+        string_t etag;
+        int64_t fileSize;
+        uint64_t rangeSize;
+        vector<uint64_t> hashes;
+    };
+
+    // An append-only record of transfer progress that lets an interrupted upload or download
+    // resume. A transfer starts with a line naming the local path, the remote URI and the version
+    // of the source: the local size and write time for uploads, the remote ETag for downloads.
+    // Completed ranges and completed files follow as short lines keyed by the transfer's id.
+    // Every line is flushed as it is written, so a killed process loses only the ranges that
+    // were in flight, and a torn last line is ignored. Opening the journal rewrites it without
+    // superseded transfers, so it does not grow without bound across runs; the rewrite goes to a
+    // temporary file that replaces the journal only once it is complete.
+    // Commands that name the same journal share one instance through Open, so concurrent jobs
+    // append to a single stream instead of compacting the file under each other.
+    class TransferJournal
+    {
+    public:
+        static shared_ptr<TransferJournal> Open(const string_t& path)
+        {
+            static mutex openMutex;
+            static unordered_map<string_t, weak_ptr<TransferJournal>> journals;
+
+            lock_guard<mutex> lock(openMutex);
+            shared_ptr<TransferJournal> journal = journals[path].lock();
+
+            if (!journal)
+            {
+                journal = make_shared<TransferJournal>(path);
+                journals[path] = journal;
+            }
+
+            return journal;
+        }
+
+        explicit TransferJournal(const string_t& path)
+            : m_path(path), m_next_id(1)
+        {
+            Load();
+            Compact();
+
+            m_stream.open(m_path.c_str(), ios::out | ios::app);
+
+            if (!m_stream)
+            {
+                throw runtime_error("Cannot open the transfer journal");
+            }
+        }
+
+        // Returns whether the transfer of this version of the source finished in an earlier run.
+        bool IsComplete(const string_t& localPath, const string_t& remoteUri, int64_t size, const string_t& version) const
+        {
+            lock_guard<mutex> lock(m_mutex);
+            const Transfer* transfer = Find(localPath, remoteUri, size, version);
+            return transfer != nullptr && transfer->complete;
+        }
+
+        // Offsets of the ranges an earlier run finished for this version of the source.
+        unordered_set<int64_t> CompletedRanges(const string_t& localPath, const string_t& remoteUri, int64_t size, const string_t& version, size_t rangeSize) const
+        {
+            lock_guard<mutex> lock(m_mutex);
+            const Transfer* transfer = Find(localPath, remoteUri, size, version);
+
+            if (transfer == nullptr || transfer->rangeSize != rangeSize)
+            {
+                return unordered_set<int64_t>();
+            }
+
+            return transfer->ranges;
+        }
+
+        // Starts recording a transfer and returns its id. With resume set, a matching transfer
+        // from an earlier run is continued with its completed ranges; otherwise it starts over.
+        uint64_t Begin(const string_t& localPath, const string_t& remoteUri, int64_t size, const string_t& version, size_t rangeSize, bool resume)
+        {
+            lock_guard<mutex> lock(m_mutex);
+            const Transfer* existing = Find(localPath, remoteUri, size, version);
+
+            if (resume && existing != nullptr && existing->rangeSize == rangeSize)
+            {
+                return m_ids[Key(localPath, remoteUri)];
+            }
+
+            Transfer transfer;
+            transfer.localPath = localPath;
+            transfer.remoteUri = remoteUri;
+            transfer.size = size;
+            transfer.version = version;
+            transfer.rangeSize = rangeSize;
+            transfer.complete = false;
+
+            uint64_t id = m_next_id++;
+            Replace(id, transfer);
+            Write(BeginLine(id, transfer));
+            return id;
+        }
+
+        void RangeDone(uint64_t id, int64_t offset)
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_transfers[id].ranges.insert(offset);
+            Write("R\t" + to_string(id) + "\t" + to_string(offset));
+        }
+
+        void Complete(uint64_t id)
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_transfers[id].complete = true;
+            m_transfers[id].ranges.clear();
+            Write("F\t" + to_string(id));
+        }
+
+    private:
+
+        struct Transfer
+        {
+            string_t localPath;
+            string_t remoteUri;
+            int64_t size;
+            string_t version;
+            size_t rangeSize;
+            bool complete;
+            unordered_set<int64_t> ranges;
+        };
+
+        static string Header()
+        {
+            return "#AzureFileConsole transfer journal 1";
+        }
+
+        static string_t Key(const string_t& localPath, const string_t& remoteUri)
+        {
+            return localPath + _XPLATSTR("\t") + remoteUri;
+        }
+
+        static string BeginLine(uint64_t id, const Transfer& transfer)
+        {
+            return "B\t" + to_string(id) + "\t" + to_string(transfer.size) + "\t" + to_string(transfer.rangeSize) + "\t"
+                + conversions::to_utf8string(transfer.version) + "\t"
+                + conversions::to_utf8string(transfer.localPath) + "\t"
+                + conversions::to_utf8string(transfer.remoteUri);
+        }
+
+        const Transfer* Find(const string_t& localPath, const string_t& remoteUri, int64_t size, const string_t& version) const
+        {
+            auto id = m_ids.find(Key(localPath, remoteUri));
+
+            if (id == m_ids.end())
+            {
+                return nullptr;
+            }
+
+            const Transfer& transfer = m_transfers.at(id->second);
+            return transfer.size == size && transfer.version == version ? &transfer : nullptr;
+        }
+
+        // Makes transfer the current one for its paths. Called with the lock held or before the
+        // journal is shared.
+        void Replace(uint64_t id, const Transfer& transfer)
+        {
+            string_t key = Key(transfer.localPath, transfer.remoteUri);
+            auto previous = m_ids.find(key);
+
+            if (previous != m_ids.end())
+            {
+                m_transfers.erase(previous->second);
+            }
+
+            m_ids[key] = id;
+            m_transfers[id] = transfer;
+        }
+
+        void Load()
+        {
+            std::ifstream stream(m_path.c_str());
+            string line;
+
+            if (!getline(stream, line) || line != Header())
+            {
+                return;
+            }
+
+            // Stops at the first line that does not parse; a torn write can only be the last.
+            while (getline(stream, line))
+            {
+                vector<string_t> fields = Util::Split(conversions::to_string_t(line), _XPLATSTR("\t"));
+
+                try
+                {
+                    if (fields.size() == 7 && fields[0] == _XPLATSTR("B"))
+                    {
+                        Transfer transfer;
+                        uint64_t id = stoull(fields[1]);
+                        transfer.size = stoll(fields[2]);
+                        transfer.rangeSize = static_cast<size_t>(stoull(fields[3]));
+                        transfer.version = fields[4];
+                        transfer.localPath = fields[5];
+                        transfer.remoteUri = fields[6];
+                        transfer.complete = false;
+
+                        Replace(id, transfer);
+                        m_next_id = (std::max)(m_next_id, id + 1);
+                    }
+                    else if (fields.size() == 3 && fields[0] == _XPLATSTR("R"))
+                    {
+                        auto transfer = m_transfers.find(stoull(fields[1]));
+
+                        if (transfer != m_transfers.end())
+                        {
+                            transfer->second.ranges.insert(stoll(fields[2]));
+                        }
+                    }
+                    else if (fields.size() == 2 && fields[0] == _XPLATSTR("F"))
+                    {
+                        auto transfer = m_transfers.find(stoull(fields[1]));
+
+                        if (transfer != m_transfers.end())
+                        {
+                            transfer->second.complete = true;
+                            transfer->second.ranges.clear();
+                        }
+                    }
+                    else
+                    {
+                        break;
+                    }
+                }
+                catch (const std::logic_error&)
+                {
+                    break;
+                }
+            }
+        }
+
+        void Compact()
+        {
+            string_t temporary = m_path + _XPLATSTR(".tmp");
+            std::ofstream stream(temporary.c_str(), ios::out | ios::trunc);
+            stream << Header() << "\n";
+
+            for (auto& entry : m_transfers)
+            {
+                stream << BeginLine(entry.first, entry.second) << "\n";
+
+                if (entry.second.complete)
+                {
+                    stream << "F\t" << entry.first << "\n";
+                }
+
+                for (auto offset : entry.second.ranges)
+                {
+                    stream << "R\t" << entry.first << "\t" << offset << "\n";
+                }
+            }
+
+            stream.close();
+
+            if (!stream)
+            {
+                throw runtime_error("Failed to write the transfer journal");
+            }
+
+#ifdef _WIN32
+            bool replaced = MoveFileExW(temporary.c_str(), m_path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+            bool replaced = rename(temporary.c_str(), m_path.c_str()) == 0;
+#endif
+
+            if (!replaced)
+            {
+                throw runtime_error("Failed to replace the transfer journal");
+            }
+        }
+
+        // Called with the lock held.
+        void Write(const string& line)
+        {
+            m_stream << line << "\n";
+
+            if (!m_stream.flush())
+            {
+                throw runtime_error("Failed to write the transfer journal");
+            }
+        }
+
+        string_t m_path;
+        mutable mutex m_mutex;
+        std::ofstream m_stream;
+        uint64_t m_next_id;
+        map<uint64_t, Transfer> m_transfers;
+        unordered_map<string_t, uint64_t> m_ids;
+    };
+
+    // Uploads local files through the transfer scheduler. A file that fits in a single range is
+    // sent with one upload_from_file call. Larger files are created at their full size and then
+    // sent as Put Range requests that run concurrently, each reading its own offset straight
+    // from the local file. With the mmap setting on, a range is sent from a memory-mapped view
+    // of the file instead of being copied into a buffer first.
+    // In delta mode every range is hashed into a RangeIndex sidecar. When the sidecar of the
+    // previous upload still matches the remote file, the file is resized in place and only the
+    // ranges whose hash changed are sent.
+    // Ranges that are all zeros are not sent: holes reported by the file system are skipped
+    // without reading them, and other ranges are scanned after they are read. A newly created
+    // remote file already reads as zeros there; a file updated in place gets a Clear Range,
+    // which carries no data.
+    // With a journal, every range sent and every file finished is recorded. A file whose upload
+    // was interrupted is resumed, as long as the remote file still has the expected size,
+    // by sending only the ranges the journal does not list.
+    class FileUploader
+    {
+    public:
+        // Put Range accepts at most 4 MiB per request.
+        static const size_t MaxRangeSize = 4 * 1024 * 1024;
+
+        FileUploader(const shared_ptr<TransferScheduler>& scheduler, const shared_ptr<IFileSystem>& file_system, size_t range_size = MaxRangeSize, bool delta = false, const shared_ptr<TransferJournal>& journal = nullptr)
+            : m_scheduler(scheduler), m_file_system(file_system), m_range_size(range_size), m_delta(delta), m_journal(journal)
+        {
+        }
+
+        // Returns whether the journal shows that this version of the local file was uploaded to
+        // the remote file.
+        bool IsUploaded(const cloud_file& file, const string_t& path) const
+        {
+            if (!m_journal)
+            {
+                return false;
+            }
+
+            LocalFileInfo info = m_file_system->GetLocalFileInfo(path);
+            return m_journal->IsComplete(path, file.uri().primary_uri().to_string(), info.size, Version(info));
+        }
+
+        // Nothing is sent before the after task completes.
+        pplx::task<void> Upload(cloud_file file, const string_t& path, const pplx::task<void>& after) const
+        {
+            shared_ptr<TransferScheduler> scheduler = m_scheduler;
+            shared_ptr<IFileSystem> fileSystem = m_file_system;
+            shared_ptr<TransferJournal> journal = m_journal;
+            int64_t size = 0;
+            string_t version;
+
+            // Only the size is needed while walking; the file is opened once its work runs, so
+            // queued files hold no descriptors.
+            try
+            {
+                LocalFileInfo info = m_file_system->GetLocalFileInfo(path);
+                size = info.size;
+
+                if (journal)
+                {
+                    version = Version(info);
+                }
+            }
+            catch (...)
+            {
+                return pplx::task_from_exception<void>(current_exception());
+            }
+
+            size_t rangeSize = m_range_size;
+            string_t remoteUri = file.uri().primary_uri().to_string();
+
+            if (!m_delta && size <= static_cast<int64_t>(m_range_size))
+            {
+                return scheduler->Submit([file, path, size, journal, remoteUri, version, rangeSize]()
+                {
+                    return BandwidthShaper::Instance().Pace(BandwidthShaper::Up, static_cast<uint64_t>(size)).then([file, path, size]() mutable
+                    {
+                        return TransferMetrics::Instance().Measure(TransferMetrics::FileUpload, static_cast<uint64_t>(size), [&](operation_context context)
+                        {
+                            return file.upload_from_file_async(path, file_access_condition(), TransferProfile::Instance().RequestOptions(), context);
+                        });
+                    }).then([path, size, journal, remoteUri, version, rangeSize]()
+                    {
+                        if (journal)
+                        {
+                            journal->Complete(journal->Begin(path, remoteUri, size, version, rangeSize, false));
+                        }
+                    });
+                }, after);
+            }
+
+            string_t sidecarPath = RangeIndex::SidecarPath(path);
+            shared_ptr<RangeIndex> previous;
+            shared_ptr<RangeIndex> current;
+
+            if (m_delta)
+            {
+                current = make_shared<RangeIndex>();
+                current->fileSize = size;
+                current->rangeSize = rangeSize;
+                current->hashes.resize(static_cast<size_t>((size + rangeSize - 1) / rangeSize));
+
+                previous = make_shared<RangeIndex>();
+
+                if (!previous->Load(sidecarPath, remoteUri) || previous->rangeSize != rangeSize)
+                {
+                    previous.reset();
+                }
+            }
+
+            shared_ptr<bool> incremental = make_shared<bool>(false);
+            shared_ptr<unordered_set<int64_t>> sent = make_shared<unordered_set<int64_t>>();
+
+            if (journal)
+            {
+                *sent = journal->CompletedRanges(path, remoteUri, size, version, rangeSize);
+            }
+
+            return scheduler->Submit([file, size, previous, incremental, sent]()
+            {
+                return CanResume(file, size, !sent->empty()).then([file, size, previous, incremental, sent](bool resume)
+                {
+                    if (resume)
+                    {
+                        return pplx::task_from_result();
+                    }
+
+                    sent->clear();
+
+                    return Prepare(file, size, previous).then([incremental](bool value)
+                    {
+                        *incremental = value;
+                    });
+                });
+            }, after).then([file, fileSystem, path, size, version, rangeSize, remoteUri, scheduler, previous, current, incremental, sent, journal]()
+            {
+                shared_ptr<FileState> state = make_shared<FileState>();
+                state->fileSystem = fileSystem;
+                state->path = path;
+                state->basis = *incremental ? previous : nullptr;
+                state->current = current;
+                state->journal = journal;
+                state->journalId = journal ? journal->Begin(path, remoteUri, size, version, rangeSize, !sent->empty()) : 0;
+                state->zeroed = !*incremental && sent->empty();
+                state->extents = fileSystem->OpenLocalFile(path)->DataExtents();
+
+                vector<pplx::task<void>> ranges;
+                size_t index = 0;
+
+                for (int64_t offset = 0; offset < size; offset += rangeSize, index++)
+                {
+                    size_t length = static_cast<size_t>((std::min)(static_cast<int64_t>(rangeSize), size - offset));
+                    bool alreadySent = sent->count(offset) > 0;
+
+                    ranges.push_back(scheduler->Post([file, state, offset, length, index, alreadySent]()
+                    {
+                        return UploadRange(file, state, offset, length, index, alreadySent);
+                    }));
+                }
+
+                return Util::WhenAll(ranges).then([journal, state]()
+                {
+                    if (journal)
+                    {
+                        journal->Complete(state->journalId);
+                    }
+                });
+            }).then([file, current, sidecarPath, remoteUri]() mutable
+            {
+                if (!current)
+                {
+                    return pplx::task_from_result();
+                }
+
+                return TransferMetrics::Instance().Measure(TransferMetrics::FileProperties, 0, [&file](operation_context context)
+                {
+                    return file.download_attributes_async(file_access_condition(), TransferProfile::Instance().RequestOptions(), context);
+                }).then([file, current, sidecarPath, remoteUri]()
+                {
+                    current->etag = file.properties().etag();
+                    current->Save(sidecarPath, remoteUri);
+                });
+            });
+        }
+
+    private:
+
+        // The journal tells versions of a local file apart by their size and write time.
+        static string_t Version(const LocalFileInfo& info)
+        {
+            return conversions::to_string_t(to_string(info.size) + "-" + to_string(info.modified));
+        }
+
+        // Returns whether an interrupted upload can carry on: the remote file must still exist
+        // with the size it was created with.
+        static pplx::task<bool> CanResume(cloud_file file, int64_t size, bool interrupted)
+        {
+            if (!interrupted)
+            {
+                return pplx::task_from_result(false);
+            }
+
+            return TransferMetrics::Instance().Measure(TransferMetrics::FileProperties, 0, [&file](operation_context context)
+            {
+                return file.download_attributes_async(file_access_condition(), TransferProfile::Instance().RequestOptions(), context);
+            }).then([file, size](pplx::task<void> attributes)
+            {
+                try
+                {
+                    attributes.get();
+                }
+                catch (const storage_exception&)
+                {
+                    return false;
+                }
+
+                return static_cast<int64_t>(file.properties().length()) == size;
+            });
+        }
+
+        // Creates the remote file at its full size and returns false, or, when the previous index
+        // still matches the remote file, resizes that file in place and returns true.
+        static pplx::task<bool> Prepare(cloud_file file, int64_t size, const shared_ptr<RangeIndex>& previous)
+        {
+            if (!previous)
+            {
+                return Create(file, size).then([]()
+                {
+                    return false;
+                });
+            }
+
+            return TransferMetrics::Instance().Measure(TransferMetrics::FileProperties, 0, [&file](operation_context context)
+            {
+                return file.download_attributes_async(file_access_condition(), TransferProfile::Instance().RequestOptions(), context);
+            }).then([file, size, previous](pplx::task<void> attributes) mutable
+            {
+                bool matches = false;
+
+                try
+                {
+                    attributes.get();
+                    matches = file.properties().etag() == previous->etag;
+                }
+                catch (const storage_exception&)
+                {
+                    // Most likely the remote file is gone; upload it in full.
+                }
+
+                if (!matches)
+                {
+                    return Create(file, size).then([]()
+                    {
+                        return false;
+                    });
+                }
+
+                if (previous->fileSize == size)
+                {
+                    return pplx::task_from_result(true);
+                }
+
+                return TransferMetrics::Instance().Measure(TransferMetrics::FileResize, 0, [&](operation_context context)
+                {
+                    return file.resize_async(size, file_access_condition(), TransferProfile::Instance().RequestOptions(), context);
+                }).then([]()
+                {
+                    return true;
+                });
+            });
+        }
+
+        static pplx::task<void> Create(cloud_file file, int64_t size)
+        {
+            return TransferMetrics::Instance().Measure(TransferMetrics::FileCreate, 0, [&](operation_context context)
+            {
+                return file.create_async(size, file_access_condition(), TransferProfile::Instance().RequestOptions(), context);
+            });
+        }
+
+        // What the ranges of one file upload share.
+        // Every range opens the local file for itself, so only the ranges in flight hold a
+        // descriptor, however many ranges are queued.
+        struct FileState
+        {
+            shared_ptr<IFileSystem> fileSystem;
+            string_t path;
+            shared_ptr<RangeIndex> basis;
+            shared_ptr<RangeIndex> current;
+            shared_ptr<TransferJournal> journal;
+            uint64_t journalId;
+
+            // The remote file was just created, so a range that is not sent reads as zeros.
+            bool zeroed;
+
+            vector<pair<int64_t, int64_t>> extents;
+        };
+
+        // Returns whether [offset, offset + length) overlaps one of the sorted data extents.
+        static bool HasData(const vector<pair<int64_t, int64_t>>& extents, int64_t offset, size_t length)
+        {
+            auto extent = upper_bound(extents.begin(), extents.end(), make_pair(offset, numeric_limits<int64_t>::max()));
+
+            if (extent != extents.begin() && prev(extent)->second > offset)
+            {
+                return true;
+            }
+
+            return extent != extents.end() && extent->first < offset + static_cast<int64_t>(length);
+        }
+
+        static void RangeDone(const shared_ptr<FileState>& state, int64_t offset)
+        {
+            if (state->journal)
+            {
+                state->journal->RangeDone(state->journalId, offset);
+            }
+        }
+
+        // Makes a range of zeros read as zeros remotely.
+        static pplx::task<void> ZeroRange(cloud_file file, const shared_ptr<FileState>& state, int64_t offset, size_t length)
+        {
+            if (state->zeroed)
+            {
+                RangeDone(state, offset);
+                return pplx::task_from_result();
+            }
+
+            return TransferMetrics::Instance().Measure(TransferMetrics::RangeClear, 0, [&](operation_context context)
+            {
+                return file.clear_range_async(offset, static_cast<int64_t>(length), file_access_condition(), TransferProfile::Instance().RequestOptions(), context);
+            }).then([state, offset]()
+            {
+                RangeDone(state, offset);
+            });
+        }
+
+        // Reads one range and sends it, unless its hash shows it is unchanged since the upload
+        // described by basis or an interrupted run already sent it. A range already sent is
+        // still read and hashed when a new index is being built. A range of zeros is passed to
+        // ZeroRange, and one lying in a hole is not even read unless it must be hashed.
+        static pplx::task<void> UploadRange(
+            cloud_file file,
+            const shared_ptr<FileState>& state,
+            int64_t offset,
+            size_t length,
+            size_t index,
+            bool alreadySent)
+        {
+            if (alreadySent && !state->current)
+            {
+                return pplx::task_from_result();
+            }
+
+            if (!state->current && !HasData(state->extents, offset, length))
+            {
+                return ZeroRange(file, state, offset, length);
+            }
+
+            return pplx::create_task([file, state, offset, length, index, alreadySent]() mutable -> pplx::task<void>
+            {
+                shared_ptr<ILocalFile> localFile = state->fileSystem->OpenLocalFile(state->path);
+                shared_ptr<const uint8_t> view = TransferProfile::Instance().MemoryMapped() ? localFile->MapView(offset, length) : nullptr;
+                vector<uint8_t> buffer;
+
+                if (!view)
+                {
+                    buffer.resize(length);
+
+                    if (localFile->ReadAt(offset, buffer.data(), length) != length)
+                    {
+                        throw runtime_error("File was truncated during upload");
+                    }
+                }
+
+                const uint8_t* data = view ? view.get() : buffer.data();
+                const shared_ptr<RangeIndex>& basis = state->basis;
+
+                if (state->current)
+                {
+                    uint64_t hash = Util::HashBlock(data, length);
+                    state->current->hashes[index] = hash;
+
+                    if (alreadySent)
+                    {
+                        return pplx::task_from_result();
+                    }
+
+                    if (basis && index < basis->hashes.size() && basis->hashes[index] == hash
+                        && (std::min)(static_cast<int64_t>(basis->rangeSize), basis->fileSize - offset) == static_cast<int64_t>(length))
+                    {
+                        return pplx::task_from_result();
+                    }
+                }
+
+                if (Util::IsZero(data, length))
+                {
+                    return ZeroRange(file, state, offset, length);
+                }
+
+                // A mapped view is sent in place; the request body reads the file's pages directly.
+                concurrency::streams::istream body = view
+                    ? concurrency::streams::rawptr_buffer<uint8_t>(view.get(), length).create_istream()
+                    : concurrency::streams::bytestream::open_istream(std::move(buffer));
+
+                return BandwidthShaper::Instance().Pace(BandwidthShaper::Up, length).then([file, body, offset, length]() mutable
+                {
+                    return TransferMetrics::Instance().Measure(TransferMetrics::RangePut, length, [&](operation_context context)
+                    {
+                        return file.write_range_async(body, offset, string_t(), file_access_condition(), TransferProfile::Instance().RequestOptions(), context);
+                    });
+                }).then([view, state, offset](pplx::task<void> sent)
+                {
+                    // Holds the view until the request, including any retries, is done with it.
+                    sent.get();
+                    RangeDone(state, offset);
+                });
+            });
+        }
+
+        shared_ptr<TransferScheduler> m_scheduler;
+        shared_ptr<IFileSystem> m_file_system;
+        size_t m_range_size;
+        bool m_delta;
+        shared_ptr<TransferJournal> m_journal;
+    };
+
+    // A shell glob compiled once into tokens and matched in place, without building strings:
+    // '*' matches any run of characters within a name, '?' one character, [a-z] and [!abc] one
+    // character of a set, and '\' quotes the next character. A pattern containing '/' is matched
+    // against the whole relative path one level per segment, where a "**" segment matches any
+    // number of directories; such a pattern also tells which directories cannot lead to a match.
+    // Without '/' the pattern is matched against the last name only.
+    class GlobMatcher
+    {
+    public:
+        GlobMatcher(const string_t& pattern, bool ignore_case)
+            : m_ignore_case(ignore_case), m_anchored(pattern.find(_XPLATSTR('/')) != string_t::npos)
+        {
+            for (auto& part : Util::Split(pattern, _XPLATSTR("/")))
+            {
+                m_segments.push_back(Compile(part));
+            }
+
+            if (m_segments.empty())
+            {
+                throw invalid_argument("Empty pattern");
+            }
+        }
+
+        // Matches a path relative to the search root, with '/' separators.
+        bool Matches(const string_t& path) const
+        {
+            if (!m_anchored)
+            {
+                size_t slash = path.find_last_of(_XPLATSTR('/'));
+                size_t start = slash == string_t::npos ? 0 : slash + 1;
+                return MatchSegment(m_segments[0], path.data() + start, path.size() - start);
+            }
+
+            vector<pair<size_t, size_t>> parts = Segments(path);
+            return MatchPath(path, parts, 0, 0, false);
+        }
+
+        // Returns false when nothing below the directory can match, so it need not be listed.
+        bool CanMatchBelow(const string_t& directoryPath) const
+        {
+            if (!m_anchored)
+            {
+                return true;
+            }
+
+            vector<pair<size_t, size_t>> parts = Segments(directoryPath);
+            return MatchPath(directoryPath, parts, 0, 0, true);
+        }
+
+    private:
+
+        struct Token
+        {
+            enum Kind { Literal, Any, Star, Set };
+
+            Kind kind;
+            utility::char_t character;
+            bool negated;
+            vector<pair<utility::char_t, utility::char_t>> ranges;
+        };
+
+        struct Segment
+        {
+            bool recursive;
+            vector<Token> tokens;
+        };
+
+        Segment Compile(const string_t& text) const
+        {
+            Segment segment;
+            segment.recursive = text == _XPLATSTR("**");
+
+            for (size_t i = 0; i < text.size() && !segment.recursive; i++)
+            {
+                Token token;
+                token.kind = Token::Literal;
+                token.character = Fold(text[i]);
+                token.negated = false;
+
+                if (text[i] == _XPLATSTR('*'))
+                {
+                    token.kind = Token::Star;
+                }
+                else if (text[i] == _XPLATSTR('?'))
+                {
+                    token.kind = Token::Any;
+                }
+                else if (text[i] == _XPLATSTR('\\') && i + 1 < text.size())
+                {
+                    token.character = Fold(text[++i]);
+                }
+                else if (text[i] == _XPLATSTR('['))
+                {
+                    size_t end = i + 1;
+
+                    if (end < text.size() && (text[end] == _XPLATSTR('!') || text[end] == _XPLATSTR('^')))
+                    {
+                        token.negated = true;
+                        end++;
+                    }
+
+                    size_t first = end;
+
+                    // A ']' right after the opening bracket is part of the set.
+                    while (end < text.size() && (text[end] != _XPLATSTR(']') || end == first))
+                    {
+                        utility::char_t low = Fold(text[end]);
+                        utility::char_t high = low;
+
+                        if (end + 2 < text.size() && text[end + 1] == _XPLATSTR('-') && text[end + 2] != _XPLATSTR(']'))
+                        {
+                            high = Fold(text[end + 2]);
+                            end += 2;
+                        }
+
+                        token.ranges.push_back(make_pair(low, high));
+                        end++;
+                    }
+
+                    // Without a closing bracket the '[' is an ordinary character.
+                    if (end < text.size())
+                    {
+                        token.kind = Token::Set;
+                        i = end;
+                    }
+                    else
+                    {
+                        token.negated = false;
+                        token.ranges.clear();
+                    }
+                }
+
+                // Consecutive stars match the same as one.
+                if (token.kind != Token::Star || segment.tokens.empty() || segment.tokens.back().kind != Token::Star)
+                {
+                    segment.tokens.push_back(token);
+                }
+            }
+
+            return segment;
+        }
+
+        utility::char_t Fold(utility::char_t c) const
+        {
+            return m_ignore_case && c >= _XPLATSTR('A') && c <= _XPLATSTR('Z') ? static_cast<utility::char_t>(c - _XPLATSTR('A') + _XPLATSTR('a')) : c;
+        }
+
+        bool MatchOne(const Token& token, utility::char_t c) const
+        {
+            switch (token.kind)
+            {
+            case Token::Any:
+                return true;
+            case Token::Literal:
+                return Fold(c) == token.character;
+            case Token::Set:
+            {
+                utility::char_t folded = Fold(c);
+                bool found = false;
+
+                for (auto& range : token.ranges)
+                {
+                    found = found || (folded >= range.first && folded <= range.second);
+                }
+
+                return found != token.negated;
+            }
+            default:
+                return false;
+            }
+        }
+
+        // Matches one name, backtracking only to the most recent star.
+        bool MatchSegment(const Segment& segment, const utility::char_t* text, size_t length) const
+        {
+            const vector<Token>& tokens = segment.tokens;
+            size_t t = 0;
+            size_t i = 0;
+            size_t star = string_t::npos;
+            size_t starText = 0;
+
+            if (segment.recursive)
+            {
+                return true;
+            }
+
+            while (i < length)
+            {
+                if (t < tokens.size() && tokens[t].kind == Token::Star)
+                {
+                    star = t++;
+                    starText = i;
+                }
+                else if (t < tokens.size() && MatchOne(tokens[t], text[i]))
+                {
+                    t++;
+                    i++;
+                }
+                else if (star != string_t::npos)
+                {
+                    t = star + 1;
+                    i = ++starText;
+                }
+                else
+                {
+                    return false;
+                }
+            }
+
+            while (t < tokens.size() && tokens[t].kind == Token::Star)
+            {
+                t++;
+            }
+
+            return t == tokens.size();
+        }
+
+        // Matches path segments from part on against pattern segments from segment on. As a
+        // prefix, the path is a directory that matches when segments are left for what is below.
+        bool MatchPath(const string_t& path, const vector<pair<size_t, size_t>>& parts, size_t segment, size_t part, bool prefix) const
+        {
+            if (part == parts.size())
+            {
+                if (prefix)
+                {
+                    return segment < m_segments.size();
+                }
+
+                while (segment < m_segments.size() && m_segments[segment].recursive)
+                {
+                    segment++;
+                }
+
+                return segment == m_segments.size();
+            }
+
+            if (segment == m_segments.size())
+            {
+                return false;
+            }
+
+            if (m_segments[segment].recursive)
+            {
+                return MatchPath(path, parts, segment + 1, part, prefix) || MatchPath(path, parts, segment, part + 1, prefix);
+            }
+
+            return MatchSegment(m_segments[segment], path.data() + parts[part].first, parts[part].second)
+                && MatchPath(path, parts, segment + 1, part + 1, prefix);
+        }
+
+        // Returns the start and length of every '/' separated segment of the path.
+        static vector<pair<size_t, size_t>> Segments(const string_t& path)
+        {
+            vector<pair<size_t, size_t>> parts;
+            size_t start = 0;
+
+            while (start < path.size())
+            {
+                size_t end = path.find(_XPLATSTR('/'), start);
+
+                if (end == string_t::npos)
+                {
+                    end = path.size();
+                }
+
+                if (end > start)
+                {
+                    parts.push_back(make_pair(start, end - start));
+                }
+
+                start = end + 1;
+            }
+
+            return parts;
+        }
+
+        bool m_ignore_case;
+        bool m_anchored;
+        vector<Segment> m_segments;
+    };
+
+    // A list of remote files, written by find -out and read by delete -from and download -from.
+    // After a header comes the directory the files were found under, as a /share/path or a URL,
+    // and then one path relative to it per line.
+    struct RemoteFileList
+    {
+        string_t root;
+        vector<string_t> paths;
+
+        static string Header()
+        {
+            return "#AzureFileConsole file list 1";
+        }
+
+        static RemoteFileList Load(const string_t& path)
+        {
+            std::ifstream stream(path.c_str());
+            RemoteFileList list;
+            string line;
+
+            if (!getline(stream, line) || line != Header() || !getline(stream, line))
+            {
+                throw runtime_error("Not a file list written by find -out");
+            }
+
+            list.root = conversions::to_string_t(line);
+
+            while (getline(stream, line))
+            {
+                if (!line.empty())
+                {
+                    list.paths.push_back(conversions::to_string_t(line));
+                }
+            }
+
+            return list;
+        }
+    };
+
+    class ICommand
+    {
+    public:
+
+        ICommand()
+        {
+        }
+
+        virtual void PreExecute() = 0;
+        virtual void Execute() = 0;
+        virtual void PostExecute() = 0;
+    };
+
+    class CommandBase : public ICommand
+    {
+    public:
+        CommandBase(const string_t& command, const vector<string_t>& arguments, AzureFileContext& context,  const shared_ptr<IFileSystem>& file_system)
+            : m_command(command), m_arguments(arguments), m_context(context), m_file_system(file_system), m_scheduler(context.Scheduler()), ICommand()
+        {
+        }
+
+        void PreExecute()
+        {
+        }
+
+        void Execute()
+        {
+        }
+
+        void PostExecute()
+        {
+        }
+
+    protected:
+
+        // Removes a flag such as "-r" from the arguments and returns whether it was given.
+        bool TakeFlag(const string_t& name)
+        {
+            auto it = std::find(m_arguments.begin(), m_arguments.end(), name);
+
+            if (it == m_arguments.end())
+            {
+                return false;
+            }
+
+            m_arguments.erase(it);
+            return true;
+        }
+
+        // Removes an option such as "-p 16" from the arguments and returns its value.
+        bool TakeOption(const string_t& name, string_t& value)
+        {
+            auto it = std::find(m_arguments.begin(), m_arguments.end(), name);
+
+            if (it == m_arguments.end())
+            {
+                return false;
+            }
+
+            if (it + 1 == m_arguments.end())
+            {
+                throw invalid_argument("Missing value for option");
+            }
+
+            value = *(it + 1);
+            m_arguments.erase(it, it + 2);
+            return true;
+        }
+
+        // Removes "-p n" from the arguments and returns n, a positive count capped at the
+        // connections setting.
+        bool TakeParallelism(size_t& value)
+        {
+            string_t text;
+
+            if (!TakeOption(_XPLATSTR("-p"), text))
+            {
+                return false;
+            }
+
+            uint64_t parallelism = 0;
+
+            try
+            {
+                parallelism = Util::ParseNumber(text);
+            }
+            catch (const invalid_argument&)
+            {
+            }
+
+            if (parallelism == 0)
+            {
+                throw invalid_argument("-p must be a positive number");
+            }
+
+            value = static_cast<size_t>((std::min)(parallelism, static_cast<uint64_t>(TransferProfile::Instance().Connections())));
+            return true;
+        }
+
+        // Applies -p to this command only: its work goes through a scheduler of its own that
+        // keeps at most that many of its items in flight on the session's scheduler.
+        void TakeParallelismLimit()
+        {
+            size_t parallelism = 0;
+
+            if (TakeParallelism(parallelism))
+            {
+                m_scheduler = make_shared<TransferScheduler>(m_context.Scheduler(), m_context.Cancellation(), parallelism);
+            }
+        }
+
+        // True once the background job running this command has been canceled. Long loops check
+        // it between items; work already handed to the scheduler is dropped by the scheduler.
+        bool IsCanceled() const
+        {
+            return m_context.Cancellation().is_canceled();
+        }
+
+        // Drops cached listings under the current directory, for commands that change it.
+        void InvalidateCache()
+        {
+            m_context.Cache()->Invalidate(m_context.CurrentDirectory().uri().primary_uri().to_string());
+        }
+
+        // A URL is used as is, with any query taken as its SAS. A path starting with '/' begins
+        // with a share name; any other path starts at the current directory.
+        cloud_file_directory ResolveDirectory(const string_t& path)
+        {
+            if (Util::IsUrl(path))
+            {
+                return cloud_file_directory(storage_uri(web::uri(Util::UrlPath(path))), UrlCredentials(path));
+            }
+
+            vector<string_t> parts = Util::Split(path, _XPLATSTR("/"));
+            cloud_file_directory directory;
+            size_t first = 0;
+
+            if (path[0] == _XPLATSTR('/'))
+            {
+                if (parts.empty())
+                {
+                    throw invalid_argument("Missing share name");
+                }
+
+                directory = m_context.FileClient().get_share_reference(parts[0]).get_root_directory_reference();
+                first = 1;
+            }
+            else if (m_context.CurrentShare().is_valid())
+            {
+                directory = m_context.CurrentDirectory();
+            }
+            else
+            {
+                throw invalid_argument("Not in a share root directory");
+            }
+
+            for (size_t i = first; i < parts.size(); i++)
+            {
+                if (parts[i] == _XPLATSTR(".."))
+                {
+                    directory = directory.get_parent_directory_reference();
+                }
+                else if (parts[i] != _XPLATSTR("."))
+                {
+                    directory = directory.get_subdirectory_reference(parts[i]);
+                }
+            }
+
+            return directory;
+        }
+
+        cloud_file ResolveFile(const string_t& path)
+        {
+            if (Util::IsUrl(path))
+            {
+                return cloud_file(storage_uri(web::uri(Util::UrlPath(path))), UrlCredentials(path));
+            }
+
+            size_t slash = path.find_last_of(_XPLATSTR('/'));
+
+            if (slash == string_t::npos)
+            {
+                return ResolveDirectory(_XPLATSTR(".")).get_file_reference(path);
+            }
+
+            if (slash + 1 == path.size())
+            {
+                throw invalid_argument("Missing file name");
+            }
+
+            return ResolveDirectory(path.substr(0, slash + 1)).get_file_reference(path.substr(slash + 1));
+        }
+
+        // Returns the /share/path form of a directory, which ResolveDirectory accepts from any
+        // current directory.
+        static string_t SharePath(const cloud_file_directory& directory)
+        {
+            cloud_file_share share = directory.get_share_reference();
+            string_t sharePath = share.uri().primary_uri().path();
+            string_t path = directory.uri().primary_uri().path();
+
+            return _XPLATSTR("/") + share.name() + web::uri::decode(path.size() > sharePath.size() ? path.substr(sharePath.size()) : string_t());
+        }
+
+        // Resolves the path of a file relative to a directory, with '/' separators.
+        static cloud_file ResolveRelative(cloud_file_directory directory, const string_t& path)
+        {
+            vector<string_t> parts = Util::Split(path, _XPLATSTR("/"));
+
+            if (parts.empty())
+            {
+                throw invalid_argument("Empty path");
+            }
+
+            for (size_t i = 0; i + 1 < parts.size(); i++)
+            {
+                directory = directory.get_subdirectory_reference(parts[i]);
+            }
+
+            return directory.get_file_reference(parts.back());
+        }
+
+        // The SAS in the query of a URL. A URL without one gets the session's credentials when it
+        // points into the session's account, as the roots find -out writes do.
+        storage_credentials UrlCredentials(const string_t& url) const
+        {
+            size_t query = url.find(_XPLATSTR('?'));
+
+            if (query != string_t::npos)
+            {
+                return storage_credentials(url.substr(query + 1));
+            }
+
+            cloud_file_client client = m_context.FileClient();
+            return web::uri(url).host() == client.base_uri().primary_uri().host() ? client.credentials() : storage_credentials();
+        }
+
+        string_t m_command_line;
+        string_t m_command;
+        vector<string_t> m_arguments;
+
+        AzureFileContext& m_context;
+
+        shared_ptr<IFileSystem> m_file_system;
+
+        // The context's scheduler, or one limited by -p for this command.
+        shared_ptr<TransferScheduler> m_scheduler;
+    };
+
+    class DefaultCommand : public CommandBase
+    {
+    public:
+        DefaultCommand(const string_t& command, const vector<string_t>& arguments, AzureFileContext& context, const shared_ptr<IFileSystem>& file_system)
+            : CommandBase(command, arguments, context, file_system)
+        {
+        }
+    };
+
+    // Lists the current directory. Segments are printed as they arrive, with the request for the
+    // next segment already on the wire. With -r the whole tree is walked, listing up to -p
+    // directories at a time.
+    class DirCommand : public CommandBase
+    {
+    public:
+        DirCommand(const string_t& command, const vector<string_t>& arguments, AzureFileContext& context, const shared_ptr<IFileSystem>& file_system)
+            : CommandBase(command, arguments, context, file_system), m_recursive(false)
+        {
+        }
+
+        void PreExecute()
+        {
+            m_recursive = TakeFlag(_XPLATSTR("-r"));
+
+            TakeParallelismLimit();
+
+            if (m_recursive && !m_context.CurrentShare().is_valid())
+            {
+                throw invalid_argument("Not in a share root directory");
+            }
+        }
+
+        void Execute()
+        {
+            if (!m_context.CurrentShare().is_valid())
+            {
+                ListShares();
+            }
+            else if (m_recursive)
+            {
+                ListTree();
+            }
+            else
+            {
+                ListDirectory();
+            }
+
+            ucout.flush();
+        }
+
+    private:
+
+        void ListShares()
+        {
+            cloud_file_client client = m_context.FileClient();
+            shared_ptr<const RemoteCache::Listing> cached = m_context.Cache()->Find(client.base_uri().primary_uri().to_string());
+
+            if (cached)
+            {
+                for (auto& entry : *cached)
+                {
+                    ucout << _XPLATSTR("    ") << entry.name << _XPLATSTR("\n");
+                }
+
+                return;
+            }
+
+            auto list = [&client](const continuation_token& token)
+            {
+                return TransferMetrics::Instance().Measure(TransferMetrics::ShareList, 0, [&](operation_context context)
+                {
+                    return client.list_shares_segmented_async(string_t(), false, 0, token, TransferProfile::Instance().RequestOptions(), context);
+                });
+            };
+
+            pplx::task<share_result_segment> next = list(continuation_token());
+
+            for (;;)
+            {
+                share_result_segment segment = next.get();
+                bool more = !segment.continuation_token().empty();
+
+                if (more)
+                {
+                    next = list(segment.continuation_token());
+                }
+
+                for (auto& item : segment.results())
+                {
+                    ucout << _XPLATSTR("    ") << item.name() << _XPLATSTR("\n");
+                }
+
+                if (!more)
+                {
+                    break;
+                }
+            }
+        }
+
+        void ListDirectory()
+        {
+            cloud_file_directory directory = m_context.CurrentDirectory();
+            shared_ptr<const RemoteCache::Listing> cached = m_context.Cache()->Find(directory.uri().primary_uri().to_string());
+
+            if (cached)
+            {
+                for (auto& entry : *cached)
+                {
+                    ucout << (entry.isDirectory ? _XPLATSTR("<d> ") : _XPLATSTR("    ")) << entry.name << _XPLATSTR("\n");
+                }
+
+                return;
+            }
+
+            auto list = [&directory](const continuation_token& token)
+            {
+                return TransferMetrics::Instance().Measure(TransferMetrics::DirectoryList, 0, [&](operation_context context)
+                {
+                    return directory.list_files_and_directories_segmented_async(0, token, TransferProfile::Instance().RequestOptions(), context);
+                });
+            };
+
+            pplx::task<list_file_and_directory_result_segment> next = list(continuation_token());
+
+            for (;;)
+            {
+                list_file_and_directory_result_segment segment = next.get();
+                bool more = !segment.continuation_token().empty();
+
+                if (more)
+                {
+                    next = list(segment.continuation_token());
+                }
+
+                for (auto& item : segment.results())
+                {
+                    ucout << (item.is_directory() ? _XPLATSTR("<d> ") : _XPLATSTR("    ")) << RemoteWalker::Name(item) << _XPLATSTR("\n");
+                }
+
+                if (!more)
+                {
+                    break;
+                }
+            }
+        }
+
+        void ListTree()
+        {
+            mutex outputMutex;
+            size_t files = 0;
+            size_t directories = 0;
+
+            RemoteWalker::Walk(m_scheduler, m_context.CurrentDirectory(), [&](const string_t& path, const list_file_and_directory_item& item)
+            {
+                lock_guard<mutex> lock(outputMutex);
+
+                if (item.is_directory())
+                {
+                    directories++;
+                    ucout << _XPLATSTR("<d> ") << path << _XPLATSTR("\n");
+                }
+                else
+                {
+                    files++;
+                    ucout << _XPLATSTR("    ") << path << _XPLATSTR("\n");
+                }
+
+                return true;
+            }).get();
+
+            ucout << files << " files, " << directories << " directories" << endl;
+        }
+
+        bool m_recursive;
+    };
+
+    class CdCommand : public CommandBase
+    {
+    public:
+        CdCommand(const string_t& command, const vector<string_t>& arguments, AzureFileContext& context, const shared_ptr<IFileSystem>& file_system)
+            : CommandBase(command, arguments, context, file_system)
+        {
+        }
+
+        void PreExecute()
+        {
+            if (m_arguments.size() == 0)
+            {
+                throw invalid_argument("Missing arguments");
+            }
+
+            string_t directory_name = m_arguments[0];
+
+            if (!m_context.CurrentShare().is_valid())
+            {
+                if (directory_name.compare(_XPLATSTR(".")) == 0
+                    || directory_name.compare(_XPLATSTR("..")) == 0)
+                {
+                    // share.exists() throws if share_name is "." or ".."
+                    throw invalid_argument("Invalid share name");
+                }
+            }
+        }
+
+        void Execute()
+        {
+            if (!m_context.CurrentShare().is_valid())
+            {
+                string_t share_name = m_arguments[0];
+
+                cloud_file_share share = m_context.FileClient().get_share_reference(share_name);
+
+                if (m_context.Cache()->ShareExists(m_context.FileClient(), share_name))
+                {
+                    m_context.CurrentShare(share);
+                    m_context.CurrentDirectory(m_context.CurrentShare().get_root_directory_reference());
+                    m_context.CurrentUri(m_context.CurrentDirectory().uri().primary_uri().to_string());
+                    m_context.Cache()->Prefetch(m_context.CurrentDirectory());
+                }
+                else
+                {
+                    throw invalid_argument("Invalid share name");
+                }
+            }
+            else
+            {
+                string_t directory_name = m_arguments[0];
+
+                if (directory_name.compare(_XPLATSTR("..")) == 0)
+                {
+                    string_t currentDirectoryPath = m_context.CurrentDirectory().uri().path();
+                    string_t rootDirectoryPath = m_context.CurrentShare().get_root_directory_reference().uri().path();
+
+                    if (currentDirectoryPath.compare(rootDirectoryPath) == 0)
+                    {
+                        m_context.CurrentShare(cloud_file_share());
+                        m_context.CurrentDirectory(cloud_file_directory());
+                        m_context.CurrentUri(m_context.FileClient().base_uri().primary_uri().to_string());
+                    }
+                    else
+                    {
+                        // Note: The parent_directory of root_directory is still the root_directory
+                        m_context.CurrentDirectory(m_context.CurrentDirectory().get_parent_directory_reference());
+                        m_context.CurrentUri(m_context.CurrentDirectory().uri().primary_uri().to_string());
+                        m_context.Cache()->Prefetch(m_context.CurrentDirectory());
+                    }
+                }
+                else if (directory_name.compare(_XPLATSTR(".")) != 0)
+                {
+                    cloud_file_directory subdir = m_context.CurrentDirectory().get_subdirectory_reference(directory_name);
+
+                    if (m_context.Cache()->DirectoryExists(m_context.CurrentDirectory(), directory_name))
+                    {
+                        m_context.CurrentDirectory(subdir);
+                        m_context.CurrentUri(m_context.CurrentDirectory().uri().primary_uri().to_string());
+                        m_context.Cache()->Prefetch(m_context.CurrentDirectory());
+                    }
+                    else
+                    {
+                        throw invalid_argument("Invalid directory name");
+                    }
+                }
+            }
+        }
+    };
+
+    class UploadCommand : public CommandBase
+    {
+    public:
+        UploadCommand(const string_t& command, const vector<string_t>& arguments, AzureFileContext& context, const shared_ptr<IFileSystem>& file_system)
+            : CommandBase(command, arguments, context, file_system), m_range_size((std::min)(TransferProfile::Instance().RangeSize(), static_cast<size_t>(FileUploader::MaxRangeSize))), m_delta(false)
+        {
+        }
+
+        void PreExecute()
+        {
+            string_t rangeSize;
+
+            m_delta = TakeFlag(_XPLATSTR("-delta"));
+            TakeOption(_XPLATSTR("-journal"), m_journal_path);
+
+            TakeParallelismLimit();
+
+            if (TakeOption(_XPLATSTR("-range"), rangeSize))
+            {
+                m_range_size = static_cast<size_t>(Util::ParseSize(rangeSize));
+
+                if (m_range_size == 0 || m_range_size > FileUploader::MaxRangeSize)
+                {
+                    throw invalid_argument("Range size must be between 1 byte and 4M");
+                }
+            }
+
+            if (m_arguments.size() == 0)
+            {
+                throw invalid_argument("Missing arguments");
+            }
+
+            if (!m_context.CurrentShare().is_valid())
+            {
+                throw invalid_argument("Not in a share root directory");
+            }
+        }
+
+        void PostExecute()
+        {
+            InvalidateCache();
+        }
+
+        void Execute()
+        {
+            InvalidateCache();
+
+            string_t path = m_arguments[0];
+            string_t fileName;
+            TransferBatch batch(m_scheduler);
+            shared_ptr<TransferJournal> journal = m_journal_path.empty() ? nullptr : TransferJournal::Open(m_journal_path);
+            FileUploader uploader(m_scheduler, m_file_system, m_range_size, m_delta, journal);
+
+            if (m_file_system->IsDirectory(path))
+            {
+                // The walk and the remote directories share one tree, so a file is matched to its
+                // remote directory by node and its full local path is built only to open it.
+                shared_ptr<PathTree> tree = make_shared<PathTree>(path);
+                utility::char_t separator = m_file_system->PathSeparators().front();
+                RemoteDirectoryCreator directories(m_context.CurrentDirectory(), m_scheduler, tree);
+
+                m_file_system->ProcessTree(
+                    *tree,
+                    [&](PathTree::Id d)
+                    {
+                        if (!IsCanceled())
+                        {
+                            batch.Track(directories.Create(d));
+                        }
+                    },
+                    [&](PathTree::Id f)
+                    {
+                        if (IsCanceled())
+                        {
+                            return;
+                        }
+
+                        string_t localPath = tree->Path(f, separator);
+
+                        // Sidecars belong to delta uploads; otherwise they are ordinary files.
+                        if ((m_delta && RangeIndex::IsSidecar(localPath)) || localPath == m_journal_path)
+                        {
+                            return;
+                        }
+
+                        cloud_file file = directories.File(f);
+                        pplx::task<void> parent = directories.Create(tree->Parent(f));
+
+                        if (uploader.IsUploaded(file, localPath))
+                        {
+                            batch.Track(parent);
+                            ucout << "Skipped " << localPath << ", already uploaded" << endl;
+                            return;
+                        }
+
+                        batch.Track(uploader.Upload(file, localPath, parent).then([tree, f, separator]()
+                        {
+                            ucout << "Uploaded " << tree->Path(f, separator) << endl;
+                        }));
+                    });
+            }
+            else
+            {
+                if (m_arguments.size() > 1)
+                {
+                    fileName = m_arguments[1];
+                }
+                else
+                {
+                    fileName = m_file_system->GetFileName(path);
+                }
+
+                cloud_file file = m_context.CurrentDirectory().get_file_reference(fileName);
+
+                if (uploader.IsUploaded(file, path))
+                {
+                    ucout << "Skipped " << path << ", already uploaded" << endl;
+                    return;
+                }
+
+                batch.Track(uploader.Upload(file, path, pplx::task_from_result()));
+            }
+
+            batch.Wait();
+        }
+
+    private:
+        size_t m_range_size;
+        bool m_delta;
+        string_t m_journal_path;
+    };
+
+    class DownloadCommand : public CommandBase
+    {
+    public:
+        DownloadCommand(const string_t& command, const vector<string_t>& arguments, AzureFileContext& context, const shared_ptr<IFileSystem>& file_system)
+            : CommandBase(command, arguments, context, file_system), m_range_size(TransferProfile::Instance().RangeSize())
+        {
+        }
+
+        void PreExecute()
+        {
+            string_t rangeSize;
+
+            TakeOption(_XPLATSTR("-journal"), m_journal_path);
+            TakeOption(_XPLATSTR("-from"), m_list_path);
+
+            TakeParallelismLimit();
+
+            if (TakeOption(_XPLATSTR("-range"), rangeSize))
+            {
+                m_range_size = static_cast<size_t>(Util::ParseSize(rangeSize));
+
+                if (m_range_size == 0)
+                {
+                    throw invalid_argument("Invalid range size");
+                }
+            }
+
+            if (!m_list_path.empty())
+            {
+                return;
+            }
+
+            if (m_arguments.size() == 0)
+            {
+                throw invalid_argument("Missing arguments");
+            }
+
+            if (!m_context.CurrentShare().is_valid())
+            {
+                throw invalid_argument("Not in a share root directory");
+            }
+        }
+
+        void Execute()
+        {
+            m_journal = m_journal_path.empty() ? nullptr : TransferJournal::Open(m_journal_path);
+
+            if (!m_list_path.empty())
+            {
+                DownloadList(m_arguments.empty() ? string_t(_XPLATSTR(".")) : m_arguments[0]);
+                return;
+            }
+
+            string_t fileName = m_arguments[0];
+            string_t path = m_arguments.size() > 1 ? m_arguments[1] : fileName;
+            TransferBatch batch(m_scheduler);
+
+            batch.Track(Download(m_context.CurrentDirectory().get_file_reference(fileName), path));
+            batch.Wait();
+        }
+
+    private:
+
+        // Downloads every file of a list written by find -out into the local directory, keeping
+        // the paths the files had below the directory they were found under. All files go into
+        // one batch, so the ranges of many files share the connections. A path with an empty,
+        // "." or ".." segment would leave the local directory and is refused.
+        void DownloadList(const string_t& localDirectory)
+        {
+            RemoteFileList list = RemoteFileList::Load(m_list_path);
+            cloud_file_directory root = ResolveDirectory(list.root);
+            string_t separators = m_file_system->PathSeparators();
+            string_t separator = separators.substr(0, 1);
+            TransferBatch batch(m_scheduler);
+            size_t failed = 0;
+
+            for (auto& path : list.paths)
+            {
+                if (IsCanceled())
+                {
+                    break;
+                }
+
+                vector<string_t> parts = Util::Split(path, _XPLATSTR("/"));
+                string_t localPath = localDirectory;
+
+                try
+                {
+                    if (parts.empty() || path[0] == _XPLATSTR('/') || path.back() == _XPLATSTR('/') || path.find(_XPLATSTR("//")) != string_t::npos)
+                    {
+                        throw invalid_argument("Invalid path in the file list");
+                    }
+
+                    for (size_t i = 0; i < parts.size(); i++)
+                    {
+                        if (parts[i] == _XPLATSTR(".") || parts[i] == _XPLATSTR("..") || parts[i].find_first_of(separators) != string_t::npos)
+                        {
+                            throw invalid_argument("Invalid path in the file list");
+                        }
+                    }
+
+                    for (size_t i = 0; i < parts.size(); i++)
+                    {
+                        if (!localPath.empty() && separator.find(localPath.back()) == string_t::npos)
+                        {
+                            localPath.append(separator);
+                        }
+
+                        localPath.append(parts[i]);
+
+                        if (i + 1 < parts.size())
+                        {
+                            m_file_system->MakeDirectory(localPath);
+                        }
+                    }
+
+                    batch.Track(Download(ResolveRelative(root, path), localPath));
+                }
+                catch (const std::exception& e)
+                {
+                    ucout << path << _XPLATSTR(": ") << e.what() << endl;
+                    failed++;
+                }
+            }
+
+            batch.Wait();
+
+            if (IsCanceled())
+            {
+                throw runtime_error("Canceled");
+            }
+
+            if (failed > 0)
+            {
+                throw runtime_error(to_string(failed) + " of " + to_string(list.paths.size()) + " downloads failed");
+            }
+        }
+
+        // Starts the download of a remote file and returns the task that finishes once the file
+        // is written. The properties of the file and the list of its valid ranges are fetched as
+        // scheduled items; every range still missing locally is then posted as an item of its
+        // own, so the ranges of several files can be in flight together.
+        pplx::task<void> Download(cloud_file file, const string_t& path)
+        {
+            shared_ptr<TransferScheduler> scheduler = m_scheduler;
+            shared_ptr<IFileSystem> fileSystem = m_file_system;
+            shared_ptr<TransferJournal> journal = m_journal;
+            size_t rangeSize = m_range_size;
+
+            return scheduler->Submit([file]() mutable
+            {
+                return TransferMetrics::Instance().Measure(TransferMetrics::FileProperties, 0, [&file](operation_context context)
+                {
+                    return file.download_attributes_async(file_access_condition(), TransferProfile::Instance().RequestOptions(), context);
+                });
+            }).then([file, path, scheduler, fileSystem, journal, rangeSize]()
+            {
+                int64_t size = static_cast<int64_t>(file.properties().length());
+                string_t remoteUri = file.uri().primary_uri().to_string();
+                string_t version = file.properties().etag();
+                unordered_set<int64_t> received;
+
+                // An interrupted download of the same remote version resumes into the partly
+                // written local file, which was sized in full before the first range arrived.
+                if (journal && LocalSize(fileSystem, path) == size)
+                {
+                    if (journal->IsComplete(path, remoteUri, size, version))
+                    {
+                        ucout << "Skipped " << path << ", already downloaded" << endl;
+                        return pplx::task_from_result();
+                    }
+
+                    received = journal->CompletedRanges(path, remoteUri, size, version, rangeSize);
+                }
+
+                // Only the ranges the service holds data for are fetched; the rest of the file
+                // reads as zeros and stays a hole locally.
+                shared_ptr<vector<pair<int64_t, int64_t>>> extents = make_shared<vector<pair<int64_t, int64_t>>>();
+
+                return scheduler->Post([file, size, extents]()
+                {
+                    return ValidExtents(file, size).then([extents](vector<pair<int64_t, int64_t>> value)
+                    {
+                        *extents = value;
+                    });
+                }).then([file, path, scheduler, fileSystem, journal, rangeSize, size, remoteUri, version, received, extents]()
+                {
+                    int64_t validBytes = 0;
+
+                    for (auto& extent : *extents)
+                    {
+                        validBytes += extent.second - extent.first;
+                    }
+
+                    // The local file is sized before any range arrives, so every range is written
+                    // at its own offset without coordinating with the others. A file with holes
+                    // is only extended; a dense one has its blocks reserved up front.
+                    shared_ptr<ILocalFile> localFile;
+
+                    if (!received.empty())
+                    {
+                        localFile = fileSystem->UpdateLocalFile(path);
+                    }
+                    else if (validBytes < size)
+                    {
+                        localFile = fileSystem->CreateLocalFile(path);
+                        localFile->AllocateSparse(size);
+                    }
+                    else
+                    {
+                        localFile = fileSystem->CreateLocalFile(path);
+                        localFile->Allocate(size);
+                    }
+
+                    uint64_t journalId = journal ? journal->Begin(path, remoteUri, size, version, rangeSize, !received.empty()) : 0;
+                    vector<pplx::task<void>> ranges;
+
+                    for (auto& extent : *extents)
+                    {
+                        for (int64_t offset = extent.first; offset < extent.second; offset += rangeSize)
+                        {
+                            size_t length = static_cast<size_t>((std::min)(static_cast<int64_t>(rangeSize), extent.second - offset));
+
+                            if (received.count(offset) > 0)
+                            {
+                                continue;
+                            }
+
+                            ranges.push_back(scheduler->Post([file, localFile, offset, length, journal, journalId]()
+                            {
+                                return DownloadRange(file, localFile, offset, length).then([journal, journalId, offset]()
+                                {
+                                    if (journal)
+                                    {
+                                        journal->RangeDone(journalId, offset);
+                                    }
+                                });
+                            }));
+                        }
+                    }
+
+                    return Util::WhenAll(ranges).then([path, journal, journalId]()
+                    {
+                        if (journal)
+                        {
+                            journal->Complete(journalId);
+                        }
+
+                        ucout << "Downloaded " << path << endl;
+                    });
+                });
+            });
+        }
+
+        // Returns the sorted [start, end) extents of the remote file that hold data, with
+        // adjacent ranges merged.
+        static pplx::task<vector<pair<int64_t, int64_t>>> ValidExtents(cloud_file file, int64_t size)
+        {
+            if (size == 0)
+            {
+                return pplx::task_from_result(vector<pair<int64_t, int64_t>>());
+            }
+
+            return TransferMetrics::Instance().Measure(TransferMetrics::RangeList, 0, [&](operation_context context)
+            {
+                return file.list_ranges_async(0, size, file_access_condition(), TransferProfile::Instance().RequestOptions(), context);
+            }).then([size](vector<file_range> ranges)
+            {
+                return MergeRanges(ranges, size);
+            });
+        }
+
+        // Turns the inclusive ranges of a range list into sorted [start, end) extents.
+        static vector<pair<int64_t, int64_t>> MergeRanges(const vector<file_range>& ranges, int64_t size)
+        {
+            vector<pair<int64_t, int64_t>> extents;
+
+            for (auto& range : ranges)
+            {
+                // The end offset of a file range is inclusive.
+                int64_t start = range.start_offset();
+                int64_t end = (std::min)(range.end_offset() + 1, size);
+
+                if (!extents.empty() && extents.back().second >= start)
+                {
+                    extents.back().second = (std::max)(extents.back().second, end);
+                }
+                else if (start < end)
+                {
+                    extents.push_back(make_pair(start, end));
+                }
+            }
+
+            return extents;
+        }
+
+        // Returns the size of a local file, or -1 when it does not exist.
+        static int64_t LocalSize(const shared_ptr<IFileSystem>& fileSystem, const string_t& path)
+        {
+            try
+            {
+                return fileSystem->GetLocalFileInfo(path).size;
+            }
+            catch (const runtime_error&)
+            {
+                return -1;
+            }
+        }
+
+        static pplx::task<void> DownloadRange(const cloud_file& file, const shared_ptr<ILocalFile>& localFile, int64_t offset, size_t length)
+        {
+            concurrency::streams::container_buffer<vector<uint8_t>> buffer;
+
+            return BandwidthShaper::Instance().Pace(BandwidthShaper::Down, length).then([file, buffer, offset, length]() mutable
+            {
+                return TransferMetrics::Instance().Measure(TransferMetrics::RangeGet, length, [&](operation_context context)
+                {
+                    return file.download_range_to_stream_async(buffer.create_ostream(), offset, length, file_access_condition(), TransferProfile::Instance().RequestOptions(), context);
+                });
+            }).then([buffer, localFile, offset, length]() mutable
+            {
+                vector<uint8_t>& data = buffer.collection();
+
+                if (data.size() != length)
+                {
+                    throw runtime_error("Unexpected range length");
+                }
+
+                localFile->WriteAt(offset, data.data(), data.size());
+            });
+        }
+
+        size_t m_range_size;
+        string_t m_journal_path;
+        string_t m_list_path;
+        shared_ptr<TransferJournal> m_journal;
+    };
+
+    // The state of a local tree after its last sync: the size and last write time of every file
+    // and the set of directories, keyed by path relative to the synced directory with '/'
+    // separators. Entries may be added from several threads at once.
+    class SyncManifest
+    {
+    public:
+        struct Entry
+        {
+            int64_t size;
+            int64_t modified;
+        };
+
+        // Returns false when the manifest is missing, incomplete or was written for another
+        // remote directory.
+        bool Load(const string_t& path, const string_t& remoteUri)
+        {
+            std::ifstream stream(path.c_str());
+            string line;
+
+            if (!getline(stream, line) || line != Header() || !getline(stream, line)
+                || conversions::to_string_t(line) != remoteUri)
+            {
+                return false;
+            }
+
+            while (getline(stream, line))
+            {
+                if (line == Trailer())
+                {
+                    return true;
+                }
+
+                vector<string_t> fields = Util::Split(conversions::to_string_t(line), _XPLATSTR("\t"));
+
+                if (fields.size() == 2 && fields[0] == _XPLATSTR("D"))
+                {
+                    m_directories.insert(fields[1]);
+                }
+                else if (fields.size() == 4 && fields[0] == _XPLATSTR("F"))
+                {
+                    Entry entry;
+                    entry.size = stoll(fields[1]);
+                    entry.modified = stoll(fields[2]);
+                    m_files[fields[3]] = entry;
+                }
+                else
+                {
+                    break;
+                }
+            }
+
+            m_files.clear();
+            m_directories.clear();
+            return false;
+        }
+
+        void Save(const string_t& path, const string_t& remoteUri) const
+        {
+            std::ofstream stream(path.c_str(), ios::out | ios::trunc);
+            lock_guard<mutex> lock(m_mutex);
+
+            stream << Header() << "\n" << conversions::to_utf8string(remoteUri) << "\n";
+
+            for (auto& directory : m_directories)
+            {
+                stream << "D\t" << conversions::to_utf8string(directory) << "\n";
+            }
+
+            for (auto& file : m_files)
+            {
+                stream << "F\t" << file.second.size << "\t" << file.second.modified << "\t" << conversions::to_utf8string(file.first) << "\n";
+            }
+
+            stream << Trailer() << "\n";
+
+            if (!stream.flush())
+            {
+                throw runtime_error("Failed to write the sync manifest");
+            }
+        }
+
+        const Entry* FindFile(const string_t& relativePath) const
+        {
+            lock_guard<mutex> lock(m_mutex);
+            auto it = m_files.find(relativePath);
+            return it != m_files.end() ? &it->second : nullptr;
+        }
+
+        bool HasDirectory(const string_t& relativePath) const
+        {
+            lock_guard<mutex> lock(m_mutex);
+            return m_directories.count(relativePath) > 0;
+        }
+
+        void AddFile(const string_t& relativePath, const LocalFileInfo& info)
+        {
+            Entry entry;
+            entry.size = info.size;
+            entry.modified = info.modified;
+
+            lock_guard<mutex> lock(m_mutex);
+            m_files[relativePath] = entry;
+        }
+
+        void AddDirectory(const string_t& relativePath)
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_directories.insert(relativePath);
+        }
+
+        // For a directory found missing remotely, so the next sync creates it again.
+        void ForgetDirectory(const string_t& relativePath)
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_directories.erase(relativePath);
+        }
+
+    private:
+
+        static string Header()
+        {
+            return "#AzureFileConsole sync manifest 1";
+        }
+
+        static string Trailer()
+        {
+            return "#end";
+        }
+
+        mutable mutex m_mutex;
+        unordered_map<string_t, Entry> m_files;
+        unordered_set<string_t> m_directories;
+    };
+
+    class SyncCommand : public CommandBase
+    {
+    public:
+        SyncCommand(const string_t& command, const vector<string_t>& arguments, AzureFileContext& context, const shared_ptr<IFileSystem>& file_system)
+            : CommandBase(command, arguments, context, file_system), m_delete(false)
+        {
+        }
+
+        void PreExecute()
+        {
+            TakeParallelismLimit();
+
+            TakeOption(_XPLATSTR("-manifest"), m_manifest_path);
+            TakeOption(_XPLATSTR("-journal"), m_journal_path);
+            m_delete = TakeFlag(_XPLATSTR("-delete"));
+
+            if (m_arguments.size() == 0)
+            {
+                throw invalid_argument("Missing arguments");
+            }
+
+            if (!m_context.CurrentShare().is_valid())
+            {
+                throw invalid_argument("Not in a share root directory");
+            }
+
+            if (!m_file_system->IsDirectory(m_arguments[0]))
+            {
+                throw invalid_argument("Not a local directory");
+            }
+        }
+
+        void PostExecute()
+        {
+            InvalidateCache();
+        }
+
+        void Execute()
+        {
+            InvalidateCache();
+
+            string_t path = m_arguments[0];
+            string_t separators = m_file_system->PathSeparators();
+            string_t remoteUri = m_context.CurrentDirectory().uri().primary_uri().to_string();
+
+            if (m_manifest_path.empty())
+            {
+                m_manifest_path = path;
+
+                if (separators.find(path.back()) == string_t::npos)
+                {
+                    m_manifest_path.append(1, separators[0]);
+                }
+
+                m_manifest_path.append(_XPLATSTR(".azurefilesync"));
+            }
+
+            SyncManifest previous;
+            bool haveManifest = previous.Load(m_manifest_path, remoteUri);
+
+            // Without a manifest the remote listing is the only record of what is already there.
+            // With one, the listing is needed only to find the remote extras to delete.
+            unordered_map<string_t, int64_t> remoteFiles;
+            unordered_set<string_t> remoteDirectories;
+
+            if (!haveManifest || m_delete)
+            {
+                mutex listingMutex;
+
+                RemoteWalker::Walk(m_scheduler, m_context.CurrentDirectory(),
+                    [&](const string_t& relativePath, const list_file_and_directory_item& item)
+                    {
+                        lock_guard<mutex> lock(listingMutex);
+
+                        if (item.is_directory())
+                        {
+                            remoteDirectories.insert(relativePath);
+                        }
+                        else
+                        {
+                            remoteFiles[relativePath] = static_cast<int64_t>(item.as_file().properties().length());
+                        }
+
+                        return true;
+                    }).get();
+            }
+
+            shared_ptr<SyncManifest> current = make_shared<SyncManifest>();
+            unordered_set<string_t> localFiles;
+            unordered_set<string_t> localDirectories;
+            shared_ptr<atomic<size_t>> uploaded = make_shared<atomic<size_t>>(0);
+            size_t unchanged = 0;
+
+            TransferBatch batch(m_scheduler);
+            shared_ptr<TransferJournal> journal = m_journal_path.empty() ? nullptr : TransferJournal::Open(m_journal_path);
+            FileUploader uploader(m_scheduler, m_file_system, (std::min)(TransferProfile::Instance().RangeSize(), static_cast<size_t>(FileUploader::MaxRangeSize)), false, journal);
+            shared_ptr<PathTree> tree = make_shared<PathTree>(path);
+            RemoteDirectoryCreator directories(m_context.CurrentDirectory(), m_scheduler, tree);
+
+            m_file_system->ProcessTree(
+                *tree,
+                [&](PathTree::Id d)
+                {
+                    if (d == PathTree::Root)
+                    {
+                        return;
+                    }
+
+                    string_t key = tree->RelativePath(d, _XPLATSTR('/'));
+                    string_t parentKey = tree->RelativePath(tree->Parent(d), _XPLATSTR('/'));
+                    localDirectories.insert(key);
+
+                    // A directory enters the manifest only once it is known to exist remotely. One
+                    // the manifest wrongly lists is dropped as soon as something under it fails
+                    // for want of a parent.
+                    if (haveManifest ? previous.HasDirectory(key) : remoteDirectories.count(key) > 0)
+                    {
+                        current->AddDirectory(key);
+                        directories.AddExisting(d);
+                    }
+                    else
+                    {
+                        batch.Track(directories.Create(d).then([current, key, parentKey](pplx::task<void> created)
+                        {
+                            try
+                            {
+                                created.get();
+                            }
+                            catch (...)
+                            {
+                                if (IsParentMissing(current_exception()))
+                                {
+                                    current->ForgetDirectory(parentKey);
+                                }
+
+                                throw;
+                            }
+
+                            current->AddDirectory(key);
+                        }));
+                    }
+                },
+                [&](PathTree::Id id)
+                {
+                    if (IsCanceled())
+                    {
+                        return;
+                    }
+
+                    string_t f = tree->Path(id, separators.front());
+
+                    if (f == m_manifest_path || f == m_journal_path)
+                    {
+                        return;
+                    }
+
+                    string_t key = tree->RelativePath(id, _XPLATSTR('/'));
+                    LocalFileInfo info = m_file_system->GetLocalFileInfo(f);
+                    localFiles.insert(key);
+
+                    if (IsUnchanged(key, info, haveManifest, previous, remoteFiles))
+                    {
+                        current->AddFile(key, info);
+                        unchanged++;
+                        return;
+                    }
+
+                    cloud_file file = directories.File(id);
+
+                    // Finished by an earlier sync that was interrupted before saving its manifest.
+                    if (uploader.IsUploaded(file, f))
+                    {
+                        current->AddFile(key, info);
+                        unchanged++;
+                        return;
+                    }
+
+                    string_t parentKey = tree->RelativePath(tree->Parent(id), _XPLATSTR('/'));
+
+                    batch.Track(uploader.Upload(file, f, directories.Create(tree->Parent(id))).then([current, uploaded, key, parentKey, info, f](pplx::task<void> sent)
+                    {
+                        try
+                        {
+                            sent.get();
+                        }
+                        catch (...)
+                        {
+                            if (IsParentMissing(current_exception()))
+                            {
+                                current->ForgetDirectory(parentKey);
+                            }
+
+                            throw;
+                        }
+
+                        current->AddFile(key, info);
+                        (*uploaded)++;
+                        ucout << "Uploaded " << f << endl;
+                    }));
+                });
+
+            // Files that failed to upload are left out of the manifest, so the next sync retries them.
+            try
+            {
+                batch.Wait();
+            }
+            catch (...)
+            {
+                current->Save(m_manifest_path, remoteUri);
+                throw;
+            }
+
+            current->Save(m_manifest_path, remoteUri);
+
+            // A canceled walk saw only part of the local tree, so nothing may be deleted after it.
+            if (IsCanceled())
+            {
+                throw runtime_error("Canceled");
+            }
+
+            size_t deleted = 0;
+
+            if (m_delete)
+            {
+                deleted = DeleteExtras(remoteFiles, remoteDirectories, localFiles, localDirectories);
+            }
+
+            ucout << *uploaded << " uploaded, " << unchanged << " unchanged, " << deleted << " deleted" << endl;
+        }
+
+    private:
+
+        // The service answers 404 ParentNotFound when the directory an item is created in is gone.
+        static bool IsParentMissing(const exception_ptr& error)
+        {
+            try
+            {
+                rethrow_exception(error);
+            }
+            catch (const storage_exception& e)
+            {
+                return e.result().is_response_available() && e.result().http_status_code() == 404;
+            }
+            catch (...)
+            {
+                return false;
+            }
+        }
+
+        static bool IsUnchanged(
+            const string_t& key,
+            const LocalFileInfo& info,
+            bool haveManifest,
+            const SyncManifest& previous,
+            const unordered_map<string_t, int64_t>& remoteFiles)
+        {
+            if (haveManifest)
+            {
+                const SyncManifest::Entry* entry = previous.FindFile(key);
+                return entry != nullptr && entry->size == info.size && entry->modified == info.modified;
+            }
+
+            // The remote listing carries no local write time, so only the size can be compared.
+            auto it = remoteFiles.find(key);
+            return it != remoteFiles.end() && it->second == info.size;
+        }
+
+        // Deletes the remote files and directories that no longer exist locally. Files go first,
+        // then directories from the deepest level up, one level at a time.
+        size_t DeleteExtras(
+            const unordered_map<string_t, int64_t>& remoteFiles,
+            const unordered_set<string_t>& remoteDirectories,
+            const unordered_set<string_t>& localFiles,
+            const unordered_set<string_t>& localDirectories)
+        {
+            size_t deleted = 0;
+            TransferBatch fileBatch(m_scheduler);
+
+            for (auto& remoteFile : remoteFiles)
+            {
+                if (localFiles.count(remoteFile.first) == 0)
+                {
+                    vector<string_t> parts = Util::Split(remoteFile.first, _XPLATSTR("/"));
+                    cloud_file file = Resolve(parts, parts.size() - 1).get_file_reference(parts.back());
+                    string_t name = remoteFile.first;
+
+                    fileBatch.Submit([file, name]() mutable
+                    {
+                        return TransferMetrics::Instance().Measure(TransferMetrics::FileDelete, 0, [&file](operation_context context)
+                        {
+                            return Util::Tolerate(file.delete_file_async(file_access_condition(), TransferProfile::Instance().RequestOptions(), context), 404);
+                        }).then([name](bool)
+                        {
+                            ucout << "Deleted " << name << endl;
+                        });
+                    });
+
+                    deleted++;
+                }
+            }
+
+            fileBatch.Wait();
+
+            map<size_t, vector<string_t>, greater<size_t>> levels;
+
+            for (auto& remoteDirectory : remoteDirectories)
+            {
+                if (localDirectories.count(remoteDirectory) == 0)
+                {
+                    levels[Util::Split(remoteDirectory, _XPLATSTR("/")).size()].push_back(remoteDirectory);
+                }
+            }
+
+            for (auto& level : levels)
+            {
+                TransferBatch directoryBatch(m_scheduler);
+
+                for (auto& name : level.second)
+                {
+                    vector<string_t> parts = Util::Split(name, _XPLATSTR("/"));
+                    cloud_file_directory directory = Resolve(parts, parts.size());
+
+                    directoryBatch.Submit([directory, name]() mutable
+                    {
+                        return TransferMetrics::Instance().Measure(TransferMetrics::DirectoryDelete, 0, [&directory](operation_context context)
+                        {
+                            return Util::Tolerate(directory.delete_directory_async(file_access_condition(), TransferProfile::Instance().RequestOptions(), context), 404);
+                        }).then([name](bool)
+                        {
+                            ucout << "Deleted " << name << endl;
+                        });
+                    });
+
+                    deleted++;
+                }
+
+                directoryBatch.Wait();
+            }
+
+            return deleted;
+        }
+
+        cloud_file_directory Resolve(const vector<string_t>& parts, size_t count) const
+        {
+            cloud_file_directory directory = m_context.CurrentDirectory();
+
+            for (size_t i = 0; i < count; i++)
+            {
+                directory = directory.get_subdirectory_reference(parts[i]);
+            }
+
+            return directory;
+        }
+
+        bool m_delete;
+        string_t m_manifest_path;
+        string_t m_journal_path;
+    };
+
+    // du [path] [-d depth] [-p n] [-fresh]: prints the bytes and files under each directory of a
+    // remote tree, deepest first and as soon as each subtree is added up, listing up to -p
+    // directories at a time. With -d only directories up to that depth below path are printed;
+    // the total comes last. Totals are kept in the session
+    // cache, so du again anywhere under the same path is answered without listing anything;
+    // -fresh ignores the cache.
+    class DuCommand : public CommandBase
+    {
+    public:
+        DuCommand(const string_t& command, const vector<string_t>& arguments, AzureFileContext& context, const shared_ptr<IFileSystem>& file_system)
+            : CommandBase(command, arguments, context, file_system), m_max_depth(numeric_limits<size_t>::max()), m_fresh(false)
+        {
+        }
+
+        void PreExecute()
+        {
+            string_t depth;
+            m_fresh = TakeFlag(_XPLATSTR("-fresh"));
+
+            if (TakeOption(_XPLATSTR("-d"), depth))
+            {
+                m_max_depth = static_cast<size_t>(Util::ParseNumber(depth, (numeric_limits<size_t>::max)()));
+            }
+
+            TakeParallelismLimit();
+        }
+
+        void Execute()
+        {
+            cloud_file_directory root = ResolveDirectory(m_arguments.empty() ? string_t(_XPLATSTR(".")) : m_arguments[0]);
+            vector<pair<string_t, RemoteCache::Usage>> cached;
+
+            if (!m_fresh && FromCache(root, string_t(), 0, cached))
+            {
+                for (auto& entry : cached)
+                {
+                    Print(entry.first, entry.second);
+                }
+
+                PrintTotal(cached.back().second);
+                return;
+            }
+
+            mutex outputMutex;
+            shared_ptr<RemoteCache> cache = m_context.Cache();
+
+            RemoteCache::Usage total = RemoteSizer::Sum(m_scheduler, root, [&](const string_t& path, const cloud_file_directory& directory, const RemoteCache::Usage& usage)
+            {
+                cache->AddUsage(directory.uri().primary_uri().to_string(), usage);
+
+                if (Depth(path) <= m_max_depth)
+                {
+                    lock_guard<mutex> lock(outputMutex);
+                    Print(path, usage);
+                    ucout.flush();
+                }
+            }).get();
+
+            PrintTotal(total);
+        }
+
+    private:
+
+        static size_t Depth(const string_t& path)
+        {
+            return path.empty() ? 0 : static_cast<size_t>(std::count(path.begin(), path.end(), _XPLATSTR('/'))) + 1;
+        }
+
+        // Collects the cached usage of the tree in the order a walk prints it, subdirectories
+        // before their parent. Returns false if any directory up to the depth is missing.
+        bool FromCache(const cloud_file_directory& directory, const string_t& path, size_t depth, vector<pair<string_t, RemoteCache::Usage>>& entries)
+        {
+            shared_ptr<const RemoteCache::Usage> usage = m_context.Cache()->FindUsage(directory.uri().primary_uri().to_string());
+
+            if (!usage)
+            {
+                return false;
+            }
+
+            if (depth < m_max_depth)
+            {
+                for (auto& name : usage->subdirectories)
+                {
+                    string_t childPath = path.empty() ? name : path + _XPLATSTR("/") + name;
+
+                    if (!FromCache(directory.get_subdirectory_reference(name), childPath, depth + 1, entries))
+                    {
+                        return false;
+                    }
+                }
+            }
+
+            entries.push_back(make_pair(path, *usage));
+            return true;
+        }
+
+        static void Print(const string_t& path, const RemoteCache::Usage& usage)
+        {
+            ucout << setw(16) << usage.bytes << setw(10) << usage.files << _XPLATSTR("  ") << (path.empty() ? string_t(_XPLATSTR(".")) : path) << _XPLATSTR("\n");
+        }
+
+        static void PrintTotal(const RemoteCache::Usage& usage)
+        {
+            ucout << usage.bytes << _XPLATSTR(" bytes in ") << usage.files << _XPLATSTR(" files, ") << usage.directories << _XPLATSTR(" directories") << endl;
+        }
+
+        size_t m_max_depth;
+        bool m_fresh;
+    };
+
+    // copy <src> <dst> [-r] [-p n]: copies a file, or with -r the contents of a directory, with
+    // the service's server-side copy. Paths are relative to the current directory, start with
+    // '/' to name a share, or are full URLs; a source in another account needs a SAS in its URL.
+    // A file copied onto an existing directory keeps its name. -p caps the pending copies.
+    class CopyCommand : public CommandBase
+    {
+    public:
+        CopyCommand(const string_t& command, const vector<string_t>& arguments, AzureFileContext& context, const shared_ptr<IFileSystem>& file_system)
+            : CommandBase(command, arguments, context, file_system), m_recursive(false), m_max_copies(RemoteCopier::DefaultMaxCopies)
+        {
+        }
+
+        void PreExecute()
+        {
+            m_recursive = TakeFlag(_XPLATSTR("-r"));
+
+            TakeParallelism(m_max_copies);
+
+            if (m_arguments.size() < 2)
+            {
+                throw invalid_argument("Missing arguments");
+            }
+        }
+
+        void Execute()
+        {
+            RemoteCopier copier(m_scheduler, m_max_copies);
+            cloud_file_directory destinationRoot;
+
+            if (m_recursive)
+            {
+                cloud_file_directory source = ResolveDirectory(m_arguments[0]);
+                destinationRoot = ResolveDirectory(m_arguments[1]);
+                CopyTree(copier, source, destinationRoot);
+            }
+            else
+            {
+                cloud_file source = ResolveFile(m_arguments[0]);
+
+                Measure(TransferMetrics::FileProperties, [&source](operation_context context)
+                {
+                    return source.download_attributes_async(file_access_condition(), TransferProfile::Instance().RequestOptions(), context);
+                });
+
+                cloud_file destination = ResolveFile(m_arguments[1]);
+                cloud_file_directory asDirectory = ResolveDirectory(m_arguments[1]);
+
+                if (IsDirectory(asDirectory))
+                {
+                    destination = asDirectory.get_file_reference(source.name());
+                }
+
+                destinationRoot = destination.get_parent_directory_reference();
+                copier.Copy(source, destination, static_cast<int64_t>(source.properties().length()), pplx::task_from_result());
+            }
+
+            m_context.Cache()->Invalidate(destinationRoot.uri().primary_uri().to_string());
+
+            while (!copier.WaitFor(chrono::seconds(2)))
+            {
+                PrintProgress(copier.Current());
+            }
+
+            PrintProgress(copier.Current());
+            copier.Wait();
+        }
+
+    private:
+
+        struct FileEntry
+        {
+            string_t path;
+            int64_t size;
+        };
+
+        // Starts copies while the tree is still being walked. The walk hands every file it lists
+        // to this thread, which starts its copy at once; Copy blocks here, never in the walk's
+        // continuations on the thread pool, while the copier is at its cap or the scheduler's
+        // queue is full.
+        void CopyTree(RemoteCopier& copier, const cloud_file_directory& source, cloud_file_directory destination)
+        {
+            mutex filesMutex;
+            condition_variable filesChanged;
+            deque<FileEntry> files;
+            bool walked = false;
+            RemoteDirectoryCreator directories(destination, m_scheduler);
+            TransferBatch batch(m_scheduler);
+
+            Measure(TransferMetrics::DirectoryCreate, [&destination](operation_context context)
+            {
+                return Util::Tolerate(destination.create_async(TransferProfile::Instance().RequestOptions(), context), 409);
+            });
+
+            pplx::task<void> walk = RemoteWalker::Walk(m_scheduler, source, [&](const string_t& path, const list_file_and_directory_item& item)
+            {
+                if (item.is_directory())
+                {
+                    batch.Track(directories.Create(Util::Split(path, _XPLATSTR("/"))));
+                }
+                else
+                {
+                    FileEntry entry;
+                    entry.path = path;
+                    entry.size = static_cast<int64_t>(item.as_file().properties().length());
+
+                    lock_guard<mutex> lock(filesMutex);
+                    files.push_back(entry);
+                    filesChanged.notify_one();
+                }
+
+                return true;
+            });
+
+            pplx::task<void> finished = walk.then([&](pplx::task<void>)
+            {
+                lock_guard<mutex> lock(filesMutex);
+                walked = true;
+                filesChanged.notify_one();
+            });
+
+            // The walk refers to this frame until it finishes, even if starting a copy throws.
+            try
+            {
+                while (true)
+                {
+                    FileEntry file;
+
+                    {
+                        unique_lock<mutex> lock(filesMutex);
+                        filesChanged.wait(lock, [&]() { return !files.empty() || walked; });
+
+                        if (files.empty())
+                        {
+                            break;
+                        }
+
+                        file = files.front();
+                        files.pop_front();
+                    }
+
+                    vector<string_t> parts = Util::Split(file.path, _XPLATSTR("/"));
+                    cloud_file target = Resolve(destination, parts, parts.size() - 1).get_file_reference(parts.back());
+                    cloud_file origin = Resolve(source, parts, parts.size() - 1).get_file_reference(parts.back());
+
+                    parts.pop_back();
+                    copier.Copy(origin, target, file.size, directories.Create(parts));
+                }
+            }
+            catch (...)
+            {
+                finished.wait();
+                throw;
+            }
+
+            finished.wait();
+            walk.get();
+            batch.Wait();
+        }
+
+        template<typename Call>
+        static void Measure(TransferMetrics::Operation operation, Call call)
+        {
+            TransferMetrics::Instance().Measure(operation, 0, call).wait();
+        }
+
+        static bool IsDirectory(cloud_file_directory directory)
+        {
+            return TransferMetrics::Instance().Measure(TransferMetrics::DirectoryExists, 0, [&directory](operation_context context)
+            {
+                return directory.exists_async(TransferProfile::Instance().RequestOptions(), context);
+            }).get();
+        }
+
+        static cloud_file_directory Resolve(cloud_file_directory directory, const vector<string_t>& parts, size_t depth)
+        {
+            for (size_t i = 0; i < depth; i++)
+            {
+                directory = directory.get_subdirectory_reference(parts[i]);
+            }
+
+            return directory;
+        }
+
+        static void PrintProgress(const RemoteCopier::Progress& progress)
+        {
+            ucout << progress.succeeded + progress.failed << _XPLATSTR(" of ") << progress.started << _XPLATSTR(" files, ")
+                << progress.bytesCopied / (1024 * 1024) << _XPLATSTR(" of ") << progress.totalBytes / (1024 * 1024) << _XPLATSTR(" MB copied");
+
+            if (progress.failed > 0)
+            {
+                ucout << _XPLATSTR(", ") << progress.failed << _XPLATSTR(" failed");
+            }
+
+            ucout << endl;
+        }
+
+        bool m_recursive;
+        size_t m_max_copies;
+    };
+
+    // find [path] [-name glob | -iname glob] [-size [+|-]N] [-newer time] [-out file] [-p n]:
+    // walks a remote tree listing up to -p directories at a time and prints every file that
+    // matches as soon as it is found. Subtrees that a pattern with '/' cannot match are not
+    // listed. -size compares the length, larger with '+' and smaller with '-'. -newer takes
+    // an ISO 8601 time and costs one request per file that passes the other tests. -out also
+    // writes the matches to a list that delete -from and download -from accept.
+    class FindCommand : public CommandBase
+    {
+    public:
+        FindCommand(const string_t& command, const vector<string_t>& arguments, AzureFileContext& context, const shared_ptr<IFileSystem>& file_system)
+            : CommandBase(command, arguments, context, file_system), m_pattern(_XPLATSTR("*")), m_ignore_case(false), m_size_comparison(0), m_size(-1)
+        {
+        }
+
+        void PreExecute()
+        {
+            string_t pattern;
+            string_t size;
+            string_t newer;
+            if (TakeOption(_XPLATSTR("-iname"), pattern))
+            {
+                m_pattern = pattern;
+                m_ignore_case = true;
+            }
+
+            if (TakeOption(_XPLATSTR("-name"), pattern))
+            {
+                m_pattern = pattern;
+                m_ignore_case = false;
+            }
+
+            if (TakeOption(_XPLATSTR("-size"), size))
+            {
+                if (size[0] == _XPLATSTR('+') || size[0] == _XPLATSTR('-'))
+                {
+                    m_size_comparison = size[0] == _XPLATSTR('+') ? 1 : -1;
+                    size = size.substr(1);
+                }
+
+                m_size = static_cast<int64_t>(Util::ParseSize(size));
+            }
+
+            if (TakeOption(_XPLATSTR("-newer"), newer))
+            {
+                m_newer = utility::datetime::from_string(newer, utility::datetime::ISO_8601);
+
+                if (!m_newer.is_initialized())
+                {
+                    throw invalid_argument("Invalid time, expected ISO 8601 such as 2024-01-31T12:00:00Z");
+                }
+            }
+
+            TakeParallelismLimit();
+
+            TakeOption(_XPLATSTR("-out"), m_out_path);
+        }
+
+        void Execute()
+        {
+            string_t rootArgument = m_arguments.empty() ? string_t(_XPLATSTR(".")) : m_arguments[0];
+            cloud_file_directory root = ResolveDirectory(rootArgument);
+            GlobMatcher matcher(m_pattern, m_ignore_case);
+            TransferBatch batch(m_scheduler);
+            shared_ptr<Output> output = make_shared<Output>();
+            string_t prefix = m_arguments.empty() ? string_t() : Util::IsUrl(rootArgument) ? Util::UrlPath(rootArgument) : rootArgument;
+
+            if (!prefix.empty() && prefix.back() != _XPLATSTR('/'))
+            {
+                prefix.append(1, _XPLATSTR('/'));
+            }
+
+            if (!m_out_path.empty())
+            {
+                output->list.open(m_out_path.c_str(), ios::out | ios::trunc);
+                output->list << RemoteFileList::Header() << "\n" << conversions::to_utf8string(Util::IsUrl(rootArgument) ? Util::UrlPath(rootArgument) : SharePath(root)) << "\n";
+
+                if (!output->list)
+                {
+                    throw runtime_error("Cannot write the file list");
+                }
+            }
+
+            RemoteWalker::Walk(m_scheduler, root, [&](const string_t& path, const list_file_and_directory_item& item)
+            {
+                if (item.is_directory())
+                {
+                    return matcher.CanMatchBelow(path);
+                }
+
+                if (!matcher.Matches(path) || !SizeMatches(static_cast<int64_t>(item.as_file().properties().length())))
+                {
+                    return false;
+                }
+
+                if (!m_newer.is_initialized())
+                {
+                    Report(output, prefix, path);
+                    return false;
+                }
+
+                cloud_file file = item.as_file();
+                utility::datetime newer = m_newer;
+
+                batch.Post([file, newer, output, prefix, path]() mutable
+                {
+                    return TransferMetrics::Instance().Measure(TransferMetrics::FileProperties, 0, [&file](operation_context context)
+                    {
+                        return file.download_attributes_async(file_access_condition(), TransferProfile::Instance().RequestOptions(), context);
+                    }).then([file, newer, output, prefix, path]()
+                    {
+                        if (file.properties().last_modified() > newer)
+                        {
+                            Report(output, prefix, path);
+                        }
+                    });
+                });
+
+                return false;
+            }).get();
+
+            batch.Wait();
+            ucout << output->count << _XPLATSTR(" files found") << endl;
+        }
+
+    private:
+
+        struct Output
+        {
+            Output()
+                : count(0)
+            {
+            }
+
+            mutex outputMutex;
+            std::ofstream list;
+            size_t count;
+        };
+
+        static void Report(const shared_ptr<Output>& output, const string_t& prefix, const string_t& path)
+        {
+            lock_guard<mutex> lock(output->outputMutex);
+            output->count++;
+            ucout << prefix << path << _XPLATSTR("\n");
+            ucout.flush();
+
+            if (output->list.is_open())
+            {
+                output->list << conversions::to_utf8string(path) << "\n";
+            }
+        }
+
+        bool SizeMatches(int64_t length) const
+        {
+            if (m_size < 0)
+            {
+                return true;
+            }
+
+            if (m_size_comparison > 0)
+            {
+                return length > m_size;
+            }
+
+            if (m_size_comparison < 0)
+            {
+                return length < m_size;
+            }
+
+            return length == m_size;
+        }
+
+        string_t m_pattern;
+        bool m_ignore_case;
+        int m_size_comparison;
+
+        // -1 when -size was not given.
+        int64_t m_size;
+        utility::datetime m_newer;
+        string_t m_out_path;
+    };
+
+    class DeleteCommand : public CommandBase
+    {
+    public:
+        DeleteCommand(const string_t& command, const vector<string_t>& arguments, AzureFileContext& context, const shared_ptr<IFileSystem>& file_system)
+            : CommandBase(command, arguments, context, file_system)
+        {
+        }
+
+        void PreExecute()
+        {
+            TakeOption(_XPLATSTR("-from"), m_list_path);
+
+            if (!m_list_path.empty())
+            {
+                return;
+            }
+
+            if (m_arguments.size() == 0)
+            {
+                throw invalid_argument("Missing arguments");
+            }
+
+            if (!m_context.CurrentShare().is_valid())
+            {
+                throw invalid_argument("Not in a share root directory");
+            }
+        }
+
+        void PostExecute()
+        {
+            InvalidateCache();
+        }
+
+        void Execute()
+        {
+            if (!m_list_path.empty())
+            {
+                DeleteList();
+                return;
+            }
+
+            InvalidateCache();
+
+            string_t itemName = m_arguments[0];
+            cloud_file file = m_context.CurrentDirectory().get_file_reference(itemName);
+
+            bool deleted = TransferMetrics::Instance().Measure(TransferMetrics::FileDelete, 0, [&file](operation_context context)
+            {
+                return Util::Tolerate(file.delete_file_async(file_access_condition(), TransferProfile::Instance().RequestOptions(), context), 404);
+            }).get();
+
+            if (deleted)
+            {
+                return;
+            }
+
+            cloud_file_directory directory = m_context.CurrentDirectory().get_subdirectory_reference(itemName);
+            RemoteTreeDeleter::Result result = RemoteTreeDeleter::Delete(m_scheduler, directory).get();
+            ucout << "Deleted " << result.files << " files and " << result.directories << " directories" << endl;
+        }
+
+    private:
+
+        // Deletes every file of a list written by find -out, all through the scheduler.
+        void DeleteList()
+        {
+            RemoteFileList list = RemoteFileList::Load(m_list_path);
+            cloud_file_directory root = ResolveDirectory(list.root);
+            TransferBatch batch(m_scheduler);
+            shared_ptr<atomic<size_t>> deleted = make_shared<atomic<size_t>>(0);
+
+            m_context.Cache()->Invalidate(root.uri().primary_uri().to_string());
+
+            for (auto& path : list.paths)
+            {
+                cloud_file file = ResolveRelative(root, path);
+
+                batch.Submit([file, deleted]() mutable
+                {
+                    return TransferMetrics::Instance().Measure(TransferMetrics::FileDelete, 0, [&file](operation_context context)
+                    {
+                        return Util::Tolerate(file.delete_file_async(file_access_condition(), TransferProfile::Instance().RequestOptions(), context), 404);
+                    }).then([deleted](bool existed)
+                    {
+                        if (existed)
+                        {
+                            (*deleted)++;
+                        }
+                    });
+                });
+            }
+
+            try
+            {
+                batch.Wait();
+            }
+            catch (...)
+            {
+                m_context.Cache()->Invalidate(root.uri().primary_uri().to_string());
+                throw;
+            }
+
+            m_context.Cache()->Invalidate(root.uri().primary_uri().to_string());
+            ucout << "Deleted " << *deleted << " of " << list.paths.size() << " files" << endl;
+        }
+
+        string_t m_list_path;
+    };
+
+    // Shows the tuning profile, or changes one of its settings for the rest of the session.
+    class SetCommand : public CommandBase
+    {
+    public:
+        SetCommand(const string_t& command, const vector<string_t>& arguments, AzureFileContext& context, const shared_ptr<IFileSystem>& file_system)
+            : CommandBase(command, arguments, context, file_system)
+        {
+        }
+
+        void PreExecute()
+        {
+            if (m_arguments.size() == 1 || m_arguments.size() > 2)
+            {
+                throw invalid_argument("Usage: set [name value]");
+            }
+        }
+
+        void Execute()
+        {
+            TransferProfile& profile = TransferProfile::Instance();
+
+            if (m_arguments.empty())
+            {
+                for (auto& setting : profile.Values())
+                {
+                    ucout << setting.first << _XPLATSTR(" = ") << setting.second << endl;
+                }
+
+                return;
+            }
+
+            profile.Set(m_arguments[0], m_arguments[1]);
+
+            if (m_arguments[0] == _XPLATSTR("connections"))
+            {
+                m_context.Scheduler()->MaxInFlight(profile.Connections());
+            }
+            else if (m_arguments[0] == _XPLATSTR("bandwidth") || m_arguments[0] == _XPLATSTR("upload-bandwidth")
+                || m_arguments[0] == _XPLATSTR("download-bandwidth") || m_arguments[0] == _XPLATSTR("burst"))
+            {
+                BandwidthShaper::Instance().Reload();
+            }
+        }
+    };
+
+    // Prints the request metrics gathered since start or since the last stats -reset.
+    class StatsCommand : public CommandBase
+    {
+    public:
+        StatsCommand(const string_t& command, const vector<string_t>& arguments, AzureFileContext& context, const shared_ptr<IFileSystem>& file_system)
+            : CommandBase(command, arguments, context, file_system), m_json(false), m_reset(false)
+        {
+        }
+
+        void PreExecute()
+        {
+            m_json = TakeFlag(_XPLATSTR("-json"));
+            m_reset = TakeFlag(_XPLATSTR("-reset"));
+        }
+
+        void Execute()
+        {
+            TransferMetrics& metrics = TransferMetrics::Instance();
+
+            if (m_json)
+            {
+                ucout << metrics.ToJson() << endl;
+            }
+            else
+            {
+                TransferMetrics::Snapshot snapshot = metrics.Take();
+                double seconds = (std::max)(snapshot.seconds, 0.001);
+
+                ucout << _XPLATSTR("operation        requests  in flight  errors  retries        MB    req/s  mean ms   p50 ms   p99 ms") << endl;
+
+                for (size_t op = 0; op < TransferMetrics::OperationCount; op++)
+                {
+                    const TransferMetrics::Summary& summary = snapshot.operations[op];
+
+                    if (summary.started > 0)
+                    {
+                        Print(conversions::to_string_t(TransferMetrics::Name(static_cast<TransferMetrics::Operation>(op))), summary, seconds);
+                    }
+                }
+
+                Print(_XPLATSTR("total"), snapshot.Total(), seconds);
+                ucout << _XPLATSTR("over ") << snapshot.seconds << _XPLATSTR(" s") << endl;
+            }
+
+            if (m_reset)
+            {
+                metrics.Reset();
+            }
+        }
+
+    private:
+
+        static void Print(const string_t& name, const TransferMetrics::Summary& summary, double seconds)
+        {
+            ucout << std::left << std::setw(15) << name << std::right << std::fixed << std::setprecision(1)
+                << std::setw(10) << summary.completed
+                << std::setw(11) << summary.started - summary.completed
+                << std::setw(8) << summary.failed
+                << std::setw(9) << summary.retries
+                << std::setw(10) << summary.bytes / (1024.0 * 1024.0)
+                << std::setw(9) << summary.completed / seconds
+                << std::setw(9) << summary.MeanMilliseconds()
+                << std::setw(9) << summary.Percentile(0.50)
+                << std::setw(9) << summary.Percentile(0.99) << endl;
+
+            ucout.unsetf(std::ios::fixed);
+            ucout << std::setprecision(6);
+        }
+
+        bool m_json;
+        bool m_reset;
+    };
+
+    // Commands started with a trailing '&' at the prompt. Each job runs on its own thread with a
+    // copy of the context, as script commands do, so its transfers share the session's
+    // scheduler and cache. Canceling a job cancels the token its context carries.
+    class BackgroundJobs
+    {
+    public:
+        enum class State
+        {
+            Running,
+            Done,
+            Failed,
+            Canceled
+        };
+
+        struct Summary
+        {
+            size_t id;
+            State state;
+            string_t command;
+            string_t message;
+            double seconds;
+        };
+
+        static BackgroundJobs& Instance()
+        {
+            static BackgroundJobs instance;
+            return instance;
+        }
+
+        ~BackgroundJobs()
+        {
+            Shutdown();
+        }
+
+        // Creates the command and checks its arguments on the calling thread, so a usage error
+        // is reported at once, then runs it in the background and returns the job id.
+        size_t Start(const string_t& command, const AzureFileContext& context, const function<shared_ptr<ICommand>(AzureFileContext&)>& create)
+        {
+            shared_ptr<Job> job = make_shared<Job>(context);
+            job->command = command;
+            job->context.Cancellation(job->source.get_token());
+
+            shared_ptr<ICommand> instance = create(job->context);
+            instance->PreExecute();
+
+            {
+                lock_guard<mutex> lock(m_mutex);
+                job->id = ++m_last_id;
+                m_jobs[job->id] = job;
+            }
+
+            job->worker = thread([this, job, instance]()
+            {
+                State state = State::Done;
+                string_t message;
+
+                try
+                {
+                    instance->Execute();
+                    instance->PostExecute();
+                }
+                catch (const std::exception& e)
+                {
+                    state = State::Failed;
+                    message = conversions::to_string_t(e.what());
+                }
+
+                if (job->source.get_token().is_canceled())
+                {
+                    state = State::Canceled;
+                }
+
+                {
+                    lock_guard<mutex> lock(m_mutex);
+                    job->state = state;
+                    job->message = message;
+                    job->finished = chrono::steady_clock::now();
+                    m_finished.notify_all();
+                }
+
+                ucout << _XPLATSTR("[") << job->id << _XPLATSTR("] ") << Name(state) << _XPLATSTR(" ") << job->command << endl;
+            });
+
+            return job->id;
+        }
+
+        // Lists every job, then forgets the ones that have finished, as a shell does.
+        vector<Summary> List()
+        {
+            vector<Summary> summaries;
+            vector<shared_ptr<Job>> finished;
+
+            {
+                lock_guard<mutex> lock(m_mutex);
+
+                for (auto it = m_jobs.begin(); it != m_jobs.end();)
+                {
+                    summaries.push_back(Summarize(*it->second));
+
+                    if (it->second->state != State::Running)
+                    {
+                        finished.push_back(it->second);
+                        it = m_jobs.erase(it);
+                    }
+                    else
+                    {
+                        ++it;
+                    }
+                }
+            }
+
+            for (auto& job : finished)
+            {
+                job->worker.join();
+            }
+
+            return summaries;
+        }
+
+        // Blocks until the job finishes, then forgets it. Whoever removes a job from the table
+        // joins its thread, so a job forgotten meanwhile by another wait, jobs or the shutdown
+        // is not joined twice.
+        Summary Wait(size_t id)
+        {
+            shared_ptr<Job> job;
+            Summary summary;
+            bool owner = false;
+
+            {
+                unique_lock<mutex> lock(m_mutex);
+                job = Find(id);
+                m_finished.wait(lock, [&job]() { return job->state != State::Running; });
+                summary = Summarize(*job);
+                owner = m_jobs.erase(id) > 0;
+            }
+
+            if (owner)
+            {
+                job->worker.join();
+            }
+
+            return summary;
+        }
+
+        // Asks the job to stop. Work it has not started yet is dropped; requests already on the
+        // wire finish first.
+        void Cancel(size_t id)
+        {
+            lock_guard<mutex> lock(m_mutex);
+            Find(id)->source.cancel();
+        }
+
+        // Cancels every job and waits for all of them, before the process exits.
+        void Shutdown()
+        {
+            map<size_t, shared_ptr<Job>> jobs;
+
+            {
+                lock_guard<mutex> lock(m_mutex);
+                jobs.swap(m_jobs);
+            }
+
+            for (auto& entry : jobs)
+            {
+                entry.second->source.cancel();
+            }
+
+            for (auto& entry : jobs)
+            {
+                entry.second->worker.join();
+            }
+        }
+
+        static string_t Name(State state)
+        {
+            switch (state)
+            {
+            case State::Running:
+                return _XPLATSTR("Running");
+            case State::Done:
+                return _XPLATSTR("Done");
+            case State::Failed:
+                return _XPLATSTR("Failed");
+            default:
+                return _XPLATSTR("Canceled");
+            }
+        }
+
+    private:
+
+        struct Job
+        {
+            Job(const AzureFileContext& context)
+                : context(context), id(0), state(State::Running), started(chrono::steady_clock::now())
+            {
+            }
+
+            AzureFileContext context;
+            pplx::cancellation_token_source source;
+            size_t id;
+            string_t command;
+            State state;
+            string_t message;
+            chrono::steady_clock::time_point started;
+            chrono::steady_clock::time_point finished;
+            thread worker;
+        };
+
+        BackgroundJobs()
+            : m_last_id(0)
+        {
+        }
+
+        // Expects the lock to be held.
+        shared_ptr<Job> Find(size_t id) const
+        {
+            auto it = m_jobs.find(id);
+
+            if (it == m_jobs.end())
+            {
+                throw invalid_argument("No such job");
+            }
+
+            return it->second;
+        }
+
+        // Expects the lock to be held.
+        static Summary Summarize(const Job& job)
+        {
+            chrono::steady_clock::time_point end = job.state == State::Running ? chrono::steady_clock::now() : job.finished;
+
+            Summary summary;
+            summary.id = job.id;
+            summary.state = job.state;
+            summary.command = job.command;
+            summary.message = job.message;
+            summary.seconds = chrono::duration<double>(end - job.started).count();
+            return summary;
+        }
+
+        mutex m_mutex;
+        condition_variable m_finished;
+        map<size_t, shared_ptr<Job>> m_jobs;
+        size_t m_last_id;
+    };
+
+    // Lists the background jobs and how long each has run.
+    class JobsCommand : public CommandBase
+    {
+    public:
+        JobsCommand(const string_t& command, const vector<string_t>& arguments, AzureFileContext& context, const shared_ptr<IFileSystem>& file_system)
+            : CommandBase(command, arguments, context, file_system)
+        {
+        }
+
+        void Execute()
+        {
+            for (auto& job : BackgroundJobs::Instance().List())
+            {
+                ucout << _XPLATSTR("[") << job.id << _XPLATSTR("] ") << std::left << std::setw(9) << BackgroundJobs::Name(job.state) << std::right
+                    << std::fixed << std::setprecision(1) << std::setw(9) << job.seconds << _XPLATSTR(" s  ") << job.command << endl;
+
+                if (!job.message.empty())
+                {
+                    ucout << _XPLATSTR("    ") << job.message << endl;
+                }
+            }
+
+            ucout.unsetf(std::ios::fixed);
+            ucout << std::setprecision(6);
+        }
+    };
+
+    // Waits for a background job to finish and reports how it ended.
+    class WaitCommand : public CommandBase
+    {
+    public:
+        WaitCommand(const string_t& command, const vector<string_t>& arguments, AzureFileContext& context, const shared_ptr<IFileSystem>& file_system)
+            : CommandBase(command, arguments, context, file_system), m_id(0)
+        {
+        }
+
+        void PreExecute()
+        {
+            m_id = JobId(m_arguments, "Usage: wait <id>");
+        }
+
+        void Execute()
+        {
+            BackgroundJobs::Summary job = BackgroundJobs::Instance().Wait(m_id);
+
+            if (job.state == BackgroundJobs::State::Failed)
+            {
+                throw runtime_error(conversions::to_utf8string(job.message));
+            }
+
+            ucout << _XPLATSTR("[") << job.id << _XPLATSTR("] ") << BackgroundJobs::Name(job.state) << _XPLATSTR(" after ") << job.seconds << _XPLATSTR(" s") << endl;
+        }
+
+        static size_t JobId(const vector<string_t>& arguments, const char* usage)
+        {
+            if (arguments.size() != 1)
+            {
+                throw invalid_argument(usage);
+            }
+
+            string_t id = arguments[0];
+
+            if (!id.empty() && id[0] == _XPLATSTR('%'))
+            {
+                id = id.substr(1);
+            }
+
+            try
+            {
+                return static_cast<size_t>(Util::ParseNumber(id, (numeric_limits<size_t>::max)()));
+            }
+            catch (const std::exception&)
+            {
+                throw invalid_argument(usage);
+            }
+        }
+
+    private:
+        size_t m_id;
+    };
+
+    // Cancels a background job. Its queued transfers are dropped and its walk stops at the next
+    // entry, so it ends within about one request time.
+    class CancelCommand : public CommandBase
+    {
+    public:
+        CancelCommand(const string_t& command, const vector<string_t>& arguments, AzureFileContext& context, const shared_ptr<IFileSystem>& file_system)
+            : CommandBase(command, arguments, context, file_system), m_id(0)
+        {
+        }
+
+        void PreExecute()
+        {
+            m_id = WaitCommand::JobId(m_arguments, "Usage: cancel <id>");
+        }
+
+        void Execute()
+        {
+            BackgroundJobs::Instance().Cancel(m_id);
+        }
+
+    private:
+        size_t m_id;
+    };
+
+    class CommandFactory
+    {
+    public:
+        static shared_ptr<ICommand> Create(const string_t& command_line, AzureFileContext& context, const shared_ptr<IFileSystem>& file_system)
+        {
+            string_t command;
+            vector<string_t> arguments;
+            istringstream_t iss(command_line);
+
+            if (!iss.eof())
+            {
+                iss >> command;
+            }
+
+            string_t arg;
+
+            while (!iss.eof())
+            {
+                iss >> arg;
+                arguments.push_back(arg);
+            }
+
+            if (command.compare(_XPLATSTR("dir")) == 0)
+            {
+                return shared_ptr<ICommand>(new DirCommand(command, arguments, context, file_system));
+            }
+            else if (command.compare(_XPLATSTR("cd")) == 0)
+            {
+                return shared_ptr<ICommand>(new CdCommand(command, arguments, context, file_system));
+            }
+            else if (command.compare(_XPLATSTR("upload")) == 0)
+            {
+                return shared_ptr<ICommand>(new UploadCommand(command, arguments, context, file_system));
+            }
+            else if (command.compare(_XPLATSTR("download")) == 0)
+            {
+                return shared_ptr<ICommand>(new DownloadCommand(command, arguments, context, file_system));
+            }
+            else if (command.compare(_XPLATSTR("sync")) == 0)
+            {
+                return shared_ptr<ICommand>(new SyncCommand(command, arguments, context, file_system));
+            }
+            else if (command.compare(_XPLATSTR("delete")) == 0)
+            {
+                return shared_ptr<ICommand>(new DeleteCommand(command, arguments, context, file_system));
+            }
+            else if (command.compare(_XPLATSTR("find")) == 0)
+            {
+                return shared_ptr<ICommand>(new FindCommand(command, arguments, context, file_system));
+            }
+            else if (command.compare(_XPLATSTR("du")) == 0)
+            {
+                return shared_ptr<ICommand>(new DuCommand(command, arguments, context, file_system));
+            }
+            else if (command.compare(_XPLATSTR("copy")) == 0)
+            {
+                return shared_ptr<ICommand>(new CopyCommand(command, arguments, context, file_system));
+            }
+            else if (command.compare(_XPLATSTR("set")) == 0)
+            {
+                return shared_ptr<ICommand>(new SetCommand(command, arguments, context, file_system));
+            }
+            else if (command.compare(_XPLATSTR("stats")) == 0)
+            {
+                return shared_ptr<ICommand>(new StatsCommand(command, arguments, context, file_system));
+            }
+            else if (command.compare(_XPLATSTR("jobs")) == 0)
+            {
+                return shared_ptr<ICommand>(new JobsCommand(command, arguments, context, file_system));
+            }
+            else if (command.compare(_XPLATSTR("wait")) == 0)
+            {
+                return shared_ptr<ICommand>(new WaitCommand(command, arguments, context, file_system));
+            }
+            else if (command.compare(_XPLATSTR("cancel")) == 0)
+            {
+                return shared_ptr<ICommand>(new CancelCommand(command, arguments, context, file_system));
+            }
+            else
+            {
+                return shared_ptr<ICommand>(new DefaultCommand(command, arguments, context, file_system));
+            }
+        }
+    };
+
+    // Runs commands from -c or a script file without the prompt. cd runs in line and only moves
+    // the commands after it; it first waits for running commands that work in the directory it
+    // enters, which may still be creating it, and a failed cd stops the script. Every other
+    // command runs on its own thread with a copy of the context, which shares the client,
+    // scheduler and cache, so it overlaps with the commands before it. A command that works in
+    // the same directory tree as a running command waits for that command to finish first.
+    class ScriptRunner
+    {
+    public:
+        static const size_t DefaultMaxConcurrentCommands = 8;
+
+        ScriptRunner(AzureFileContext& context, const shared_ptr<IFileSystem>& file_system, size_t max_concurrent_commands = DefaultMaxConcurrentCommands)
+            : m_context(context), m_file_system(file_system), m_max_concurrent_commands((std::max)(max_concurrent_commands, static_cast<size_t>(1))), m_running(0), m_failed(0)
+        {
+        }
+
+        // Returns the number of commands that failed.
+        size_t Run(const vector<string_t>& lines)
+        {
+            ProgressLine progress;
+
+            try
+            {
+                RunLines(lines);
+            }
+            catch (...)
+            {
+                JoinAll();
+                throw;
+            }
+
+            JoinAll();
+            return m_failed;
+        }
+
+    private:
+
+        struct Job
+        {
+            Job(const AzureFileContext& context)
+                : context(context), done(false)
+            {
+            }
+
+            AzureFileContext context;
+            vector<string_t> scopes;
+            thread worker;
+            bool done;
+        };
+
+        void RunLines(const vector<string_t>& lines)
+        {
+            for (auto& text : lines)
+            {
+                string_t line = Util::Trim(text);
+                string_t command;
+                istringstream_t iss(line);
+                iss >> command;
+
+                if (command.empty() || command[0] == _XPLATSTR('#'))
+                {
+                    continue;
+                }
+
+                if (command.compare(_XPLATSTR("exit")) == 0)
+                {
+                    break;
+                }
+
+                vector<shared_ptr<Job>> finished;
+
+                if (command.compare(_XPLATSTR("cd")) == 0)
+                {
+                    vector<string_t> target = CdScope(line);
+
+                    {
+                        unique_lock<mutex> lock(m_mutex);
+
+                        m_changed.wait(lock, [&]()
+                        {
+                            return !Overlaps(target);
+                        });
+
+                        finished = TakeFinished();
+                    }
+
+                    Join(finished);
+
+                    if (!Execute(CommandFactory::Create(line, m_context, m_file_system)))
+                    {
+                        ucout << _XPLATSTR("Script stopped: ") << line << _XPLATSTR(" failed") << endl;
+                        break;
+                    }
+
+                    continue;
+                }
+
+                shared_ptr<Job> job = make_shared<Job>(m_context);
+                job->scopes = Scopes(line);
+
+                {
+                    unique_lock<mutex> lock(m_mutex);
+
+                    m_changed.wait(lock, [&]()
+                    {
+                        return m_running < m_max_concurrent_commands && !Overlaps(job->scopes);
+                    });
+
+                    finished = TakeFinished();
+                    m_running++;
+                    m_jobs.push_back(job);
+                }
+
+                Join(finished);
+
+                try
+                {
+                    job->worker = thread([this, job, line]()
+                    {
+                        try
+                        {
+                            Execute(CommandFactory::Create(line, job->context, m_file_system));
+                        }
+                        catch (...)
+                        {
+                        }
+
+                        lock_guard<mutex> lock(m_mutex);
+                        job->done = true;
+                        m_running--;
+                        m_changed.notify_all();
+                    });
+                }
+                catch (...)
+                {
+                    lock_guard<mutex> lock(m_mutex);
+                    job->done = true;
+                    m_running--;
+                    throw;
+                }
+            }
+        }
+
+        // Removes the finished jobs, so neither their threads nor the overlap checks pile up over
+        // a long script. Called with the lock held; the caller joins them after releasing it.
+        vector<shared_ptr<Job>> TakeFinished()
+        {
+            auto running = partition(m_jobs.begin(), m_jobs.end(), [](const shared_ptr<Job>& job)
+            {
+                return !job->done;
+            });
+
+            vector<shared_ptr<Job>> finished(running, m_jobs.end());
+            m_jobs.erase(running, m_jobs.end());
+            return finished;
+        }
+
+        static void Join(const vector<shared_ptr<Job>>& jobs)
+        {
+            for (auto& job : jobs)
+            {
+                if (job->worker.joinable())
+                {
+                    job->worker.join();
+                }
+            }
+        }
+
+        // Waits for every command still running.
+        void JoinAll()
+        {
+            vector<shared_ptr<Job>> jobs;
+
+            {
+                lock_guard<mutex> lock(m_mutex);
+                jobs.swap(m_jobs);
+            }
+
+            Join(jobs);
+        }
+
+        // Returns whether the command succeeded.
+        bool Execute(const shared_ptr<ICommand>& command)
+        {
+            try
+            {
+                command->PreExecute();
+                command->Execute();
+                command->PostExecute();
+                return true;
+            }
+            catch (const std::exception& e)
+            {
+                ucout << e.what() << std::endl;
+
+                lock_guard<mutex> lock(m_mutex);
+                m_failed++;
+                return false;
+            }
+        }
+
+        // The remote directories a command line works in: the current directory, and every
+        // argument that names a remote path outside it, as a /share/path, a URL, a relative
+        // path climbing with "..", or a list written by find -out. Reading a local path as a
+        // share path only makes the command wait for more than it has to.
+        vector<string_t> Scopes(const string_t& line) const
+        {
+            vector<string_t> arguments = Util::Split(line, _XPLATSTR(" \t"));
+            vector<string_t> scopes(1, m_context.CurrentUri());
+
+            for (size_t i = 1; i < arguments.size(); i++)
+            {
+                const string_t& argument = arguments[i];
+
+                if (argument == _XPLATSTR("-from") && i + 1 < arguments.size())
+                {
+                    try
+                    {
+                        scopes.push_back(Resolve(RemoteFileList::Load(arguments[++i]).root));
+                    }
+                    catch (const std::exception&)
+                    {
+                        // The command reports the unreadable list itself.
+                    }
+                }
+                else if (Util::IsUrl(argument) || argument[0] == _XPLATSTR('/') || argument.find(_XPLATSTR("..")) != string_t::npos)
+                {
+                    scopes.push_back(Resolve(argument));
+                }
+            }
+
+            return scopes;
+        }
+
+        // The directory cd enters. Going up needs no wait, the parent exists.
+        vector<string_t> CdScope(const string_t& line) const
+        {
+            vector<string_t> arguments = Util::Split(line, _XPLATSTR(" \t"));
+
+            if (arguments.size() < 2 || arguments[1] == _XPLATSTR("..") || arguments[1] == _XPLATSTR("."))
+            {
+                return vector<string_t>();
+            }
+
+            return vector<string_t>(1, Combine(m_context.CurrentUri(), arguments[1]));
+        }
+
+        // A URL without its SAS, a /share/path from the account root, or a path relative to the
+        // current directory.
+        string_t Resolve(const string_t& path) const
+        {
+            if (Util::IsUrl(path))
+            {
+                return Util::UrlPath(path);
+            }
+
+            if (path[0] == _XPLATSTR('/'))
+            {
+                return Combine(m_context.FileClient().base_uri().primary_uri().to_string(), path);
+            }
+
+            return Combine(m_context.CurrentUri(), path);
+        }
+
+        // Appends the segments of a '/' path to a URL, applying "." and "..".
+        static string_t Combine(const string_t& base, const string_t& path)
+        {
+            string_t result = base;
+            size_t root = result.find(_XPLATSTR("://"));
+            size_t host = root == string_t::npos ? 0 : result.find(_XPLATSTR('/'), root + 3);
+
+            if (host == string_t::npos)
+            {
+                host = result.size();
+            }
+
+            while (result.size() > host && result.back() == _XPLATSTR('/'))
+            {
+                result.pop_back();
+            }
+
+            for (auto& part : Util::Split(path, _XPLATSTR("/")))
+            {
+                if (part == _XPLATSTR(".."))
+                {
+                    size_t slash = result.find_last_of(_XPLATSTR('/'));
+
+                    if (slash != string_t::npos && slash >= host)
+                    {
+                        result.erase(slash);
+                    }
+                }
+                else if (part != _XPLATSTR("."))
+                {
+                    result.append(1, _XPLATSTR('/'));
+                    result.append(part);
+                }
+            }
+
+            return result;
+        }
+
+        // True when a running command works in, above or below any of the directories.
+        bool Overlaps(const vector<string_t>& scopes) const
+        {
+            for (auto& job : m_jobs)
+            {
+                if (job->done)
+                {
+                    continue;
+                }
+
+                for (auto& scope : scopes)
+                {
+                    for (auto& other : job->scopes)
+                    {
+                        if (IsWithin(scope, other) || IsWithin(other, scope))
+                        {
+                            return true;
+                        }
+                    }
+                }
+            }
+
+            return false;
+        }
+
+        static bool IsWithin(const string_t& path, const string_t& root)
+        {
+            string_t prefix = root;
+
+            if (!prefix.empty() && prefix.back() == _XPLATSTR('/'))
+            {
+                prefix.pop_back();
+            }
+
+            return path.compare(0, prefix.size(), prefix) == 0
+                && (path.size() == prefix.size() || path[prefix.size()] == _XPLATSTR('/'));
+        }
+
+        AzureFileContext& m_context;
+        shared_ptr<IFileSystem> m_file_system;
+        size_t m_max_concurrent_commands;
+        mutex m_mutex;
+        condition_variable m_changed;
+        size_t m_running;
+        size_t m_failed;
+        vector<shared_ptr<Job>> m_jobs;
+    };
+}
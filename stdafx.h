@@ -5,17 +5,56 @@
 
 #pragma once
 
+#ifdef _WIN32
 #include "targetver.h"
+#endif
 
 #include <stdio.h>
-#include <tchar.h>
-
 
+#ifdef _WIN32
+#include <tchar.h>
+#include <io.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#endif
 
 // TODO: reference additional headers your program requires here
 #include <string>
-#include "cpprest\details\basic_types.h"
-#include "pplx\pplxtasks.h"
-#include "was\core.h"
-#include "was\storage_account.h"
-#include "was\file.h"
+#include <vector>
+#include <queue>
+#include <functional>
+#include <memory>
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+#include <stdexcept>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <set>
+#include <fstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <random>
+#include "cpprest/details/basic_types.h"
+#include "pplx/pplxtasks.h"
+#include "cpprest/containerstream.h"
+#include "cpprest/rawptrstream.h"
+#include "was/core.h"
+#include "was/storage_account.h"
+#include "was/file.h"